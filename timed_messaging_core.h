@@ -0,0 +1,195 @@
+#ifndef _TIMED_MESSAGING_CORE_H
+#define _TIMED_MESSAGING_CORE_H
+
+//Core of the message queue of a device file: storage accounting, the two-lock message list and the pending writes of the
+//delayed messages. The functions use only lists, spinlocks, atomics and timers, so the same code is built in the module, on top
+//of the kernel headers, and in userspace, on top of user/kernel_shim.h, where it can be tested and profiled without loading
+//the module. The includer provides the environment: this header includes nothing
+
+//core_reserve_storage accounts len bytes to storage if they fit limit. It returns false, leaving storage untouched, otherwise
+static inline bool core_reserve_storage(atomic_long_t *storage, long limit, size_t len) {
+	long storage_size = atomic_long_read(storage);
+
+	do {
+		if (storage_size + len > limit)
+			return false;
+	} while (!atomic_long_try_cmpxchg(storage, &storage_size, storage_size + len));
+
+	return true;
+}
+
+//core_release_storage gives back len bytes accounted by core_reserve_storage
+static inline void core_release_storage(atomic_long_t *storage, size_t len) {
+	atomic_long_sub(len, storage);
+}
+
+//core_reserve_slots reserves count slots of a store of capacity slots, whose slots in use are counted by reserved_slots. It
+//returns false, leaving reserved_slots untouched, if they don't fit
+static inline bool core_reserve_slots(atomic_t *reserved_slots, unsigned long capacity, int count) {
+	int reserved = atomic_read(reserved_slots);
+
+	do {
+		if (reserved + count > capacity)
+			return false;
+	} while (!atomic_try_cmpxchg(reserved_slots, &reserved, reserved + count));
+
+	return true;
+}
+
+//core_claim_reading claims one of the available readings of a queue. It returns false if there are none
+static inline bool core_claim_reading(atomic_t *available_readings) {
+	return atomic_dec_if_positive(available_readings) >= 0;
+}
+
+//core_link_tail appends a batch of count messages, ordered from the newest, to the incoming list of a two-lock queue and makes
+//them available. It is called with the tail lock held. The readings are published after the batch is linked, so a reader that
+//claims one of them finds the incoming list not empty
+static inline void core_link_tail(struct list_head *incoming, atomic_t *available_readings, struct list_head *batch, int count) {
+	list_splice(batch, incoming);
+	smp_mb__before_atomic();
+	atomic_add(count, available_readings);
+}
+
+//core_post_tail appends a batch of count messages, ordered from the newest, to the incoming list of a two-lock queue taking only
+//the tail lock, so the writers don't contend with the readers holding the head lock. If can_post is not NULL it is checked under
+//the tail lock, with data: if it returns false the batch is left untouched and false is returned
+static inline bool core_post_tail(spinlock_t *tail_lock, struct list_head *incoming, atomic_t *available_readings,
+		struct list_head *batch, int count, bool (*can_post)(void *data), void *data) {
+	spin_lock(tail_lock);
+	if (can_post != NULL && !can_post(data)) {
+		spin_unlock(tail_lock);
+		return false;
+	}
+	core_link_tail(incoming, available_readings, batch, count);
+	spin_unlock(tail_lock);
+	return true;
+}
+
+//core_drain_incoming moves the messages of the incoming list to the message list of a two-lock queue. They are newer than every
+//message of the list, so they go to its head. It is called with the head lock held, which is always taken before the tail lock
+static inline void core_drain_incoming(struct list_head *messages, struct list_head *incoming, spinlock_t *tail_lock) {
+	if (list_empty(incoming))
+		return;
+	spin_lock(tail_lock);
+	list_splice_init(incoming, messages);
+	spin_unlock(tail_lock);
+}
+
+//core_take_oldest moves the oldest message of a two-lock queue to the tail of batch and returns its link. message_to_read points
+//to the next message to read, NULL when the list has been emptied. The tail lock is taken only when the list is empty, so in the
+//common case a reader and a writer don't share any lock. It is called with the head lock held, after a reading has been claimed
+static inline struct list_head *core_take_oldest(struct list_head *messages, struct list_head *incoming, spinlock_t *tail_lock,
+		struct list_head **message_to_read, struct list_head *batch) {
+	struct list_head *oldest;
+
+	if (list_empty(messages))
+		core_drain_incoming(messages, incoming, tail_lock);
+
+	//New messages are always inserted after the head, so the oldest one is the previous of the head
+	if (*message_to_read == NULL)
+		*message_to_read = messages->prev;
+
+	oldest = *message_to_read;
+	*message_to_read = oldest->prev;
+	list_move_tail(oldest, batch);
+
+	if (list_empty(messages))
+		*message_to_read = NULL;
+	return oldest;
+}
+
+//core_next_handle returns the next handle of a device file. Handles are positive in an int, so a write and the result of an
+//io_uring completion can return them
+static inline u64 core_next_handle(u64 *next_handle) {
+	*next_handle = (*next_handle + 1) & INT_MAX;
+	if (*next_handle == 0)
+		*next_handle = 1;
+	return *next_handle;
+}
+
+//core_pending is the revocable part of a delayed message, embedded in the pending writes of the module and of the userspace
+//build: its links in the pending writes of its owner and in the handle index, and the timer that posts it
+struct core_pending {
+	struct list_head list;					//link in the pending writes of the owner
+	union {
+		struct timer_list timer;			//expires when the message has to be posted
+		struct hrtimer hrtimer;				//used instead of timer by the high resolution delays
+	};
+	bool is_high_resolution;				//true if the write is driven by hrtimer instead of timer
+	u64 handle;								//handle of the delayed message, 0 if it has none
+	struct hlist_node handle_link;			//link in the bucket of the handle index, unhashed when the write is no longer revocable
+};
+
+//core_link_pending links a new pending write to the pending writes of its owner and, if bucket is not NULL, indexes it in bucket,
+//the bucket of the handle index for the handle of the write. It is called with the lock of the pending writes held
+static inline void core_link_pending(struct core_pending *pending, struct list_head *pending_writes, struct hlist_head *bucket) {
+	INIT_LIST_HEAD(&(pending->list));
+	list_add(&(pending->list), pending_writes);
+	INIT_HLIST_NODE(&(pending->handle_link));
+	if (bucket != NULL)
+		hlist_add_head(&(pending->handle_link), bucket);
+}
+
+//core_find_pending returns the pending write with a handle from bucket, the bucket of the handle index for the handle, NULL if
+//it has already been posted or canceled. It is called with the lock of the pending writes held
+static inline struct core_pending *core_find_pending(struct hlist_head *bucket, u64 handle) {
+	struct core_pending *pending;
+
+	hlist_for_each_entry(pending, bucket, handle_link) {
+		if (pending->handle == handle)
+			return pending;
+	}
+	return NULL;
+}
+
+//core_stop_pending stops the timer of a pending write. It returns false if the timer already expired, that is the write is being
+//posted and it can't be revoked any more
+static inline bool core_stop_pending(struct core_pending *pending) {
+	if (pending->is_high_resolution)
+		return hrtimer_try_to_cancel(&(pending->hrtimer)) == 1;
+	return timer_delete(&(pending->timer));
+}
+
+//core_unlink_pending unlinks a pending write whose timer has been stopped, or has expired, from its owner and from the handle
+//index. It is called with the lock of the pending writes held
+static inline void core_unlink_pending(struct core_pending *pending) {
+	list_del_init(&(pending->list));
+	hlist_del_init(&(pending->handle_link));
+}
+
+//core_expire_pending is called when the timer of a pending write expires: the write is no longer revocable, so it is unlinked
+//taking the lock of the pending writes, and the caller posts its message. A cancel that holds the lock while the timer expires
+//fails to stop it, so the write is either canceled or posted, never both
+static inline void core_expire_pending(struct core_pending *pending, spinlock_t *pending_lock) {
+	spin_lock(pending_lock);
+	core_unlink_pending(pending);
+	spin_unlock(pending_lock);
+}
+
+//core_cancel_pending stops the timer of a pending write and, if the timer had not expired yet, unlinks the write, that the caller
+//then deallocates. It returns false if the write is already being posted. It is called with the lock of the pending writes held
+static inline bool core_cancel_pending(struct core_pending *pending) {
+	if (!core_stop_pending(pending))
+		return false;
+	core_unlink_pending(pending);
+	return true;
+}
+
+//core_revoke_pending cancels the pending writes of a list whose timers have not expired yet, passing each canceled write to
+//dispose with data, and returns their number. It is called with the lock of the pending writes held
+static inline int core_revoke_pending(struct list_head *pending_writes, void (*dispose)(struct core_pending *pending, void *data),
+		void *data) {
+	struct core_pending *pending;
+	struct core_pending *temp_pending;
+	int canceled = 0;
+
+	list_for_each_entry_safe(pending, temp_pending, pending_writes, list) {
+		if (!core_cancel_pending(pending))
+			continue;
+		dispose(pending, data);
+		canceled++;
+	}
+	return canceled;
+}
+
+#endif
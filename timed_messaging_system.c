@@ -7,8 +7,39 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/ioprio.h>
+#include <linux/refcount.h>
+#include <linux/seqlock.h>
+#include <linux/highmem.h>
+#include <linux/bvec.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#endif
+#include "timed_messaging_core.h"
 #include "timed_messaging_system.h"
 
+#define CREATE_TRACE_POINTS
+#include "timed_messaging_system_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tommaso Villa");
 MODULE_DESCRIPTION("The module allows the communication across thread through a timed messaging system");
@@ -21,6 +52,23 @@ MODULE_DESCRIPTION("The module allows the communication across thread through a
 #define get_minor(session)	MINOR(session->f_dentry->d_inode->i_rdev)
 #endif
 
+//get_channel returns the channel of the session opened on a file
+#define get_channel(file)	(((struct session*)((file)->private_data))->minor)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_delete(timer)	del_timer(timer)
+#define timer_delete_sync(timer)	del_timer_sync(timer)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+#define hrtimer_setup(timer, callback, clock, mode)	\
+	do { hrtimer_init(timer, clock, mode); (timer)->function = callback; } while (0)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+#define from_timer(var, timer, field)	timer_container_of(var, timer, field)
+#endif
+
 
 //The manipulation of module parameters is allowed only for owner user and for the user group he belongs to.
 static int max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
@@ -31,28 +79,160 @@ static int max_storage_size = DEFAULT_MAX_STORAGE_SIZE;
 module_param(max_storage_size, int, 0660);
 MODULE_PARM_DESC(max_storage_size, "The maximum storage size for all messages posted on a device file");
 
+//Priorities of the messages. A message of a level can use the storage of the device file except the bytes reserved to the higher
+//levels, so the bulk traffic can't crowd out the control messages
+static int priority_reservation[PRIORITY_LEVELS];
+module_param_array(priority_reservation, int, NULL, 0660);
+MODULE_PARM_DESC(priority_reservation, "Bytes of max_storage_size usable only by each priority level and the levels above it (list of values, from level 0)");
+
+static int priority_aging_ms = 0;
+module_param(priority_aging_ms, int, 0660);
+MODULE_PARM_DESC(priority_aging_ms, "Milliseconds after which a message is read before the messages of higher priority (0 = disabled)");
+
+//The queue engine is chosen when the module is installed, so it can only be read at runtime
+static int queue_engine = DEFAULT_QUEUE_ENGINE;
+module_param(queue_engine, int, 0440);
+MODULE_PARM_DESC(queue_engine, "The engine used to queue the messages of a device file (0 = mutex protected list, 1 = lock-free ring)");
+
+//In arena mode each channel preallocates the storage of its messages when it is created, so the writes and the reads don't
+//allocate memory. It is chosen when the module is installed, so it can only be read at runtime
+static bool message_arena = false;
+module_param(message_arena, bool, 0440);
+MODULE_PARM_DESC(message_arena, "Preallocate for each device file a slot for each max_message_size bytes of max_storage_size, and store the messages there");
+
+//With the direct handoff a writer gives the message straight to the reader that has been waiting for longest, so the reader
+//doesn't have to race with the other readers for it. It is used by the device files with the list engine and the FIFO ordering
+static bool reader_handoff = false;
+module_param(reader_handoff, bool, 0660);
+MODULE_PARM_DESC(reader_handoff, "Hand the posted messages directly to the blocked readers, in the order they started waiting");
+
+//The AUDIT printk are behind a static key, so while they are disabled they cost a not taken jump. The key is switched through
+//the audit parameter
+DEFINE_STATIC_KEY_FALSE(audit_enabled);
+
+static int set_audit(const char *value, const struct kernel_param *kp) {
+	bool enabled;
+	int outcome;
+
+	outcome = kstrtobool(value, &enabled);
+	if (outcome)
+		return outcome;
+
+	if (enabled)
+		static_branch_enable(&audit_enabled);
+	else
+		static_branch_disable(&audit_enabled);
+	return 0;
+}
+
+static int get_audit(char *buffer, const struct kernel_param *kp) {
+	return sprintf(buffer, "%c\n", static_key_enabled(&audit_enabled) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops audit_ops = {
+	.set = set_audit,
+	.get = get_audit,
+};
+module_param_cb(audit, &audit_ops, NULL, 0660);
+MODULE_PARM_DESC(audit, "Log every operation on the device files through printk (disabled by default, use the tracepoints instead)");
+
+
+//The number of minors reserved for the device driver. A channel is allocated only when its device file is opened
+static int max_channels = DEFAULT_MAX_CHANNELS;
+module_param(max_channels, int, 0440);
+MODULE_PARM_DESC(max_channels, "The maximum number of device files (minor numbers) of the device driver");
 
 static int major_number; 
-static struct minor minors[MAX_MINOR_NUMBER];
+
+//Table of the channels, indexed by minor number. Lookups are lockless under RCU, insertions and removals take the lock of the
+//table
+static DEFINE_XARRAY(channels);
+static struct minor *open_channel(int minor_number, int node);
+static void put_channel(struct minor *minor, int count);
+static int purge_expired(struct minor *minor, bool full);
+static void leave_broadcast(struct minor *minor, struct session *session);
+static void post_broadcast(struct minor *minor, struct list_head *batch, int count);
+static void copy_message_to_buffer(struct message *message, char *buffer);
+static void wake_uring_reads(struct minor *minor, int count);
+static void put_flow(struct flow *flow);
+
+//Slab caches for immediate and delayed messages. Their objects have room for the max_message_size set when the module is
+//installed, up to MAX_INLINE_PAYLOAD_SIZE
+static struct kmem_cache *message_cache;
+static struct kmem_cache *pending_write_cache;
+static size_t inline_payload_size;
+
+//Module-wide engine for delayed writes: the timers of the pending writes move them on expired_writes, then the delivery work
+//posts them on their device files
+static struct workqueue_struct *delivery_workqueue;
+static LLIST_HEAD(expired_writes);
+static void deliver_expired_writes(struct work_struct *work);
+static DECLARE_WORK(delivery_work, deliver_expired_writes);
+
+//The reaper drops the expired messages of all the device files every ttl_reap_ms milliseconds
+static int ttl_reap_ms = DEFAULT_TTL_REAP_MS;
+module_param(ttl_reap_ms, int, 0660);
+MODULE_PARM_DESC(ttl_reap_ms, "Period in milliseconds of the scan that drops the expired messages (0 = expired messages are dropped only when met)");
+static void reap_expired_messages(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reaper_work, reap_expired_messages);
+static atomic_t ttl_channels = ATOMIC_INIT(0);		//channels with ttl_used, the reaper runs only while there are any
+
+//Root of the debugfs directories of the device files
+static struct dentry *debugfs_root;
+
+//The statistics are updated on the copy of the current CPU
+#define stats_inc(minor, field)	this_cpu_inc((minor)->stats->field)
+#define stats_add(minor, field, value)	this_cpu_add((minor)->stats->field, value)
 
 
 static int dev_open(struct inode *inode, struct file *file) {
 
 	struct session *new_session;
+	struct minor *minor;
 	int minor_number = get_minor(file);
 
 	//A new session for the given minor is created and linked to the others
 	new_session = kmalloc(sizeof(struct session), GFP_KERNEL);
+	if (new_session == NULL)
+		return -ENOMEM;
+
+	//The arena of a new channel goes on the node of the session that opens it, if the session reads
+	minor = open_channel(minor_number, (file->f_mode & FMODE_READ) ? numa_node_id() : NUMA_NO_NODE);
+	if (minor == NULL) {
+		kfree(new_session);
+		AUDIT
+		printk("%s: Open aborted on device [%d,%d]: not enough memory for the channel\n", MODULE_NAME, major_number, minor_number);
+		return -ENOMEM;
+	}
+
+	new_session->minor = minor;
 	new_session->send_timeout = DEFAULT_SEND_TIMEOUT;
 	new_session->recv_timeout = DEFAULT_RECV_TIMEOUT;
-	new_session->workqueue = alloc_workqueue("pending_writes", WQ_MEM_RECLAIM, 0);
+	new_session->send_timeout_ns = 0;
+	new_session->recv_timeout_ns = 0;
+	new_session->send_timeout_is_deadline = false;
+	new_session->recv_timeout_is_deadline = false;
+	new_session->shared_ring_mapped = false;
+	new_session->send_tag = 0;
+	new_session->send_priority = 0;
+	new_session->write_timeout_ns = 0;
+	new_session->write_timeout_is_deadline = false;
+	new_session->message_ttl = 0;
+	new_session->message_ttl_is_deadline = false;
+	new_session->filter_tag = 0;
+	new_session->filter_mask = 0;
+	new_session->is_subscriber = (file->f_mode & FMODE_READ) != 0;
+	new_session->write_handles = false;
+	new_session->flow = NULL;
+	new_session->cursor = NULL;
 	mutex_init(&(new_session->session_mutex));
+	seqcount_mutex_init(&(new_session->timeouts_seq), &(new_session->session_mutex));
 	INIT_LIST_HEAD(&new_session->list);
 	INIT_LIST_HEAD(&new_session->pending_writes);
 
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
-	list_add(&new_session->list, &minors[minor_number].sessions);
-  	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	spin_lock(&(minor->operation_synchronizer));
+	list_add(&new_session->list, &minor->sessions);
+  	spin_unlock(&(minor->operation_synchronizer));
 
 	//The pointer to the just created session is stored in private_data field of file struct
 	file->private_data = new_session;
@@ -67,20 +247,29 @@ static int dev_open(struct inode *inode, struct file *file) {
 static int dev_release(struct inode *inode, struct file *file) {
 
  	struct session *current_session;
+	struct minor *minor = get_channel(file);
 	int minor_number = get_minor(file);
 
 	current_session = (struct session*)(file->private_data);
 
-	//The session to close is removed from the list of sessions of device file
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
+	//The session to close is removed from the list of sessions of device file. In broadcast mode it stops being a subscriber, so
+	//the messages it did not read can be freed
+	spin_lock(&(minor->operation_synchronizer));
+	leave_broadcast(minor, current_session);
 	list_del(&(current_session->list));
-	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	spin_unlock(&(minor->operation_synchronizer));
+
+	//The pending writes of the session are not waited: they are moved on the orphan writes of the device file, so they are
+	//still posted when their timers expire
+	spin_lock_bh(&(minor->pending_lock));
+	list_splice_init(&(current_session->pending_writes), &(minor->orphan_writes));
+	spin_unlock_bh(&(minor->pending_lock));
 
-	//The completation of works in the workqueue is waited before to destroy the workqueue and to deallocate the session. 
-	//Warning: the works inserted in the workqueue after the invocation of these function will be not executed
-	flush_workqueue(current_session->workqueue);
-	destroy_workqueue(current_session->workqueue);
+	//The flow of the session lives on while its messages are queued
+	if (current_session->flow != NULL)
+		put_flow(current_session->flow);
 	kfree(current_session);
+	put_channel(minor, 1);
 
 	AUDIT
 	printk("%s: Close on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
@@ -89,428 +278,4171 @@ static int dev_release(struct inode *inode, struct file *file) {
 }
 
 
-//enqueue_message is the function called when the timer for a delayed write expires. Using the pointer to work_struct is possible obtain
-//the delayed_work that contains the work_struct and the pending_write that contains the delayed_work.
-static void enqueue_message(struct work_struct *work){
+//ring_init allocates the slots of the ring. As for the arena, the capacity is a slot for each max_message_size bytes of
+//max_storage_size, rounded up to a power of two: with smaller messages the ring can fill up before the storage of the device file
+//does, and the writers then wait as for a full storage
+static int ring_init(struct message_ring *ring) {
+	unsigned long i;
 
-	struct pending_write *pending_write;
-	struct delayed_work *delayed_work;
-	struct message *new_message;
-	int minor_number;
+	ring->capacity = roundup_pow_of_two(max(max_storage_size / max(max_message_size, 1), 2));
+	ring->slots = kvcalloc(ring->capacity, sizeof(struct ring_slot), GFP_KERNEL);
+	if (ring->slots == NULL)
+		return -ENOMEM;
 
-	delayed_work = container_of(work, struct delayed_work, work);
-	pending_write = container_of(delayed_work, struct pending_write, delayed_work);
-	new_message = &(pending_write->message);
-	minor_number = pending_write->minor_number;
+	for (i = 0; i < ring->capacity; i++)
+		atomic_long_set(&(ring->slots[i].sequence), i);
+	atomic_long_set(&(ring->head), 0);
+	atomic_long_set(&(ring->tail), 0);
+	atomic_set(&(ring->reserved_slots), 0);
 
-	//The message is effectly posted, the number of available readings is updated and eventually a sleeping reader is awaked 
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
-	list_add(&(new_message->list), &(minors[minor_number].messages));
-	minors[minor_number].available_readings += 1;
-	wake_up(&(minors[minor_number].pending_readers_wq));
-	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	return 0;
+}
 
-	AUDIT
-	printk("%s: Deferred write completed on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+//ring_enqueue claims the tail position and publishes the message in its slot. It returns false if the slot at the tail has not
+//been released yet by a reader. The preemption is disabled between the claim and the publication, so a reader waiting for the
+//slot only spins for a few instructions
+static bool ring_enqueue(struct message_ring *ring, struct message *message) {
 
-	return;	
-}
+	struct ring_slot *slot;
+	long position;
+	long difference;
+	bool enqueued = false;
 
+	preempt_disable();
+	position = atomic_long_read(&(ring->tail));
+	while (true) {
+		slot = &(ring->slots[position & (ring->capacity - 1)]);
+		difference = atomic_long_read_acquire(&(slot->sequence)) - position;
 
-static ssize_t dev_write(struct file *file, const char *buff, size_t len, loff_t *off) {
+		if (difference == 0) {
+			if (atomic_long_try_cmpxchg(&(ring->tail), &position, position + 1)) {
+				enqueued = true;
+				break;
+			}
+		} else if (difference < 0) {
+			//The slot still holds a message of the previous lap
+			break;
+		} else {
+			position = atomic_long_read(&(ring->tail));
+		}
+	}
 
-	struct session *current_session;
-	struct message *new_message;
-	struct pending_write *pending_write;
-	int minor_number = get_minor(file);
-	int unwritten_chars;
-	int send_timeout;
+	if (enqueued) {
+		slot->message = message;
+		atomic_long_set_release(&(slot->sequence), position + 1);
+	}
+	preempt_enable();
 
-	AUDIT
-	printk("%s: Write called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+	return enqueued;
+}
 
-	//Check if the size of message is too large
-	if (len > max_message_size) {
-		AUDIT
-		printk("%s: Write aborted on device [%d,%d]: too long message\n", MODULE_NAME, major_number, minor_number);
-		return -1;	
-	}		
+//ring_dequeue claims the head position and takes the message in its slot. It returns NULL if the slot at the head has not been
+//published yet by a writer
+static struct message *ring_dequeue(struct message_ring *ring) {
 
-	//Check if the total size of messages in the device file is too large
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
-	if (minors[minor_number].storage_size + len > max_storage_size){
-		mutex_unlock(&(minors[minor_number].operation_synchronizer));
-		AUDIT
-		printk("%s: Write aborted on device [%d,%d]: not enough space for storing message\n", MODULE_NAME, major_number, minor_number);
-		return -1;	
-	}
+	struct ring_slot *slot;
+	struct message *message = NULL;
+	long position;
+	long difference;
 
-	//If the write can occur, the storage size of the device file is updated
-	minors[minor_number].storage_size = minors[minor_number].storage_size + len;
-	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	preempt_disable();
+	position = atomic_long_read(&(ring->head));
+	while (true) {
+		slot = &(ring->slots[position & (ring->capacity - 1)]);
+		difference = atomic_long_read_acquire(&(slot->sequence)) - (position + 1);
 
-	//The new message is created 
-	new_message = kmalloc(sizeof(struct message), GFP_KERNEL);
-	new_message->text = kmalloc(len, GFP_KERNEL);
-	new_message->size = len;
-	new_message->is_delayed = false;
-	unwritten_chars = copy_from_user(new_message->text, buff, len);
-	INIT_LIST_HEAD(&(new_message->list));
+		if (difference == 0) {
+			if (atomic_long_try_cmpxchg(&(ring->head), &position, position + 1)) {
+				message = slot->message;
+				atomic_long_set_release(&(slot->sequence), position + ring->capacity);
+				break;
+			}
+		} else if (difference < 0) {
+			break;
+		} else {
+			position = atomic_long_read(&(ring->head));
+		}
+	}
+	preempt_enable();
 
-	//Checking if the message has to be immediatly posted or not
-	current_session = (struct session*)(file->private_data);
-	mutex_lock(&(current_session->session_mutex));
-	send_timeout = current_session->send_timeout;
-	mutex_unlock(&(current_session->session_mutex));
+	return message;
+}
 
-	if (send_timeout == 0){
+//shard_storage returns the storage counter of a shard, or the one of the device file for SHARD_NONE
+static atomic_long_t *shard_storage(struct minor *minor, int shard) {
+	if (shard == SHARD_NONE)
+		return &(minor->storage_size);
+	return &(per_cpu_ptr(minor->shards, shard)->storage_size);
+}
 
-		//The message is immediatly posted, the number of available readings is updated and eventually a sleeping reader is awaked
-		mutex_lock(&(minors[minor_number].operation_synchronizer));
-		list_add(&(new_message->list), &(minors[minor_number].messages));
-		minors[minor_number].available_readings += 1;
-		wake_up(&(minors[minor_number].pending_readers_wq));
-		mutex_unlock(&(minors[minor_number].operation_synchronizer));
+//storage_limit returns the bytes of storage usable by the messages of a priority level, that is max_storage_size without the
+//reservations of the higher levels
+static long storage_limit(int priority) {
+	long limit = max_storage_size;
+	int level;
 
-		AUDIT
-		printk("%s: Write done on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+	for (level = priority + 1; level < PRIORITY_LEVELS; level++)
+		limit -= READ_ONCE(priority_reservation[level]);
+	return limit;
+}
 
-		return len - unwritten_chars;
+//reserve_storage accounts len bytes to the storage of the device file for count messages of priority, and count slots of the
+//ring when the ring engine is used. With the per-producer orderings the bytes are accounted to the shard of the writer instead, and each shard
+//has its own max_storage_size. In arena mode count slots of the arena are reserved too, whatever the shard, and they are given
+//back when the messages are freed. It returns false if the messages don't fit. The accounting is done with atomic operations, so
+//it doesn't need any lock
+static bool reserve_storage(struct minor *minor, int shard, int priority, size_t len, int count) {
 
-	} else {
+	bool uses_ring = shard == SHARD_NONE && minor->engine == QUEUE_ENGINE_RING;
 
-		//The message posting is deferred
-		pending_write = kmalloc(sizeof(struct pending_write), GFP_KERNEL);
-		pending_write->minor_number = minor_number;
-		INIT_LIST_HEAD(&(pending_write->list));
-
-		//The message is copied into a pending_message struct, so the original message can be deallocated
-		//NB: the field text of message can't be deallocated until the read occurs
-		new_message->is_delayed = true;
-		pending_write->message = *(new_message);
-		kfree(new_message);		
-
-		INIT_DELAYED_WORK(&(pending_write->delayed_work), enqueue_message);
-
-		mutex_lock(&(current_session->session_mutex));
-		list_add(&(pending_write->list), &(current_session->pending_writes));
-		queue_delayed_work(current_session->workqueue, &(pending_write->delayed_work), current_session->send_timeout);
-		mutex_unlock(&(current_session->session_mutex));
-	
-		AUDIT
-		printk("%s: Write deferred on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+	if (!core_reserve_storage(shard_storage(minor, shard), storage_limit(priority), len))
+		return false;
 
-		return 0;
+	if (uses_ring && !core_reserve_slots(&(minor->ring.reserved_slots), minor->ring.capacity, count)) {
+		core_release_storage(shard_storage(minor, shard), len);
+		return false;
+	}
+
+	if (minor->arena != NULL && !core_reserve_slots(&(minor->arena->reserved_slots), minor->arena->capacity, count)) {
+		if (uses_ring)
+			atomic_sub(count, &(minor->ring.reserved_slots));
+		core_release_storage(shard_storage(minor, shard), len);
+		return false;
 	}
 
+	return true;
 }
 
-static ssize_t dev_read(struct file *file, char *buff, size_t len, loff_t *off) {
+//release_storage gives back the storage accounted by reserve_storage for count messages of len bytes in total. The threads polling
+//for room in the storage are woken up
+static void release_storage(struct minor *minor, int shard, size_t len, int count) {
+	core_release_storage(shard_storage(minor, shard), len);
+	if (shard == SHARD_NONE && minor->engine == QUEUE_ENGINE_RING)
+		atomic_sub(count, &(minor->ring.reserved_slots));
 
-	struct pending_read *pending_read = NULL;
-	struct session *current_session;
-	struct message *message_to_read;
-	int unread_chars;
-	int minor_number = get_minor(file);
-	long recv_timeout;
-	int wait_outcome;
+	if (wq_has_sleeper(&(minor->pending_writers_wq)))
+		wake_up(&(minor->pending_writers_wq));
+}
 
-	AUDIT
-	printk("%s: Read called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+//session_flow returns the flow of a session, allocating it if the session has none and create is true: the flow is needed by a
+//quota, a weight or a write with ORDERING_FAIR, so the other sessions never allocate it. It returns NULL if the session has no
+//flow, or if the allocation fails
+static struct flow *session_flow(struct session *session, bool create) {
+	struct flow *flow = READ_ONCE(session->flow);
 
-	//Checking if the read has to be blocking or not
-	current_session = (struct session*)(file->private_data);
-	mutex_lock(&(current_session->session_mutex));
-	recv_timeout = current_session->recv_timeout;
-	mutex_unlock(&(current_session->session_mutex));
+	if (flow != NULL || !create)
+		return flow;
 
-	//Checking if on the device there are available messages
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
-	if (minors[minor_number].available_readings == 0){
-		mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	flow = kmalloc(sizeof(struct flow), GFP_KERNEL);
+	if (flow == NULL)
+		return NULL;
+	INIT_LIST_HEAD(&(flow->messages));
+	INIT_LIST_HEAD(&(flow->active_link));
+	flow->deficit = 0;
+	flow->weight = 1;
+	flow->quota = 0;
+	atomic_long_set(&(flow->storage_size), 0);
+	refcount_set(&(flow->references), 1);
 
-		if (recv_timeout == 0) {
-			//Non blocking read
+	//Concurrent writes and ioctls of the session install a single flow
+	mutex_lock(&(session->session_mutex));
+	if (session->flow == NULL) {
+		WRITE_ONCE(session->flow, flow);
+		flow = NULL;
+	}
+	mutex_unlock(&(session->session_mutex));
 
-			AUDIT
-			printk("%s: Read aborted on device [%d,%d]: not messages to read\n", MODULE_NAME, major_number, minor_number);
-			return -1;
+	kfree(flow);
+	return READ_ONCE(session->flow);
+}
 
-		} else {
-			//Blocking read
-		
-			//A pending_reading struct is allocated and linked whit the other pending readings for the device file.
-			//That list will be used in case of invocation of dev_flush()
-			pending_read = kmalloc(sizeof(struct pending_read), GFP_KERNEL);
-			pending_read -> is_flushed = false;
-			INIT_LIST_HEAD(&(pending_read->list));
+//put_flow drops a reference to a flow, freeing it with the last one
+static void put_flow(struct flow *flow) {
+	if (refcount_dec_and_test(&(flow->references)))
+		kfree(flow);
+}
 
-			mutex_lock(&(minors[minor_number].operation_synchronizer));
-			list_add(&(pending_read->list), &(minors[minor_number].pending_readings));
-			mutex_unlock(&(minors[minor_number].operation_synchronizer));
-
-
-			while(true){
-				//The thread sleeps on the waitqueue associated whit the device file.
-				//It can be woken up if the condition becames true or timeout expires
-				wait_outcome = wait_event_timeout(minors[minor_number].pending_readers_wq,
-									minors[minor_number].available_readings > 0 || pending_read->is_flushed, recv_timeout);
-				
-				if (wait_outcome == 0){
-					//Timer expired before wait condition changes: the reading is canceled
-
-					mutex_lock(&(minors[minor_number].operation_synchronizer));
-					list_del(&(pending_read->list));
-					mutex_unlock(&(minors[minor_number].operation_synchronizer));
-					kfree(pending_read);
-
-					AUDIT
-					printk("%s: Read aborted on device [%d,%d]: not messages to read after timeout expiration\n", 
-						MODULE_NAME, major_number, minor_number);
-					return -1;
-				} 
-				
-				//If the thread reachs this point of code it means the condition changes before timer expiration.
-				//However, to prevent race condition due to concurring awakes, the condition is checked again
-
-				if (pending_read->is_flushed){
-					//Another thread invoked flush on the device file
-
-					mutex_lock(&(minors[minor_number].operation_synchronizer));
-					list_del(&(pending_read->list));
-					mutex_unlock(&(minors[minor_number].operation_synchronizer));
-					kfree(pending_read);
-
-					AUDIT
-					printk("%s: Read aborted on device [%d,%d]: another process calls flush()\n", 
-						MODULE_NAME, major_number, minor_number);
-					return -1;
-				}
+//charge_flow accounts len bytes to the storage of a flow if they fit its quota. It returns false if they don't; a NULL flow has
+//nothing to account. The messages of a flow are charged before the storage of the device file is reserved, so a session over
+//its quota never waits for room in the storage
+static bool charge_flow(struct flow *flow, size_t len) {
+	long quota;
+
+	if (flow == NULL)
+		return true;
+	quota = READ_ONCE(flow->quota);
+	return core_reserve_storage(&(flow->storage_size), quota != 0 ? quota : LONG_MAX, len);
+}
 
-				mutex_lock(&(minors[minor_number].operation_synchronizer));	
+//uncharge_flow gives back len bytes accounted by charge_flow
+static void uncharge_flow(struct flow *flow, size_t len) {
+	if (flow != NULL)
+		core_release_storage(&(flow->storage_size), len);
+}
 
-				if (minors[minor_number].available_readings == 0){
-					mutex_unlock(&(minors[minor_number].operation_synchronizer));
-					//The condition is evalued as false again. The wait_event_timeout returns the residual jiffies so the
-					//the thread returns to sleep but whit a different timeout				
-					recv_timeout = recv_timeout - wait_outcome;
+//attach_flow hands the bytes charged to a flow for a message to the message: they are given back, with the reference taken here,
+//when the message is freed
+static void attach_flow(struct message *message, struct flow *flow) {
+	if (flow == NULL)
+		return;
+	refcount_inc(&(flow->references));
+	message->flow = flow;
+}
 
-				} else {
-					//The condition is verified, so the reading can occur. 
-					//NB: here the thread still has the lock on device file
-					break;
-				}
+//writer_flow returns the flow the messages written by a session are charged to, NULL if the session has none. With ORDERING_FAIR
+//the messages are queued on the flows, so the flow is allocated if needed: it returns ERR_PTR(-ENOMEM) if it can't be
+static struct flow *writer_flow(struct minor *minor, struct session *session) {
+	struct flow *flow;
+
+	if (READ_ONCE(minor->ordering) != ORDERING_FAIR)
+		return session_flow(session, false);
+	flow = session_flow(session, true);
+	return flow != NULL ? flow : ERR_PTR(-ENOMEM);
+}
+
+//wake_readers wakes up the readers sleeping on the device file for count new messages. The blocked readers wait exclusively, in
+//the order they started waiting, so each message wakes up at most one of them; the waits of poll() and SHARED_RING_WAIT are not
+//exclusive and they are always woken up
+static void wake_readers(struct minor *minor, int count) {
+	if (wq_has_sleeper(&(minor->pending_readers_wq)))
+		wake_up_nr(&(minor->pending_readers_wq), count);
+	wake_uring_reads(minor, count);
+}
+
+//post_on_shards queues a batch of messages on the shards they were written on. The batch is walked from the oldest message and
+//the lock of a shard is taken once for each run of messages of the same shard. The readers are woken up only if there are
+//sleepers, so the writers on different CPUs share no cache line
+static void post_on_shards(struct minor *minor, struct list_head *batch) {
+
+	struct message *message;
+	struct message *temp_message;
+	struct message_shard *shard = NULL;
+	int total = 0;
+	int count = 0;
+
+	list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+		if (shard != per_cpu_ptr(minor->shards, message->shard)) {
+			if (shard != NULL) {
+				atomic_add(count, &(shard->available_readings));
+				spin_unlock(&(shard->lock));
 			}
-		}			
-	}
+			shard = per_cpu_ptr(minor->shards, message->shard);
+			count = 0;
+			spin_lock(&(shard->lock));
+		}
 
-	minors[minor_number].available_readings -= 1;
-	
-	//The pending_read struct is removed from the list in the device file and it is deallocated
-	if (pending_read != NULL) {
-		list_del(&(pending_read->list));
-		kfree(pending_read);
+		if (list_empty(&(shard->messages)))
+			WRITE_ONCE(shard->head_queued_at, message->queued_at);
+		list_move_tail(&(message->list), &(shard->messages));
+		count++;
+		total++;
 	}
-
-	if (minors[minor_number].message_to_read == NULL){
-	//The read operation is invoked for the first time or after the message list has been emptied. In the message list new message are 
-	//always inserted after the head. So in this case the message to read is the previous respect the head.
-		minors[minor_number].message_to_read = minors[minor_number].messages.prev;	
+	if (shard != NULL) {
+		atomic_add(count, &(shard->available_readings));
+		spin_unlock(&(shard->lock));
 	}
 
-	//The read occurs here: the pointer to next message to read is updated and the total size of storage for device file is updated too
-	message_to_read = list_entry(minors[minor_number].message_to_read, struct message, list);
-	if (message_to_read->size < len){
-		len = strlen(message_to_read->text);	
+	wake_readers(minor, total);
+}
+
+//level_queue returns the queue of the messages of a priority level with the list engine: the message list of the device file for
+//level 0, a priority queue for the others. Like the message list, each queue has the newest message at the head
+static struct list_head *level_queue(struct minor *minor, int level) {
+	if (level == 0)
+		return &(minor->messages);
+	return &(minor->priority_queues[level - 1]);
+}
+
+//queue_prioritized moves the messages of a batch with a priority to the queue of their level, from the oldest. The others are
+//left in the batch. It is called with the lock of the device file held
+static void queue_prioritized(struct minor *minor, struct list_head *batch) {
+	struct message *message;
+	struct message *temp_message;
+
+	list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+		if (message->priority != 0) {
+			list_move(&(message->list), level_queue(minor, message->priority));
+			__set_bit(message->priority, &(minor->priority_bitmap));
+		}
 	}
-	unread_chars = copy_to_user(buff, message_to_read->text, len);
-	minors[minor_number].message_to_read = message_to_read->list.prev;
-	minors[minor_number].storage_size = minors[minor_number].storage_size - message_to_read->size;
-	list_del(&(message_to_read->list));
+}
+
+//priority_level returns the level the next message is read from with the list engine: the highest level with messages, found
+//with a single bit scan. With priority_aging_ms the lower levels are checked first, and a level whose oldest message is older
+//than the aging is chosen instead, so the bulk traffic is not starved. It is called with the lock of the device file held
+static int priority_level(struct minor *minor) {
+
+	unsigned long bitmap = minor->priority_bitmap;
+	int aging_ms = READ_ONCE(priority_aging_ms);
+	ktime_t aged;
+	int highest;
+	int level;
+
+	if (bitmap == 0)
+		return 0;
+	highest = __fls(bitmap);
+	if (aging_ms <= 0)
+		return highest;
 
-	if (list_empty(&(minors[minor_number].messages))){
-		minors[minor_number].message_to_read = NULL;
+	aged = ktime_sub(ktime_get(), ms_to_ktime(aging_ms));
+	if (!list_empty(&(minor->messages)) &&
+			ktime_before(list_last_entry(&(minor->messages), struct message, list)->queued_at, aged))
+		return 0;
+	for_each_set_bit(level, &bitmap, highest) {
+		if (ktime_before(list_last_entry(level_queue(minor, level), struct message, list)->queued_at, aged))
+			return level;
 	}
+	return highest;
+}
 
-	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+//remove_message unlinks a message of the list engine from the queue of its level, keeping the pointer to the next message to read
+//and the bitmap of the priority levels. It is called with the lock of the device file held
+static void remove_message(struct minor *minor, struct message *message) {
 
-	
-	//If the message was delayed the pending_message struct is deallocated, otherwise the message is deallocated
-	if (message_to_read->is_delayed){
-		struct pending_write *pending_write_to_delete;
-		pending_write_to_delete = container_of(message_to_read, struct pending_write, message);
-
-		//Pending write struct is also removed from the list associated whit the session
-		mutex_lock(&(current_session->session_mutex));
-		list_del(&(pending_write_to_delete->list));
-		mutex_unlock(&(current_session->session_mutex));
-	
-		kfree(pending_write_to_delete->message.text);
-		kfree(pending_write_to_delete);
+	if (minor->message_to_read == &(message->list))
+		minor->message_to_read = message->list.prev == &(minor->messages) ? NULL : message->list.prev;
+	list_del_init(&(message->tag_link));
+	list_del(&(message->list));
+	if (message->priority != 0 && list_empty(level_queue(minor, message->priority)))
+		__clear_bit(message->priority, &(minor->priority_bitmap));
+}
 
-	} else {
-		kfree(message_to_read->text);
-		kfree(message_to_read);
+//tag_bucket returns the bucket of the tag index of the device file where the messages with tag are linked
+static struct list_head *tag_bucket(struct minor *minor, u64 tag) {
+	return &(minor->tag_index[hash_64(tag, TAG_HASH_BITS)]);
+}
+
+//index_messages links the tagged messages of a batch in the tag index of the device file. Like the message list, each bucket
+//has the newest message at the head. It is called with the lock of the device file held; the filtered readers sleeping on the
+//device file are woken up by the wake up of the post through tag_sequence
+static void index_messages(struct minor *minor, struct list_head *batch) {
+	struct message *message;
+	bool tagged = false;
+
+	list_for_each_entry_reverse(message, batch, list) {
+		if (message->tag != 0) {
+			list_add(&(message->tag_link), tag_bucket(minor, message->tag));
+			tagged = true;
+		}
 	}
+	if (tagged)
+		WRITE_ONCE(minor->tag_sequence, minor->tag_sequence + 1);
+}
 
-	AUDIT	
-	printk("%s: Read done on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+//drain_incoming moves the messages posted under the tail lock to the message list of the device file. It is called with the lock
+//of the device file held, which is always taken before the tail lock
+static void drain_incoming(struct minor *minor) {
+	core_drain_incoming(&(minor->messages), &(minor->incoming), &(minor->tail_lock));
+}
 
-	return len - unread_chars;
+//tail_open returns true if a batch can be posted on the tail of the device file in data. It is checked by core_post_tail under
+//the tail lock: the tag index is installed and the readers are queued for a handoff holding the tail lock, so a batch queued on
+//the tail is drained before the index is used, and seen by a reader queued after it
+static bool tail_open(void *data) {
+	struct minor *minor = data;
+
+	return minor->tag_index == NULL && list_empty(&(minor->handoff_readers));
 }
 
-static long dev_ioctl(struct file *file, unsigned int command, unsigned long param) {
+//post_on_tail appends a batch of messages to the incoming list of the device file taking only the tail lock, so the writers
+//don't contend with the readers holding the lock of the device file. It returns false, leaving the batch untouched, if the batch
+//has to be posted under the lock of the device file: a tag index has to be kept, the priority levels are used or readers wait
+//for a handoff. The readers are checked whatever reader_handoff is now, since the parameter can be cleared while they wait
+static bool post_on_tail(struct minor *minor, struct list_head *batch, int count) {
 
-	int minor_number = get_minor(file);
-	struct session *current_session;
-	struct list_head *position;
-	struct list_head *temp_position;
-	struct pending_write *pending_write;
-	size_t storage_freed = 0;
+	if (READ_ONCE(minor->priorities_used))
+		return false;
 
-	AUDIT
-	printk("%s: Ioctl called on device [%d,%d] with command %d\n", MODULE_NAME, major_number, minor_number, command);
+	if (!core_post_tail(&(minor->tail_lock), &(minor->incoming), &(minor->available_readings), batch, count, tail_open, minor))
+		return false;
 
-	current_session = (struct session*)(file->private_data);
-	mutex_lock(&(current_session->session_mutex));
+	wake_readers(minor, count);
+	return true;
+}
 
-	switch(command){
+//flow_quantum returns the bytes a flow gets at each turn with ORDERING_FAIR. A quantum is never shorter than max_message_size, so
+//a flow reads at least one message at each turn
+static long flow_quantum(struct flow *flow) {
+	return (long)READ_ONCE(flow->weight) * max(READ_ONCE(max_message_size), 1);
+}
 
-		case SET_SEND_TIMEOUT:
-			current_session->send_timeout = (long)param;
-			mutex_unlock(&(current_session->session_mutex));
-			break;
-		
-		case SET_RECV_TIMEOUT:
-			current_session->recv_timeout = (long)param;
-			mutex_unlock(&(current_session->session_mutex));
-			break;
+//post_on_flows queues a batch of messages on the flows of the sessions that wrote them, with ORDERING_FAIR. The batch is walked from
+//the oldest message, since the delivery work posts the delayed messages of several sessions together. A flow that had no messages
+//joins the round at the tail of the active flows; if the round was empty its turn starts at once, with its quantum
+static void post_on_flows(struct minor *minor, struct list_head *batch, int count) {
 
-		case REVOKE_DELAYED_MESSAGES:		
+	struct message *message;
+	struct message *temp_message;
+	struct flow *flow;
 
-			//The pending writes on the current session are canceled and the structs deallocated
-			list_for_each_safe(position, temp_position, &(current_session->pending_writes)) {
-				
-				pending_write = list_entry(position, struct pending_write, list);
-				if (cancel_delayed_work(&(pending_write->delayed_work))) {
+	spin_lock(&(minor->operation_synchronizer));
+	list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+		flow = message->flow;
+		list_move(&(message->list), &(flow->messages));
+		if (list_empty(&(flow->active_link))) {
+			flow->deficit = list_empty(&(minor->active_flows)) ? flow_quantum(flow) : 0;
+			list_add_tail(&(flow->active_link), &(minor->active_flows));
+		}
+	}
+	atomic_add(count, &(minor->available_readings));
+	spin_unlock(&(minor->operation_synchronizer));
 
-					list_del(&(pending_write->list));
-					storage_freed += pending_write->message.size;
-					kfree(pending_write->message.text);
-					kfree(pending_write);
+	wake_readers(minor, count);
+}
 
-					AUDIT					
-					printk("%s: Deferred write canceled on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
-				}
-			}
+//take_fair moves to the tail of batch the next message of the active flows by deficit round-robin on the bytes: the flow in turn,
+//the first one, reads its oldest messages while its deficit covers them, then it goes to the tail and the next flow gets its
+//quantum. A flow left without messages leaves the round with its deficit. It is called with the lock of the device file held,
+//after a reading has been claimed
+static void take_fair(struct minor *minor, struct list_head *batch) {
 
-			mutex_unlock(&(current_session->session_mutex));
-			
-			//The total storage size for current minor is updated after cancellation of pending writes 
-			mutex_lock(&(minors[minor_number].operation_synchronizer));		
-			minors[minor_number].storage_size = minors[minor_number].storage_size - storage_freed;
-			mutex_unlock(&(minors[minor_number].operation_synchronizer));		
-			break;
+	struct flow *flow = list_first_entry(&(minor->active_flows), struct flow, active_link);
+	struct message *message = list_last_entry(&(flow->messages), struct message, list);
 
-		default:
-			mutex_unlock(&(current_session->session_mutex));
-			break;
+	while (message->size > flow->deficit) {
+		list_move_tail(&(flow->active_link), &(minor->active_flows));
+		flow = list_first_entry(&(minor->active_flows), struct flow, active_link);
+		flow->deficit += flow_quantum(flow);
+		message = list_last_entry(&(flow->messages), struct message, list);
 	}
 
-	return 0;
+	flow->deficit -= message->size;
+	list_move_tail(&(message->list), batch);
+
+	if (list_empty(&(flow->messages))) {
+		list_del_init(&(flow->active_link));
+		flow->deficit = 0;
+		flow = list_first_entry_or_null(&(minor->active_flows), struct flow, active_link);
+		if (flow != NULL)
+			flow->deficit += flow_quantum(flow);
+	}
 }
 
+//post_messages makes a batch of count messages visible to the readers of the device file. The batch is ordered from the newest
+//to the oldest message, like the message list of the device file. The messages are queued, the number of available readings is
+//updated and eventually the sleeping readers are awaked: the lock of the device file is taken once and the waitqueue is
+//woken up once for the whole batch, for as many readers as the messages. With the list engine the oldest messages are first
+//handed off to the readers waiting for a handoff
+static void post_messages(struct minor *minor, struct list_head *batch, int count) {
 
-static int dev_flush(struct file *file, fl_owner_t id) {
-	struct list_head *pos_i;
-	struct list_head *pos_j;
-	struct list_head *temp_pos;
+	struct message *message;
+	struct message *temp_message;
 	struct pending_read *pending_read;
-	struct session *session;
-	struct pending_write *pending_write;
-	int minor_number = get_minor(file);
-	size_t storage_freed = 0;
-	
-	AUDIT
-	printk("%s: Flush called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
 
-	//Acquiring lock for device file
-	mutex_lock(&(minors[minor_number].operation_synchronizer));
+	//The messages of a device file with the per-producer orderings are all written on shards
+	if (list_first_entry(batch, struct message, list)->shard != SHARD_NONE) {
+		post_on_shards(minor, batch);
+		return;
+	}
 
-	//Canceling each delayed message through the sessions opened for the device file
-	list_for_each(pos_i, &minors[minor_number].sessions) { 
-	    session = list_entry(pos_i, struct session, list); 	
+	//In broadcast mode the messages go to the log read by every subscriber, whatever the queue engine
+	if (READ_ONCE(minor->broadcast) != BROADCAST_OFF) {
+		post_broadcast(minor, batch, count);
+		return;
+	}
+
+	if (minor->engine == QUEUE_ENGINE_RING) {
+		//Slots were reserved when the writes were accepted, so the enqueue can only fail while a reader is still
+		//releasing the slot at the tail. The batch is walked from the oldest message
+		list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+			while (!ring_enqueue(&(minor->ring), message))
+				cpu_relax();
+		}
+		atomic_add(count, &(minor->available_readings));
+		wake_readers(minor, count);
+		return;
+	}
+
+	if (READ_ONCE(minor->ordering) == ORDERING_FAIR) {
+		post_on_flows(minor, batch, count);
+		return;
+	}
 
-		//Acquiring lock for session
-		mutex_lock(&(session->session_mutex));
+	if (post_on_tail(minor, batch, count))
+		return;
 
-		list_for_each_safe(pos_j, temp_pos, &(session->pending_writes)) {
+	//The messages already on the tail are older than the batch, so they are moved to the list before it
+	spin_lock(&(minor->operation_synchronizer));
+	drain_incoming(minor);
+	while (count > 0 && !list_empty(&(minor->handoff_readers))) {
+		pending_read = list_first_entry(&(minor->handoff_readers), struct pending_read, handoff_link);
+		list_del_init(&(pending_read->handoff_link));
+		message = list_last_entry(batch, struct message, list);
+		list_del(&(message->list));
+		WRITE_ONCE(pending_read->message, message);
+		wake_up_process(pending_read->task);
+		count--;
+	}
+	if (count > 0) {
+		if (minor->tag_index != NULL)
+			index_messages(minor, batch);
+		if (READ_ONCE(minor->priorities_used))
+			queue_prioritized(minor, batch);
+		list_splice(batch, &(minor->messages));
+		atomic_add(count, &(minor->available_readings));
+		wake_readers(minor, count);
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+}
 
-				pending_write = list_entry(pos_j, struct pending_write, list);
-				//The canceling of delayed work can fail if the task is already started
-				if (cancel_delayed_work(&(pending_write->delayed_work))) {
+static void post_message(struct minor *minor, struct message *message) {
+	LIST_HEAD(batch);
 
-					list_del(&(pending_write->list));
-					storage_freed += pending_write->message.size;
-					kfree(pending_write->message.text);
-					kfree(pending_write);
+	list_add(&(message->list), &batch);
+	post_messages(minor, &batch, 1);
+}
 
-					AUDIT					
-					printk("%s: Deferred write canceled on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
-				}
-			}
+//take_requeued moves to batch up to count of the messages given back by unread_message whose reading is on shard, from the
+//first given back, and returns their number. It is called with the lock of the device file held
+static int take_requeued(struct minor *minor, int shard, int count, struct list_head *batch) {
+	struct message *message;
+	struct message *temp_message;
+	int taken = 0;
 
-		mutex_unlock(&(session->session_mutex));
+	list_for_each_entry_safe(message, temp_message, &(minor->requeued), list) {
+		if (taken == count)
+			break;
+		if (message->shard != shard)
+			continue;
+		list_move_tail(&(message->list), batch);
+		taken++;
 	}
+	return taken;
+}
 
-	minors[minor_number].storage_size = minors[minor_number].storage_size - storage_freed;
+//fetch_messages removes the count oldest messages from the queue of the device file, or from a shard, and appends them, from the
+//oldest, to batch. The caller has already claimed count of the available readings, so the messages are surely present or about
+//to be published. The lock of the device file is taken once for the whole batch
+static void fetch_messages(struct minor *minor, int shard, int count, struct list_head *batch) {
 
-	//Canceling each blocked reading on the device file marking the apposite flag in the pending_read struct
-	list_for_each(pos_i, &minors[minor_number].pending_readings) { 
-    	pending_read = list_entry(pos_i, struct pending_read, list); 	
-		pending_read->is_flushed = true;	 
-    }
-	wake_up_all(&(minors[minor_number].pending_readers_wq));
+	struct message *message;
+	struct message_shard *message_shard;
+	int level;
+
+	//The messages given back by the reads that could not deliver them are taken before the queues
+	if (!list_empty(&(minor->requeued))) {
+		spin_lock(&(minor->operation_synchronizer));
+		count -= take_requeued(minor, shard, count, batch);
+		spin_unlock(&(minor->operation_synchronizer));
+		if (count == 0)
+			return;
+	}
 
-	mutex_unlock(&(minors[minor_number].operation_synchronizer));
+	if (shard != SHARD_NONE) {
+		message_shard = per_cpu_ptr(minor->shards, shard);
+		spin_lock(&(message_shard->lock));
+		while (count-- > 0)
+			list_move_tail(message_shard->messages.next, batch);
+		message = list_first_entry_or_null(&(message_shard->messages), struct message, list);
+		if (message != NULL)
+			WRITE_ONCE(message_shard->head_queued_at, message->queued_at);
+		spin_unlock(&(message_shard->lock));
+		return;
+	}
 
-	return 0;
+	if (minor->engine == QUEUE_ENGINE_RING) {
+		while (count-- > 0) {
+			while ((message = ring_dequeue(&(minor->ring))) == NULL)
+				cpu_relax();
+			list_add_tail(&(message->list), batch);
+		}
+		return;
+	}
+
+	spin_lock(&(minor->operation_synchronizer));
+	if (minor->ordering == ORDERING_FAIR) {
+		while (count-- > 0)
+			take_fair(minor, batch);
+		spin_unlock(&(minor->operation_synchronizer));
+		return;
+	}
+
+	while (count-- > 0) {
+		//The level 0 messages may be only on the incoming list while the message list is empty
+		if (list_empty(&(minor->messages)))
+			drain_incoming(minor);
+
+		//The messages with a priority are taken first, from the tail of the queue of their level
+		level = priority_level(minor);
+		if (level != 0) {
+			message = list_last_entry(level_queue(minor, level), struct message, list);
+			remove_message(minor, message);
+			list_add_tail(&(message->list), batch);
+			continue;
+		}
+
+		//The oldest message is moved to the batch, updating the pointer to next message to read
+		message = list_entry(core_take_oldest(&(minor->messages), &(minor->incoming), &(minor->tail_lock),
+					&(minor->message_to_read), batch), struct message, list);
+		list_del_init(&(message->tag_link));
+	}
+	spin_unlock(&(minor->operation_synchronizer));
 }
 
-static struct file_operations file_ops = {
-	.owner = THIS_MODULE,
-	.open = dev_open,
-	.write = dev_write,
-	.read = dev_read,
-	.unlocked_ioctl = dev_ioctl,
-	.flush = dev_flush,
-	.release = dev_release
-};
 
+//ordering_sharded returns true for the per-producer orderings, whose messages are queued on the shards of the CPUs. The other
+//orderings use the readings and the storage of the device file
+static bool ordering_sharded(int ordering) {
+	return ordering == ORDERING_PER_PRODUCER || ordering == ORDERING_APPROXIMATE;
+}
+
+//readings_available returns true if the device file has messages that no reader claimed yet
+static bool readings_available(struct minor *minor) {
+	int cpu;
 
-static int __init install_driver(void) {
-	int i;
+	if (!ordering_sharded(READ_ONCE(minor->ordering)))
+		return atomic_read(&(minor->available_readings)) > 0;
 
-	//The array of minor struct is initializated to support the operations over device files
-	for(i = 0; i < MAX_MINOR_NUMBER; i++){
-		mutex_init(&(minors[i].operation_synchronizer));
-		init_waitqueue_head(&(minors[i].pending_readers_wq));
-		INIT_LIST_HEAD(&(minors[i].messages));
-		INIT_LIST_HEAD(&(minors[i].sessions));
-		INIT_LIST_HEAD(&(minors[i].pending_readings));
-		minors[i].message_to_read = NULL;
-		minors[i].available_readings = 0;
+	for_each_possible_cpu(cpu) {
+		if (atomic_read(&(per_cpu_ptr(minor->shards, cpu)->available_readings)) > 0)
+			return true;
 	}
+	return false;
+}
 
-	major_number = __register_chrdev(0, 0, MAX_MINOR_NUMBER, DEVICE_DRIVER_NAME, &file_ops);
-	if (major_number < 0) {
+//queued_readings returns the number of messages of the device file that no reader claimed yet
+static int queued_readings(struct minor *minor) {
+	int readings = atomic_read(&(minor->available_readings));
+	int cpu;
 
-	  AUDIT
-	  printk("%s: failure in device driver registration\n", MODULE_NAME);
-	  return major_number;
+	if (ordering_sharded(READ_ONCE(minor->ordering))) {
+		for_each_possible_cpu(cpu)
+			readings += atomic_read(&(per_cpu_ptr(minor->shards, cpu)->available_readings));
+	}
+	return readings;
+}
+
+//claim_shard_reading claims one of the available readings of a shard, or of the device file for SHARD_NONE
+static bool claim_shard_reading(struct minor *minor, int shard) {
+	if (shard == SHARD_NONE)
+		return core_claim_reading(&(minor->available_readings));
+	return core_claim_reading(&(per_cpu_ptr(minor->shards, shard)->available_readings));
+}
+
+//try_claim_reading claims one of the available readings without waiting, storing in shard where the message has to be fetched
+//from. With ORDERING_PER_PRODUCER the shards are tried round-robin, starting from the shard after the one the previous reader
+//started from; with ORDERING_APPROXIMATE the shard whose oldest message was queued first is tried, and the shards are scanned
+//again if another reader claimed it
+static bool try_claim_reading(struct minor *minor, int *shard) {
+
+	int ordering = READ_ONCE(minor->ordering);
+	struct message_shard *message_shard;
+	ktime_t oldest_queued_at = 0;
+	unsigned int start;
+	int oldest;
+	int cpu;
+	int i;
+
+	if (!ordering_sharded(ordering)) {
+		*shard = SHARD_NONE;
+		return claim_shard_reading(minor, SHARD_NONE);
+	}
+
+	if (ordering == ORDERING_APPROXIMATE) {
+		while (true) {
+			oldest = SHARD_NONE;
+			for_each_possible_cpu(cpu) {
+				message_shard = per_cpu_ptr(minor->shards, cpu);
+				if (atomic_read(&(message_shard->available_readings)) > 0 &&
+						(oldest == SHARD_NONE || ktime_before(READ_ONCE(message_shard->head_queued_at), oldest_queued_at))) {
+					oldest = cpu;
+					oldest_queued_at = READ_ONCE(message_shard->head_queued_at);
+				}
+			}
+			if (oldest == SHARD_NONE)
+				return false;
+			if (claim_shard_reading(minor, oldest)) {
+				*shard = oldest;
+				return true;
+			}
+		}
+	}
+
+	start = atomic_inc_return(&(minor->next_shard));
+	for (i = 0; i < nr_cpu_ids; i++) {
+		cpu = (start + i) % nr_cpu_ids;
+		if (cpu_possible(cpu) && claim_shard_reading(minor, cpu)) {
+			*shard = cpu;
+			return true;
+		}
+	}
+	return false;
+}
+
+//writer_shard returns the shard the messages of a writer go to: the one of the current CPU with the per-producer orderings. The
+//writer can migrate afterwards, so the shard only gives locality and it is recorded in the messages
+static int writer_shard(struct minor *minor) {
+	if (!ordering_sharded(READ_ONCE(minor->ordering)))
+		return SHARD_NONE;
+	return raw_smp_processor_id();
+}
+
+//set_ordering changes the ordering of the messages of a device file, allocating the shards the first time a per-producer
+//ordering is chosen. ORDERING_FAIR needs the list engine. The ordering can be changed only by the single session open on the device file, when no message is
+//stored, so no writer and no reader can see the change halfway
+static long set_ordering(struct minor *minor, int ordering) {
+
+	struct message_shard __percpu *shards;
+	struct message_shard *shard;
+	long storage_size;
+	long outcome = 0;
+	int cpu;
+
+	if (ordering != ORDERING_FIFO && ordering != ORDERING_PER_PRODUCER && ordering != ORDERING_APPROXIMATE && ordering != ORDERING_FAIR)
+		return -EINVAL;
+	if (ordering != ORDERING_FIFO && READ_ONCE(minor->broadcast) != BROADCAST_OFF)
+		return -EINVAL;
+	if (ordering == ORDERING_FAIR && minor->engine != QUEUE_ENGINE_LIST)
+		return -EINVAL;
+
+	if (ordering_sharded(ordering) && minor->shards == NULL) {
+		shards = alloc_percpu(struct message_shard);
+		if (shards == NULL)
+			return -ENOMEM;
+		for_each_possible_cpu(cpu) {
+			shard = per_cpu_ptr(shards, cpu);
+			spin_lock_init(&(shard->lock));
+			INIT_LIST_HEAD(&(shard->messages));
+		}
+
+		spin_lock(&(minor->operation_synchronizer));
+		if (minor->shards == NULL)
+			minor->shards = shards;
+		else
+			free_percpu(shards);
+		spin_unlock(&(minor->operation_synchronizer));
+	}
+
+	//The session list is changed under the lock of the device file, so a session opened concurrently is either counted here or
+	//it sees the new ordering. Storage still reserved means a write of the same session is in progress
+	spin_lock(&(minor->operation_synchronizer));
+	storage_size = atomic_long_read(&(minor->storage_size));
+	if (minor->shards != NULL) {
+		for_each_possible_cpu(cpu)
+			storage_size += atomic_long_read(&(per_cpu_ptr(minor->shards, cpu)->storage_size));
+	}
+	if (!list_is_singular(&(minor->sessions)) || atomic_read(&(minor->users)) != 1 || queued_readings(minor) != 0 || storage_size != 0)
+		outcome = -EBUSY;
+	else
+		WRITE_ONCE(minor->ordering, ordering);
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return outcome;
+}
+
+//shared_ring_create allocates the area of a shared ring, with a slot for each max_message_size bytes of max_storage_size, and
+//initializes its header and the sequences of its slots. The area is zeroed and it can be mapped in userspace
+static struct shared_ring *shared_ring_create(void) {
+
+	struct shared_ring *ring;
+	struct shared_ring_slot *slot;
+	size_t slots_offset;
+	unsigned long i;
+
+	ring = kzalloc(sizeof(struct shared_ring), GFP_KERNEL);
+	if (ring == NULL)
+		return NULL;
+
+	ring->slot_count = roundup_pow_of_two(max(max_storage_size / max(max_message_size, 1), 2));
+	ring->slot_size = ALIGN(sizeof(struct shared_ring_slot) + max(max_message_size, 0), SMP_CACHE_BYTES);
+	slots_offset = ALIGN(sizeof(struct shared_ring_header), SMP_CACHE_BYTES);
+	ring->area_size = PAGE_ALIGN(slots_offset + ring->slot_count * ring->slot_size);
+
+	ring->header = vmalloc_user(ring->area_size);
+	if (ring->header == NULL) {
+		kfree(ring);
+		return NULL;
+	}
+	ring->slots = (char *)(ring->header) + slots_offset;
+	spin_lock_init(&(ring->waiters_lock));
+
+	ring->header->slot_count = ring->slot_count;
+	ring->header->slot_size = ring->slot_size;
+	ring->header->slots_offset = slots_offset;
+	for (i = 0; i < ring->slot_count; i++) {
+		slot = (struct shared_ring_slot *)(ring->slots + i * ring->slot_size);
+		slot->sequence = i;
+	}
+
+	return ring;
+}
+
+static void shared_ring_destroy(struct shared_ring *ring) {
+	vfree(ring->header);
+	kfree(ring);
+}
+
+static struct shared_ring_slot *shared_ring_slot(struct shared_ring *ring, u64 position) {
+	return (struct shared_ring_slot *)(ring->slots + (position & (ring->slot_count - 1)) * ring->slot_size);
+}
+
+//shared_ring_claim claims the tail position of the shared ring and returns its slot, or NULL if the ring is full. The header and
+//the slots can be written by userspace at any time, so the kernel never trusts them: positions are masked and the number of
+//attempts is bounded, so a corrupted ring is only seen as full
+static struct shared_ring_slot *shared_ring_claim(struct shared_ring *ring, u64 *position) {
+
+	struct shared_ring_slot *slot;
+	u64 tail = READ_ONCE(ring->header->tail);
+	s64 difference;
+	int attempts;
+
+	for (attempts = 0; attempts < SHARED_RING_MAX_ATTEMPTS; attempts++) {
+		slot = shared_ring_slot(ring, tail);
+		difference = (s64)(smp_load_acquire(&(slot->sequence)) - tail);
+
+		if (difference == 0) {
+			if (try_cmpxchg64(&(ring->header->tail), &tail, tail + 1)) {
+				*position = tail;
+				return slot;
+			}
+		} else if (difference < 0) {
+			return NULL;
+		} else {
+			tail = READ_ONCE(ring->header->tail);
+		}
+	}
+
+	return NULL;
+}
+
+//shared_ring_readable returns true if the slot at the head of the shared ring holds a published message
+static bool shared_ring_readable(struct shared_ring *ring) {
+	u64 head = READ_ONCE(ring->header->head);
+
+	return smp_load_acquire(&(shared_ring_slot(ring, head)->sequence)) == head + 1;
+}
+
+//shared_ring_unread returns true if the shared ring has slots claimed by a producer and not read yet, published or not
+static bool shared_ring_unread(struct shared_ring *ring) {
+	return READ_ONCE(ring->header->head) != READ_ONCE(ring->header->tail);
+}
+
+//post_on_shared_ring copies a message in a slot of the shared ring of the device file and wakes up the consumers sleeping on the
+//ring. It returns false if the ring is full or the message doesn't fit a slot
+static bool post_on_shared_ring(struct minor *minor, struct message *message) {
+
+	struct shared_ring *ring = smp_load_acquire(&(minor->shared_ring));
+	struct shared_ring_slot *slot;
+	u64 position;
+
+	if (ring == NULL || message->size > ring->slot_size - sizeof(struct shared_ring_slot))
+		return false;
+
+	slot = shared_ring_claim(ring, &position);
+	if (slot == NULL)
+		return false;
+
+	copy_message_to_buffer(message, slot->text);
+	slot->size = message->size;
+	smp_store_release(&(slot->sequence), position + 1);
+
+	wake_up(&(minor->pending_readers_wq));
+	return true;
+}
+
+//shared_ring_wait sleeps until the shared ring of the device file has a message to read, flush() is invoked or timeout expires.
+//The thread is counted in the waiters field of the header before checking the ring, so a producer that publishes a message and
+//then reads waiters as zero is sure the check will see the message
+static long shared_ring_wait(struct minor *minor, long timeout) {
+
+	struct shared_ring *ring = smp_load_acquire(&(minor->shared_ring));
+	struct pending_read *pending_read;
+	int minor_number = minor->minor_number;
+	long wait_outcome;
+	bool is_flushed;
+
+	if (ring == NULL)
+		return -ENXIO;
+
+	//The wait is linked to the pending readings of the device file, so dev_flush() can abort it
+	pending_read = kmalloc(sizeof(struct pending_read), GFP_KERNEL);
+	if (pending_read == NULL)
+		return -ENOMEM;
+	pending_read->is_flushed = false;
+	INIT_LIST_HEAD(&(pending_read->list));
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_add(&(pending_read->list), &(minor->pending_readings));
+	spin_unlock(&(minor->operation_synchronizer));
+
+	spin_lock(&(ring->waiters_lock));
+	WRITE_ONCE(ring->header->waiters, ++ring->waiters);
+	spin_unlock(&(ring->waiters_lock));
+	smp_mb();
+
+	wait_outcome = wait_event_timeout(minor->pending_readers_wq,
+						shared_ring_readable(ring) || pending_read->is_flushed, timeout);
+
+	spin_lock(&(ring->waiters_lock));
+	WRITE_ONCE(ring->header->waiters, --ring->waiters);
+	spin_unlock(&(ring->waiters_lock));
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_del(&(pending_read->list));
+	spin_unlock(&(minor->operation_synchronizer));
+	is_flushed = pending_read->is_flushed;
+	kfree(pending_read);
+
+	if (is_flushed) {
+		AUDIT
+		printk("%s: Wait on shared ring aborted on device [%d,%d]: another process calls flush()\n", MODULE_NAME, major_number, minor_number);
+		return -ECANCELED;
+	}
+
+	if (wait_outcome == 0) {
+		AUDIT
+		printk("%s: Wait on shared ring aborted on device [%d,%d]: not messages to read after timeout expiration\n",
+			MODULE_NAME, major_number, minor_number);
+		return -ETIME;
+	}
+
+	return 0;
+}
+
+
+//elapsed_ns returns the nanoseconds elapsed since the time since
+static s64 elapsed_ns(ktime_t since) {
+	return ktime_to_ns(ktime_sub(ktime_get(), since));
+}
+
+//stats_bucket returns the bucket of the latency histograms for a latency of ns nanoseconds
+static int stats_bucket(s64 ns) {
+	if (ns <= 1)
+		return 0;
+	return min_t(int, ilog2((u64)ns), STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+//record_read accounts the read of a message: its time in the queue goes to the statistics and to the tracepoint
+static void record_read(struct minor *minor, int minor_number, struct message *message) {
+	s64 latency = elapsed_ns(message->queued_at);
+
+	stats_inc(minor, queue_latency[stats_bucket(latency)]);
+	trace_tms_read(minor_number, message->size, latency);
+}
+
+//record_read_wait accounts the time spent sleeping by a blocked read
+static void record_read_wait(struct minor *minor, ktime_t wait_start) {
+	stats_inc(minor, read_wait[stats_bucket(elapsed_ns(wait_start))]);
+}
+
+//create_arena allocates the arena of a device file on node (NUMA_NO_NODE if any node will do), with a slot for each
+//max_message_size bytes of max_storage_size. All the memory is allocated here, so it never has to be found under pressure later.
+//It returns NULL if the arena can't be allocated
+static struct message_arena *create_arena(struct minor *minor, int node) {
+	struct message_arena *arena;
+	unsigned long i;
+
+	arena = kzalloc_node(sizeof(struct message_arena), GFP_KERNEL, node);
+	if (arena == NULL)
+		return NULL;
+
+	arena->payload_size = max(max_message_size, 0);
+	arena->slot_size = ALIGN(sizeof(struct pending_write) + arena->payload_size, SMP_CACHE_BYTES);
+	arena->capacity = max(max_storage_size / max(max_message_size, 1), 1);
+	arena->slots = kvmalloc_node(arena->capacity * arena->slot_size, GFP_KERNEL, node);
+	arena->free_slots = kvmalloc_node(arena->capacity * sizeof(unsigned int), GFP_KERNEL, node);
+	if (arena->slots == NULL || arena->free_slots == NULL) {
+		kvfree(arena->slots);
+		kvfree(arena->free_slots);
+		kfree(arena);
+		return NULL;
+	}
+
+	//The slots are handed out from the top of the stack, so the first writes use the first slots
+	for (i = 0; i < arena->capacity; i++)
+		arena->free_slots[i] = arena->capacity - 1 - i;
+	arena->free_count = arena->capacity;
+	atomic_set(&(arena->reserved_slots), 0);
+	spin_lock_init(&(arena->lock));
+	arena->writers_wq = &(minor->pending_writers_wq);
+
+	return arena;
+}
+
+static void destroy_arena(struct message_arena *arena) {
+	if (arena == NULL)
+		return;
+	kvfree(arena->slots);
+	kvfree(arena->free_slots);
+	kfree(arena);
+}
+
+//arena_take takes a free slot of an arena, for a message whose slot has been reserved with the storage, so there is always one.
+//The slot is laid out as a pending_write, whose message is the one returned
+static struct message *arena_take(struct message_arena *arena) {
+	struct pending_write *pending_write;
+	unsigned long flags;
+
+	spin_lock_irqsave(&(arena->lock), flags);
+	pending_write = (struct pending_write *)(arena->slots + arena->free_slots[--arena->free_count] * arena->slot_size);
+	spin_unlock_irqrestore(&(arena->lock), flags);
+
+	return &(pending_write->message);
+}
+
+//arena_put gives back the slot of a message to its arena and releases its reservation, waking up the writers waiting for room.
+//The messages are freed under the locks of the device file and by the timers, so the free stack is locked with the interrupts off
+static void arena_put(struct message_arena *arena, struct message *message) {
+	char *slot = (char *)container_of(message, struct pending_write, message);
+	unsigned long flags;
+
+	spin_lock_irqsave(&(arena->lock), flags);
+	arena->free_slots[arena->free_count++] = (slot - arena->slots) / arena->slot_size;
+	spin_unlock_irqrestore(&(arena->lock), flags);
+
+	atomic_dec(&(arena->reserved_slots));
+	if (wq_has_sleeper(arena->writers_wq))
+		wake_up(arena->writers_wq);
+}
+
+//free_message gives back a message to the cache, or to the arena, it was taken from, dropping the references to the pages of a
+//large message. Messages are freed under the spinlocks of the device file, so a page vector taken from vmalloc is freed with
+//vfree_atomic
+static void free_message(struct message *message) {
+	unsigned int i;
+
+	if (message->pages != NULL) {
+		for (i = 0; i < message->nr_pages; i++)
+			put_page(message->pages[i].bv_page);
+		if (is_vmalloc_addr(message->pages))
+			vfree_atomic(message->pages);
+		else
+			kfree(message->pages);
+	}
+
+	if (message->flow != NULL) {
+		uncharge_flow(message->flow, message->size);
+		put_flow(message->flow);
+	}
+
+	if (message->arena != NULL)
+		arena_put(message->arena, message);
+	else if (message->is_delayed)
+		kmem_cache_free(pending_write_cache, container_of(message, struct pending_write, message));
+	else
+		kmem_cache_free(message_cache, message);
+}
+
+//alloc_pages_vector gives a message without content room for len bytes in a vector of capacity pages, allocating a page for
+//each PAGE_SIZE bytes. A message that is filled by splice() has no pages yet (len 0) and references the pages of the pipe
+static int alloc_pages_vector(struct message *message, size_t len, unsigned int capacity) {
+	struct page *page;
+
+	message->text = NULL;
+	message->pages = kvmalloc_array(capacity, sizeof(struct bio_vec), GFP_KERNEL);
+	if (message->pages == NULL)
+		return -ENOMEM;
+
+	while (len > 0) {
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL)
+			return -ENOMEM;
+		message->pages[message->nr_pages].bv_page = page;
+		message->pages[message->nr_pages].bv_offset = 0;
+		message->pages[message->nr_pages].bv_len = min_t(size_t, len, PAGE_SIZE);
+		len -= message->pages[message->nr_pages].bv_len;
+		message->nr_pages++;
+	}
+	return 0;
+}
+
+//alloc_message creates a message of len bytes. An immediate message is taken from message_cache, a delayed one is created inside a
+//pending_write taken from pending_write_cache. The content is stored in the same object if len fits the cache objects, otherwise
+//in a vector of pages, so a large message never needs a high order allocation. With an arena, both are taken from a slot of
+//arena instead, with the content, unless max_message_size was raised past the slots after the arena was created. shard is the
+//shard the message is accounted to, tag the tag of the message (0 for an untagged message) and priority its priority level
+static struct message *alloc_message(struct message_arena *arena, size_t len, bool is_delayed, int shard, u64 tag, int priority) {
+
+	struct pending_write *pending_write;
+	struct message *message;
+
+	if (arena != NULL) {
+		message = arena_take(arena);
+	} else if (is_delayed) {
+		pending_write = kmem_cache_alloc(pending_write_cache, GFP_KERNEL);
+		if (pending_write == NULL)
+			return NULL;
+		message = &(pending_write->message);
+	} else {
+		message = kmem_cache_alloc(message_cache, GFP_KERNEL);
+		if (message == NULL)
+			return NULL;
+	}
+
+	message->is_delayed = is_delayed;
+	message->shard = shard;
+	message->tag = tag;
+	message->flow = NULL;
+	message->arena = arena;
+	message->priority = priority;
+	message->expires_at = 0;
+	message->size = len;
+	message->text = message->payload;
+	message->pages = NULL;
+	message->nr_pages = 0;
+	message->queued_at = ktime_get();
+	INIT_LIST_HEAD(&(message->list));
+	INIT_LIST_HEAD(&(message->tag_link));
+
+	if (len > (arena != NULL ? arena->payload_size : inline_payload_size) &&
+			alloc_pages_vector(message, len, DIV_ROUND_UP(len, PAGE_SIZE)) < 0) {
+		free_message(message);
+		return NULL;
+	}
+
+	return message;
+}
+
+//copy_message_from_user fills the content of a message with len bytes from the user buffer buff. It returns the number of bytes
+//that could not be copied, as copy_from_user
+static unsigned long copy_message_from_user(struct message *message, const char *buff, size_t len) {
+	unsigned long unwritten = 0;
+	unsigned int i;
+	char *address;
+
+	if (message->text != NULL)
+		return copy_from_user(message->text, buff, len);
+
+	for (i = 0; i < message->nr_pages && len > 0; i++) {
+		address = kmap_local_page(message->pages[i].bv_page);
+		unwritten += copy_from_user(address + message->pages[i].bv_offset, buff, message->pages[i].bv_len);
+		kunmap_local(address);
+		buff += message->pages[i].bv_len;
+		len -= message->pages[i].bv_len;
+	}
+	return unwritten;
+}
+
+//copy_message_to_user copies the first len bytes of a message to the user buffer buff. It returns the number of bytes that could
+//not be copied, as copy_to_user
+static unsigned long copy_message_to_user(struct message *message, char *buff, size_t len) {
+	unsigned long unread = 0;
+	unsigned int i;
+	size_t chunk;
+	char *address;
+
+	if (message->text != NULL)
+		return copy_to_user(buff, message->text, len);
+
+	for (i = 0; i < message->nr_pages && len > 0; i++) {
+		chunk = min_t(size_t, len, message->pages[i].bv_len);
+		address = kmap_local_page(message->pages[i].bv_page);
+		unread += copy_to_user(buff, address + message->pages[i].bv_offset, chunk);
+		kunmap_local(address);
+		buff += chunk;
+		len -= chunk;
+	}
+	return unread;
+}
+
+//copy_message_from_iter fills the content of a message from the iov_iter from. It returns the number of bytes copied
+static size_t copy_message_from_iter(struct message *message, struct iov_iter *from) {
+	size_t copied = 0;
+	size_t chunk;
+	unsigned int i;
+
+	if (message->text != NULL)
+		return copy_from_iter(message->text, message->size, from);
+
+	for (i = 0; i < message->nr_pages; i++) {
+		chunk = copy_page_from_iter(message->pages[i].bv_page, message->pages[i].bv_offset, message->pages[i].bv_len, from);
+		copied += chunk;
+		if (chunk < message->pages[i].bv_len)
+			break;
+	}
+	return copied;
+}
+
+//copy_message_to_iter copies the first len bytes of a message to the iov_iter to. It returns the number of bytes copied
+static size_t copy_message_to_iter(struct message *message, size_t len, struct iov_iter *to) {
+	size_t copied = 0;
+	size_t chunk;
+	unsigned int i;
+
+	if (message->text != NULL)
+		return copy_to_iter(message->text, len, to);
+
+	for (i = 0; i < message->nr_pages && copied < len; i++) {
+		chunk = min_t(size_t, len - copied, message->pages[i].bv_len);
+		if (copy_page_to_iter(message->pages[i].bv_page, message->pages[i].bv_offset, chunk, to) < chunk)
+			return copied;
+		copied += chunk;
+	}
+	return copied;
+}
+
+//copy_message_to_buffer copies the whole content of a message to a kernel buffer
+static void copy_message_to_buffer(struct message *message, char *buffer) {
+	unsigned int i;
+
+	if (message->text != NULL) {
+		memcpy(buffer, message->text, message->size);
+		return;
+	}
+
+	for (i = 0; i < message->nr_pages; i++) {
+		memcpy_from_page(buffer, message->pages[i].bv_page, message->pages[i].bv_offset, message->pages[i].bv_len);
+		buffer += message->pages[i].bv_len;
+	}
+}
+
+//put_broadcast drops a reference to a message of the broadcast log. The last reference frees the message and gives back its
+//storage, so a read can copy a message without the lock of the device file while the log moves on. It returns true if the
+//storage has been given back
+static bool put_broadcast(struct minor *minor, struct message *message) {
+	if (!refcount_dec_and_test(&(message->references)))
+		return false;
+	release_storage(minor, SHARD_NONE, message->size, 1);
+	free_message(message);
+	return true;
+}
+
+//trim_broadcast removes from the head of the broadcast log the messages that every subscriber has read. The subscribers read the
+//log in order and a message counts all the subscribers counted by the older ones, so the first message that still has
+//subscribers ends the scan. It is called with the lock of the device file
+static void trim_broadcast(struct minor *minor) {
+	struct message *message;
+	struct message *temp_message;
+
+	list_for_each_entry_safe(message, temp_message, &(minor->broadcast_log), list) {
+		if (message->subscribers > 0)
+			break;
+		list_del_init(&(message->list));
+		put_broadcast(minor, message);
+	}
+}
+
+//next_broadcast returns the message of the broadcast log after message, NULL if message is the newest one
+static struct message *next_broadcast(struct minor *minor, struct message *message) {
+	if (list_is_last(&(message->list), &(minor->broadcast_log)))
+		return NULL;
+	return list_next_entry(message, list);
+}
+
+//post_broadcast appends a batch of messages to the broadcast log, counting as their readers the subscribers open on the device
+//file, and points to the oldest of them the subscribers that had read the whole log. A message without subscribers is dropped at
+//once. All the sleeping readers are woken up, since every subscriber reads every message
+static void post_broadcast(struct minor *minor, struct list_head *batch, int count) {
+
+	struct message *message;
+	struct message *temp_message;
+	struct message *first = NULL;
+	struct session *session;
+	unsigned int subscribers = 0;
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_for_each_entry(session, &(minor->sessions), list) {
+		if (session->is_subscriber)
+			subscribers++;
+	}
+
+	//The batch has the newest message at the head, so it is walked from the tail
+	list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+		list_del(&(message->list));
+		if (subscribers == 0) {
+			release_storage(minor, SHARD_NONE, message->size, 1);
+			free_message(message);
+			continue;
+		}
+		message->subscribers = subscribers;
+		refcount_set(&(message->references), 1);
+		list_add_tail(&(message->list), &(minor->broadcast_log));
+		if (first == NULL)
+			first = message;
+	}
+
+	if (first != NULL) {
+		list_for_each_entry(session, &(minor->sessions), list) {
+			if (session->is_subscriber && session->cursor == NULL)
+				WRITE_ONCE(session->cursor, first);
+		}
+		if (wq_has_sleeper(&(minor->pending_readers_wq)))
+			wake_up_all(&(minor->pending_readers_wq));
+		wake_uring_reads(minor, INT_MAX);
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+}
+
+//take_broadcast moves the cursor of a subscriber past its next message and returns the message with a reference for the read,
+//NULL if the subscriber read the whole log. The reference is dropped with put_broadcast once the message is copied
+static struct message *take_broadcast(struct minor *minor, struct session *session) {
+	struct message *message;
+
+	spin_lock(&(minor->operation_synchronizer));
+	message = session->cursor;
+	if (message != NULL) {
+		refcount_inc(&(message->references));
+		WRITE_ONCE(session->cursor, next_broadcast(minor, message));
+		message->subscribers--;
+		trim_broadcast(minor);
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return message;
+}
+
+//leave_broadcast gives up the messages of the broadcast log that a subscriber did not read, when its session is closed. It is
+//called with the lock of the device file
+static void leave_broadcast(struct minor *minor, struct session *session) {
+	struct message *message = session->cursor;
+
+	if (message == NULL)
+		return;
+	list_for_each_entry_from(message, &(minor->broadcast_log), list)
+		message->subscribers--;
+	session->cursor = NULL;
+	trim_broadcast(minor);
+}
+
+//drop_lagging makes room for len bytes of the priority level in a broadcast device file with BROADCAST_DROP, removing the oldest
+//messages of the log even if some subscribers did not read them: their cursors skip to the next message. A message that a read
+//is still copying gives back its storage when the copy ends, so its size is counted apart as freed. It returns the number of
+//dropped messages
+static int drop_lagging(struct minor *minor, int priority, size_t len) {
+
+	struct message *message;
+	struct message *next;
+	struct session *session;
+	long limit = storage_limit(priority);
+	long freed = 0;
+	size_t size;
+	int dropped = 0;
+
+	if (READ_ONCE(minor->broadcast) != BROADCAST_DROP)
+		return 0;
+
+	spin_lock(&(minor->operation_synchronizer));
+	while (atomic_long_read(&(minor->storage_size)) - freed + len > limit && !list_empty(&(minor->broadcast_log))) {
+		message = list_first_entry(&(minor->broadcast_log), struct message, list);
+		next = next_broadcast(minor, message);
+		list_for_each_entry(session, &(minor->sessions), list) {
+			if (session->cursor == message)
+				WRITE_ONCE(session->cursor, next);
+		}
+		list_del_init(&(message->list));
+		size = message->size;
+		if (!put_broadcast(minor, message))
+			freed += size;
+		dropped++;
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+
+	if (dropped > 0) {
+		stats_add(minor, lagged_messages, dropped);
+		AUDIT
+		printk("%s: %d broadcast messages dropped on device [%d,%d]: subscribers lagging behind\n", MODULE_NAME, dropped,
+			major_number, minor->minor_number);
+	}
+	return dropped;
+}
+
+//set_broadcast changes the broadcast mode of a device file. As for set_ordering, the mode can be changed only by the single
+//session open on the device file when no message is stored, and the broadcast log needs the FIFO ordering
+static long set_broadcast(struct minor *minor, int broadcast) {
+
+	long outcome = 0;
+
+	if (broadcast != BROADCAST_OFF && broadcast != BROADCAST_DROP && broadcast != BROADCAST_BLOCK)
+		return -EINVAL;
+
+	spin_lock(&(minor->operation_synchronizer));
+	if (minor->ordering != ORDERING_FIFO)
+		outcome = -EINVAL;
+	else if (!list_is_singular(&(minor->sessions)) || atomic_read(&(minor->users)) != 1 || queued_readings(minor) != 0 ||
+			atomic_long_read(&(minor->storage_size)) != 0 || !list_empty(&(minor->broadcast_log)))
+		outcome = -EBUSY;
+	else
+		WRITE_ONCE(minor->broadcast, broadcast);
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return outcome;
+}
+
+
+//expire_pending_write is called when the timer of a delayed write expires. It runs in softirq context, so it only unlinks the
+//pending write from its session, since the write is no longer revocable, and hands it to the delivery work
+static void expire_pending_write(struct pending_write *pending_write) {
+
+	core_expire_pending(&(pending_write->pending), &(pending_write->minor->pending_lock));
+
+	//The work is queued only by the timer that finds the list empty: the others are collected by the same execution
+	if (llist_add(&(pending_write->expired_node), &expired_writes))
+		queue_work(delivery_workqueue, &delivery_work);
+}
+
+static void pending_write_expired(struct timer_list *timer) {
+	struct pending_write *pending_write = from_timer(pending_write, timer, pending.timer);
+
+	expire_pending_write(pending_write);
+}
+
+//pending_write_hrtimer_expired is the callback of the high resolution writes. The hrtimer is started in soft mode, so the
+//callback runs in softirq context as the one of the timer wheel
+static enum hrtimer_restart pending_write_hrtimer_expired(struct hrtimer *hrtimer) {
+	struct pending_write *pending_write = container_of(hrtimer, struct pending_write, pending.hrtimer);
+
+	expire_pending_write(pending_write);
+	return HRTIMER_NORESTART;
+}
+
+//deliver_expired_writes posts the expired writes collected since its last execution. The writes are grouped by device file, so
+//each device file is locked once and its readers are woken up once for all the messages expired in the same tick. The work
+//never runs concurrently with itself, so the delivery batches of the channels need no lock
+static void deliver_expired_writes(struct work_struct *work) {
+
+	LIST_HEAD(delivering);
+	struct pending_write *pending_write;
+	struct pending_write *temp_pending_write;
+	struct llist_node *expired;
+	struct message *new_message;
+	struct minor *minor;
+	struct minor *temp_minor;
+	int count;
+
+	//The llist is in LIFO order, so it is reversed to post the messages in the order their timers expired
+	expired = llist_reverse_order(llist_del_all(&expired_writes));
+
+	llist_for_each_entry_safe(pending_write, temp_pending_write, expired, expired_node) {
+		new_message = &(pending_write->message);
+		minor = pending_write->minor;
+
+		//From now on the message waits in the queue of the device file
+		trace_tms_deferred_publish(minor->minor_number, new_message->size, elapsed_ns(new_message->queued_at));
+		new_message->queued_at = ktime_get();
+
+		//If the session mapped the shared ring the message is copied on the ring, so the consumers can read it without
+		//syscalls; if the ring is full the message is posted on the queue of the device file instead
+		if (pending_write->to_shared_ring && post_on_shared_ring(minor, new_message)) {
+			release_storage(minor, new_message->shard, new_message->size, 1);
+			free_message(new_message);
+			put_channel(minor, 1);
+			continue;
+		}
+
+		//Batches are ordered from the newest to the oldest message, like the message list of the device file
+		if (minor->delivery_count == 0)
+			list_add_tail(&(minor->delivery_link), &delivering);
+		list_add(&(new_message->list), &(minor->delivery_batch));
+		minor->delivery_count++;
+	}
+
+	//The messages are effectly posted, then the pending writes stop being users of their channels
+	list_for_each_entry_safe(minor, temp_minor, &delivering, delivery_link) {
+		count = minor->delivery_count;
+		post_messages(minor, &(minor->delivery_batch), count);
+		INIT_LIST_HEAD(&(minor->delivery_batch));
+		minor->delivery_count = 0;
+		list_del(&(minor->delivery_link));
+
+		AUDIT
+		printk("%s: %d deferred writes completed on device [%d,%d]\n", MODULE_NAME, count, major_number, minor->minor_number);
+
+		put_channel(minor, count);
+	}
+}
+
+//drop_pending_write gives back the storage of a canceled pending write and deallocates it. It is the dispose callback of
+//core_revoke_pending, called holding pending_lock of the device file
+static void drop_pending_write(struct core_pending *pending, void *data) {
+	struct pending_write *pending_write = container_of(pending, struct pending_write, pending);
+
+	release_storage(pending_write->minor, pending_write->message.shard, pending_write->message.size, 1);
+	free_message(&(pending_write->message));
+}
+
+//cancel_pending_write stops the timer of a pending write and, if the timer had not expired yet, unlinks and deallocates the
+//pending write. It is called holding pending_lock of the device file and it returns false if the write is already being posted.
+//The caller drops the canceled writes as users of the channel, after releasing the lock
+static bool cancel_pending_write(struct pending_write *pending_write) {
+
+	if (!core_cancel_pending(&(pending_write->pending)))
+		return false;
+
+	drop_pending_write(&(pending_write->pending), NULL);
+	return true;
+}
+
+
+//get_send_timeout reads the send timeout of the session. A high resolution timeout is returned as an absolute CLOCK_MONOTONIC
+//deadline, otherwise deadline is zero and the timeout is in jiffies. It returns true if the posting has to be deferred. The
+//timeouts are read locklessly through the seqcount of the session, retrying if an ioctl changed them in the meantime
+static bool get_send_timeout(struct session *session, long *timeout, ktime_t *deadline) {
+	ktime_t timeout_ns;
+	bool is_deadline;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&(session->timeouts_seq));
+		*timeout = session->send_timeout;
+		timeout_ns = session->send_timeout_ns;
+		is_deadline = session->send_timeout_is_deadline;
+	} while (read_seqcount_retry(&(session->timeouts_seq), seq));
+
+	*deadline = 0;
+	if (timeout_ns != 0)
+		*deadline = is_deadline ? timeout_ns : ktime_add(ktime_get(), timeout_ns);
+
+	return *timeout != 0 || *deadline != 0;
+}
+
+//get_expiry returns the CLOCK_MONOTONIC time the messages written now by the session expire at, or zero if they don't expire
+static ktime_t get_expiry(struct session *session) {
+	ktime_t ttl;
+	bool is_deadline;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&(session->timeouts_seq));
+		ttl = session->message_ttl;
+		is_deadline = session->message_ttl_is_deadline;
+	} while (read_seqcount_retry(&(session->timeouts_seq), seq));
+
+	if (ttl == 0)
+		return 0;
+	return is_deadline ? ttl : ktime_add(ktime_get(), ttl);
+}
+
+//get_write_deadline returns the CLOCK_MONOTONIC time until which a write of the session started now can wait for room in the
+//storage, or zero if the write can't wait
+static ktime_t get_write_deadline(struct session *session) {
+	ktime_t timeout_ns;
+	bool is_deadline;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&(session->timeouts_seq));
+		timeout_ns = session->write_timeout_ns;
+		is_deadline = session->write_timeout_is_deadline;
+	} while (read_seqcount_retry(&(session->timeouts_seq), seq));
+
+	if (timeout_ns == 0)
+		return 0;
+	return is_deadline ? timeout_ns : ktime_add(ktime_get(), timeout_ns);
+}
+
+//wait_storage reserves the storage for count messages of len bytes in total, as reserve_storage. If the storage is full the
+//expired messages are dropped and, if the session has a write timeout, the writer sleeps until the messages fit, the timeout
+//expires, flush() is invoked or a signal arrives. The writers wait exclusively, in the order they started waiting, and the
+//storage released by reads, revokes and expired messages wakes up one of them; a writer that stops waiting passes the wake up
+//on, since the room left can fit the next one. It returns 0 if the storage is reserved, -EAGAIN if the storage is full for a
+//nonblocking write, -EINTR if a signal interrupts the wait, -1 if the write has to be aborted
+static int wait_storage(struct minor *minor, struct session *session, int shard, int priority, size_t len, int count,
+		bool nonblock) {
+
+	struct blocked_write *blocked_write;
+	int minor_number = minor->minor_number;
+	DEFINE_WAIT(wait);
+	ktime_t deadline;
+	bool expired = false;
+	bool reserved = false;
+	bool interrupted = false;
+	bool is_flushed;
+
+	if (reserve_storage(minor, shard, priority, len, count))
+		return 0;
+
+	//When the storage is full the expired messages are dropped, and the storage is checked again if any is dropped. A broadcast
+	//device file with BROADCAST_DROP drops the messages the lagging subscribers did not read in the same way
+	if (purge_expired(minor, true) > 0 && reserve_storage(minor, shard, priority, len, count))
+		return 0;
+	if (drop_lagging(minor, priority, len) > 0 && reserve_storage(minor, shard, priority, len, count))
+		return 0;
+
+	if (nonblock)
+		return -EAGAIN;
+
+	deadline = get_write_deadline(session);
+	if (deadline == 0)
+		return -1;
+
+	//The wait is linked to the blocked writes of the device file, so dev_flush() can abort it
+	blocked_write = kmalloc(sizeof(struct blocked_write), GFP_KERNEL);
+	if (blocked_write == NULL)
+		return -1;
+	blocked_write->is_flushed = false;
+	spin_lock(&(minor->operation_synchronizer));
+	list_add(&(blocked_write->list), &(minor->blocked_writes));
+	spin_unlock(&(minor->operation_synchronizer));
+
+	while (true) {
+		//The write timeout can be long, so the writer can be interrupted by a signal
+		prepare_to_wait_exclusive(&(minor->pending_writers_wq), &wait, TASK_INTERRUPTIBLE);
+		if (READ_ONCE(blocked_write->is_flushed))
+			break;
+		if (reserve_storage(minor, shard, priority, len, count)) {
+			reserved = true;
+			break;
+		}
+		if (signal_pending(current)) {
+			interrupted = true;
+			break;
+		}
+		if (expired)
+			break;
+		expired = schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS) == 0;
+	}
+	finish_wait(&(minor->pending_writers_wq), &wait);
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_del(&(blocked_write->list));
+	spin_unlock(&(minor->operation_synchronizer));
+	is_flushed = blocked_write->is_flushed;
+	kfree(blocked_write);
+
+	if (wq_has_sleeper(&(minor->pending_writers_wq)))
+		wake_up(&(minor->pending_writers_wq));
+
+	if (reserved)
+		return 0;
+
+	if (is_flushed) {
+		stats_inc(minor, flushed_writes);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: another process calls flush()\n", MODULE_NAME, major_number, minor_number);
+		return -1;
+	}
+
+	if (interrupted) {
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: interrupted by a signal\n", MODULE_NAME, major_number, minor_number);
+		return -EINTR;
+	}
+
+	stats_inc(minor, write_timeouts);
+	AUDIT
+	printk("%s: Write aborted on device [%d,%d]: not enough space after timeout expiration\n", MODULE_NAME, major_number, minor_number);
+	return -1;
+}
+
+//get_recv_timeout reads the receive timeout of the session in the same way as get_send_timeout. It returns true if a read can
+//block
+static bool get_recv_timeout(struct session *session, long *timeout, ktime_t *deadline) {
+	ktime_t timeout_ns;
+	bool is_deadline;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&(session->timeouts_seq));
+		*timeout = session->recv_timeout;
+		timeout_ns = session->recv_timeout_ns;
+		is_deadline = session->recv_timeout_is_deadline;
+	} while (read_seqcount_retry(&(session->timeouts_seq), seq));
+
+	*deadline = 0;
+	if (timeout_ns != 0)
+		*deadline = is_deadline ? timeout_ns : ktime_add(ktime_get(), timeout_ns);
+
+	return *timeout != 0 || *deadline != 0;
+}
+
+//send_delay returns the nanoseconds before the posting of a message deferred with send_timeout or send_deadline
+static s64 send_delay(long send_timeout, ktime_t send_deadline) {
+	if (send_deadline != 0)
+		return ktime_to_ns(ktime_sub(send_deadline, ktime_get()));
+	return jiffies_to_nsecs(send_timeout);
+}
+
+//handle_bucket returns the bucket of the handle index for a handle
+static struct hlist_head *handle_bucket(struct minor *minor, u64 handle) {
+	return &(minor->handle_index[hash_64(handle, HANDLE_HASH_BITS)]);
+}
+
+//create_handle_index allocates the handle index of a device file, when a session first asks for the handles of its writes
+static int create_handle_index(struct minor *minor) {
+	struct hlist_head *handle_index;
+	int i;
+
+	if (READ_ONCE(minor->handle_index) != NULL)
+		return 0;
+
+	handle_index = kmalloc_array(1 << HANDLE_HASH_BITS, sizeof(struct hlist_head), GFP_KERNEL);
+	if (handle_index == NULL)
+		return -ENOMEM;
+	for (i = 0; i < (1 << HANDLE_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&(handle_index[i]));
+
+	spin_lock_bh(&(minor->pending_lock));
+	if (minor->handle_index == NULL) {
+		minor->handle_index = handle_index;
+		handle_index = NULL;
+	}
+	spin_unlock_bh(&(minor->pending_lock));
+
+	kfree(handle_index);
+	return 0;
+}
+
+//find_pending_write returns the pending write with a handle, NULL if it has already been posted or canceled. It is called with
+//the lock of the pending writes
+static struct pending_write *find_pending_write(struct minor *minor, u64 handle) {
+	struct core_pending *pending;
+
+	if (minor->handle_index == NULL || handle == 0)
+		return NULL;
+
+	pending = core_find_pending(handle_bucket(minor, handle), handle);
+	return pending != NULL ? container_of(pending, struct pending_write, pending) : NULL;
+}
+
+//defer_messages schedules the posting of a batch of delayed messages after send_timeout jiffies or, if send_deadline is not
+//zero, at the CLOCK_MONOTONIC time send_deadline through a hrtimer. Each message of the batch is linked to the list of pending
+//writes of the session and its timer is started, taking the lock of the pending writes once for the whole batch. If the session
+//asked for handles, each message gets the next handle of the device file and it is indexed by it: the handle of the newest
+//message is returned, 0 otherwise. Handles are kept positive in an int, so a write and an io_uring completion can return them
+static u64 defer_messages(struct session *session, struct list_head *batch, long send_timeout, ktime_t send_deadline) {
+
+	struct minor *minor = session->minor;
+	struct message *message;
+	struct message *temp_message;
+	struct pending_write *pending_write;
+	struct hlist_head *bucket;
+	unsigned long expires = jiffies + send_timeout;
+	bool write_handles = READ_ONCE(session->write_handles);
+	u64 handle = 0;
+
+	spin_lock_bh(&(minor->pending_lock));
+	list_for_each_entry_safe_reverse(message, temp_message, batch, list) {
+		list_del(&(message->list));
+
+		pending_write = container_of(message, struct pending_write, message);
+		pending_write->minor = minor;
+		pending_write->to_shared_ring = READ_ONCE(session->shared_ring_mapped);
+		pending_write->pending.is_high_resolution = send_deadline != 0;
+		pending_write->pending.handle = 0;
+		bucket = NULL;
+		if (write_handles && minor->handle_index != NULL) {
+			pending_write->pending.handle = handle = core_next_handle(&(minor->next_handle));
+			bucket = handle_bucket(minor, handle);
+		}
+		core_link_pending(&(pending_write->pending), &(session->pending_writes), bucket);
+
+		//The pending write keeps the channel until it is posted or canceled, so the channel is never reclaimed under a timer
+		atomic_inc(&(minor->users));
+
+		if (pending_write->pending.is_high_resolution) {
+			hrtimer_setup(&(pending_write->pending.hrtimer), pending_write_hrtimer_expired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+			hrtimer_start(&(pending_write->pending.hrtimer), send_deadline, HRTIMER_MODE_ABS_SOFT);
+		} else {
+			timer_setup(&(pending_write->pending.timer), pending_write_expired, 0);
+			mod_timer(&(pending_write->pending.timer), expires);
+		}
+	}
+	spin_unlock_bh(&(minor->pending_lock));
+
+	return handle;
+}
+
+//cancel_delayed_message cancels the delayed message with a handle. It returns 0 if the message is canceled, -ENOENT if no message
+//has the handle or its timer already expired
+static long cancel_delayed_message(struct minor *minor, u64 handle) {
+	struct pending_write *pending_write;
+	bool canceled = false;
+
+	spin_lock_bh(&(minor->pending_lock));
+	pending_write = find_pending_write(minor, handle);
+	if (pending_write != NULL)
+		canceled = cancel_pending_write(pending_write);
+	spin_unlock_bh(&(minor->pending_lock));
+
+	if (!canceled)
+		return -ENOENT;
+
+	AUDIT
+	printk("%s: Deferred write %llu canceled on device [%d,%d]\n", MODULE_NAME, handle, major_number, minor->minor_number);
+
+	trace_tms_revoke(minor->minor_number, 1);
+	stats_inc(minor, revoked_messages);
+	put_channel(minor, 1);
+	return 0;
+}
+
+//reschedule_delayed_message moves the posting of the delayed message with a handle to the CLOCK_MONOTONIC time deadline. The
+//timer of the message is stopped and the message is driven by a hrtimer from then on, whatever timer it had. It returns 0 if
+//the message is rescheduled, -ENOENT if no message has the handle or its timer already expired
+static long reschedule_delayed_message(struct minor *minor, u64 handle, ktime_t deadline) {
+	struct pending_write *pending_write;
+	long outcome = -ENOENT;
+
+	spin_lock_bh(&(minor->pending_lock));
+	pending_write = find_pending_write(minor, handle);
+	if (pending_write != NULL && core_stop_pending(&(pending_write->pending))) {
+		if (!pending_write->pending.is_high_resolution) {
+			hrtimer_setup(&(pending_write->pending.hrtimer), pending_write_hrtimer_expired, CLOCK_MONOTONIC,
+					HRTIMER_MODE_ABS_SOFT);
+			pending_write->pending.is_high_resolution = true;
+		}
+		hrtimer_start(&(pending_write->pending.hrtimer), deadline, HRTIMER_MODE_ABS_SOFT);
+		outcome = 0;
+	}
+	spin_unlock_bh(&(minor->pending_lock));
+
+	return outcome;
+}
+
+//send_message posts a message of len bytes from the user buffer buff on the device file, as described for dev_write. If delay is
+//not zero it replaces the send timeout of the session: the message is posted delay nanoseconds after the write
+static ssize_t send_message(struct file *file, const char *buff, size_t len, bool nonblock, ktime_t delay) {
+
+	struct session *current_session;
+	struct message *new_message;
+	struct flow *flow;
+	u64 handle;
+	LIST_HEAD(batch);
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	int unwritten_chars;
+	int outcome;
+	long send_timeout;
+	ktime_t send_deadline;
+	bool is_delayed;
+	int priority;
+	int shard;
+
+	//Check if the size of message is too large
+	if (len > max_message_size) {
+		stats_inc(minor, oversize_rejections);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: too long message\n", MODULE_NAME, major_number, minor_number);
+		return -1;	
+	}		
+
+	//Check if the total size of messages in the device file is too large for the priority of the message. If the write can
+	//occur, the storage size of the device file is updated
+	current_session = (struct session*)(file->private_data);
+	flow = writer_flow(minor, current_session);
+	if (IS_ERR(flow))
+		return PTR_ERR(flow);
+	if (!charge_flow(flow, len)) {
+		stats_inc(minor, quota_rejections);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: storage quota of the session used up\n", MODULE_NAME, major_number, minor_number);
+		return -EDQUOT;
+	}
+	priority = READ_ONCE(current_session->send_priority);
+	shard = writer_shard(minor);
+	outcome = wait_storage(minor, current_session, shard, priority, len, 1, nonblock);
+	if (outcome < 0){
+		uncharge_flow(flow, len);
+		stats_inc(minor, full_rejections);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: not enough space for storing message\n", MODULE_NAME, major_number, minor_number);
+		return outcome;	
+	}
+
+	//Checking if the message has to be immediatly posted or not
+	if (delay != 0) {
+		send_timeout = 0;
+		send_deadline = ktime_add(ktime_get(), delay);
+		is_delayed = true;
+	} else {
+		is_delayed = get_send_timeout(current_session, &send_timeout, &send_deadline);
+	}
+
+	//The new message is created with a single allocation, as a pending write if its posting is deferred
+	new_message = alloc_message(minor->arena, len, is_delayed, shard, READ_ONCE(current_session->send_tag), priority);
+	if (new_message == NULL) {
+		release_storage(minor, shard, len, 1);
+		uncharge_flow(flow, len);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: not enough memory for message\n", MODULE_NAME, major_number, minor_number);
+		return -ENOMEM;
+	}
+	attach_flow(new_message, flow);
+	new_message->expires_at = get_expiry(current_session);
+	unwritten_chars = copy_message_from_user(new_message, buff, len);
+
+	if (!is_delayed){
+
+		//The message is immediatly posted
+		post_message(minor, new_message);
+		trace_tms_write(minor_number, len, 1);
+		stats_inc(minor, writes);
+		stats_inc(minor, written_messages);
+
+		AUDIT
+		printk("%s: Write done on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+		return len - unwritten_chars;
+
+	} else {
+
+		//The message posting is deferred
+		list_add(&(new_message->list), &batch);
+		handle = defer_messages(current_session, &batch, send_timeout, send_deadline);
+		trace_tms_write_deferred(minor_number, len, 1, send_delay(send_timeout, send_deadline));
+		stats_inc(minor, writes);
+		stats_inc(minor, deferred_messages);
+	
+		AUDIT
+		printk("%s: Write deferred on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+		//The handle is 0 unless the session asked for handles
+		return handle;
+	}
+
+}
+
+static ssize_t dev_write(struct file *file, const char *buff, size_t len, loff_t *off) {
+
+	AUDIT
+	printk("%s: Write called on device [%d,%d]\n", MODULE_NAME, major_number, get_minor(file));
+
+	return send_message(file, buff, len, file->f_flags & O_NONBLOCK, 0);
+}
+
+//wait_reading sleeps until a reading may be available, a message is handed off to pending_read, flush() is invoked or the timeout
+//expires: after timeout jiffies or, if deadline is not zero, at the CLOCK_MONOTONIC time deadline. A reader waiting for a handoff
+//is woken up directly by the writer, the others wait exclusively on the waitqueue of the device file. It returns 0 if the
+//timeout expired, otherwise the residual jiffies (at least 1)
+static long wait_reading(struct minor *minor, struct pending_read *pending_read, long timeout, ktime_t deadline) {
+
+	DEFINE_WAIT(wait);
+	bool expired = false;
+	bool ready;
+
+	while (true) {
+		if (pending_read->task == NULL)
+			prepare_to_wait_exclusive(&(minor->pending_readers_wq), &wait, TASK_UNINTERRUPTIBLE);
+		else
+			set_current_state(TASK_UNINTERRUPTIBLE);
+
+		ready = READ_ONCE(pending_read->is_flushed) || READ_ONCE(pending_read->message) != NULL ||
+				(pending_read->task == NULL && readings_available(minor));
+		if (ready || expired)
+			break;
+
+		if (deadline != 0) {
+			expired = schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS) == 0;
+		} else {
+			timeout = schedule_timeout(timeout);
+			expired = timeout == 0;
+		}
+	}
+	finish_wait(&(minor->pending_readers_wq), &wait);
+
+	if (!ready)
+		return 0;
+	return max(timeout, 1L);
+}
+
+//leave_pending_readings unlinks a blocked read from the device file and returns the message handed off to it, if any. A writer
+//can hand off a message until the read is unlinked, even after its timeout expired
+static struct message *leave_pending_readings(struct minor *minor, struct pending_read *pending_read) {
+	struct message *message;
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_del(&(pending_read->list));
+	list_del(&(pending_read->handoff_link));
+	message = pending_read->message;
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return message;
+}
+
+//claim_reading claims one of the available readings of the device file. If there are none and recv_timeout is not zero, the
+//thread sleeps until a message is posted, the timeout expires or flush() is invoked; if recv_deadline is not zero the thread
+//sleeps with a high resolution wait until the CLOCK_MONOTONIC time recv_deadline instead. A nonblocking read never sleeps. With
+//reader_handoff the thread can receive the message from the writer: the message is appended to batch. It returns 0 if a reading
+//is claimed, 1 if a message has been handed off, -EAGAIN if there are no readings for a nonblocking read, -1 if the read has to
+//be aborted
+static int claim_reading(struct minor *minor, long recv_timeout, ktime_t recv_deadline, bool nonblock, int *shard,
+		struct list_head *batch) {
+
+	struct pending_read *pending_read = NULL;
+	struct message *message;
+	int minor_number = minor->minor_number;
+	long wait_outcome;
+	ktime_t wait_start;
+	bool is_flushed;
+	bool is_handoff;
+	bool claimed = false;
+
+	//Checking if on the device there are available messages. If there are, one of them is claimed by this reader
+	if (try_claim_reading(minor, shard))
+		return 0;
+
+	if (nonblock)
+		return -EAGAIN;
+
+	if (recv_timeout == 0 && recv_deadline == 0) {
+		//Non blocking read
+
+		AUDIT
+		printk("%s: Read aborted on device [%d,%d]: not messages to read\n", MODULE_NAME, major_number, minor_number);
+		return -1;
+	}
+
+	//Blocking read
+
+	//A pending_reading struct is allocated and linked whit the other pending readings for the device file.
+	//That list will be used in case of invocation of dev_flush()
+	pending_read = kmalloc(sizeof(struct pending_read), GFP_KERNEL);
+	if (pending_read == NULL)
+		return -1;
+	pending_read -> is_flushed = false;
+	pending_read->task = NULL;
+	pending_read->message = NULL;
+	INIT_LIST_HEAD(&(pending_read->list));
+	INIT_LIST_HEAD(&(pending_read->handoff_link));
+
+	spin_lock(&(minor->operation_synchronizer));
+	list_add(&(pending_read->list), &(minor->pending_readings));
+	//With the direct handoff the reader is queued for the next message. Once a reader is queued the writers of the list engine
+	//post under the lock of the device file, not on the tail, so a message posted after the first check is claimed here
+	if (READ_ONCE(reader_handoff) && minor->engine == QUEUE_ENGINE_LIST && READ_ONCE(minor->ordering) == ORDERING_FIFO) {
+		pending_read->task = current;
+		spin_lock(&(minor->tail_lock));
+		list_add_tail(&(pending_read->handoff_link), &(minor->handoff_readers));
+		spin_unlock(&(minor->tail_lock));
+		if (try_claim_reading(minor, shard)) {
+			list_del(&(pending_read->list));
+			list_del(&(pending_read->handoff_link));
+			spin_unlock(&(minor->operation_synchronizer));
+			kfree(pending_read);
+			return 0;
+		}
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+	wait_start = ktime_get();
+
+	while(true){
+		//The thread sleeps until a reading may be available or timeout expires. A high resolution wait sleeps until the
+		//deadline, so it doesn't need the residual time
+		wait_outcome = wait_reading(minor, pending_read, recv_timeout, recv_deadline);
+
+		//Timer expired before wait condition changes, another thread invoked flush on the device file or a writer handed
+		//off a message: in every case the reading ends
+		if (wait_outcome == 0 || pending_read->is_flushed || READ_ONCE(pending_read->message) != NULL)
+			break;
+
+		//If the thread reachs this point of code it means the condition changes before timer expiration.
+		//However, another reader could have claimed the message: the thread returns to sleep with the residual time
+		if (try_claim_reading(minor, shard)) {
+			claimed = true;
+			break;
+		}
+		recv_timeout = wait_outcome;
+	}
+
+	//The pending_read struct is removed from the list in the device file and it is deallocated
+	message = leave_pending_readings(minor, pending_read);
+	is_flushed = pending_read->is_flushed;
+	is_handoff = pending_read->task != NULL;
+	kfree(pending_read);
+	record_read_wait(minor, wait_start);
+
+	//A message handed off is read even if flush() is invoked or the timeout expires in the meantime, otherwise it would be lost
+	if (message != NULL) {
+		*shard = SHARD_NONE;
+		list_add_tail(&(message->list), batch);
+		return 1;
+	}
+
+	if (claimed)
+		return 0;
+
+	if (is_flushed) {
+		stats_inc(minor, flushed_reads);
+
+		AUDIT
+		printk("%s: Read aborted on device [%d,%d]: another process calls flush()\n", 
+			MODULE_NAME, major_number, minor_number);
+		return -1;
+	}
+
+	//An exclusive waiter could have been woken up for a message just before its timeout expired: the wake up is passed on to
+	//the next waiter
+	if (!is_handoff && readings_available(minor))
+		wake_readers(minor, 1);
+	trace_tms_read_timeout(minor_number, elapsed_ns(wait_start));
+	stats_inc(minor, read_timeouts);
+
+	AUDIT
+	printk("%s: Read aborted on device [%d,%d]: not messages to read after timeout expiration\n", 
+		MODULE_NAME, major_number, minor_number);
+	return -1;
+}
+
+//create_tag_index allocates the tag index of the device file, the first time a session uses the tags
+static int create_tag_index(struct minor *minor) {
+	struct list_head *tag_index;
+	int i;
+
+	if (READ_ONCE(minor->tag_index) != NULL)
+		return 0;
+
+	tag_index = kmalloc_array(1 << TAG_HASH_BITS, sizeof(struct list_head), GFP_KERNEL);
+	if (tag_index == NULL)
+		return -ENOMEM;
+	for (i = 0; i < (1 << TAG_HASH_BITS); i++)
+		INIT_LIST_HEAD(&(tag_index[i]));
+
+	//The index is installed under the lock of the device file and the tail lock, so every message posted afterwards is indexed
+	spin_lock(&(minor->operation_synchronizer));
+	spin_lock(&(minor->tail_lock));
+	if (minor->tag_index == NULL) {
+		WRITE_ONCE(minor->tag_index, tag_index);
+		tag_index = NULL;
+	}
+	spin_unlock(&(minor->tail_lock));
+	spin_unlock(&(minor->operation_synchronizer));
+
+	kfree(tag_index);
+	return 0;
+}
+
+//take_message claims a reading for a message of the queue of the device file and moves the message to batch. The
+//readings claimed by the other readers are for the oldest messages, and they leave enough messages only while
+//available_readings is positive. It is called with the lock of the device file held
+static bool take_message(struct minor *minor, struct message *message, struct list_head *batch) {
+
+	if (atomic_dec_if_positive(&(minor->available_readings)) < 0)
+		return false;
+
+	remove_message(minor, message);
+	list_add_tail(&(message->list), batch);
+	return true;
+}
+
+//take_tagged_messages removes from the queue of the device file up to count of the oldest messages whose tag matches tag in the
+//bits of mask, appending them to batch, and returns their number. An exact filter (mask of all ones) walks only the bucket of
+//the tag in the tag index, so it takes the messages in the order they were posted; another mask scans the queues of the priority
+//levels, from the highest. The matching messages given back by unread_message are taken first. retry is set if a matching message
+//is left to the readers that have already claimed it
+static int take_tagged_messages(struct minor *minor, u64 tag, u64 mask, int count, struct list_head *batch, bool *retry) {
+
+	struct message *message;
+	struct message *temp_message;
+	int taken = 0;
+	int level;
+
+	*retry = false;
+	spin_lock(&(minor->operation_synchronizer));
+	list_for_each_entry_safe(message, temp_message, &(minor->requeued), list) {
+		if (taken == count)
+			break;
+		if (mask == ~0ULL ? message->tag != tag : message->tag == 0 || (message->tag & mask) != (tag & mask))
+			continue;
+		if (atomic_dec_if_positive(&(minor->available_readings)) < 0) {
+			*retry = true;
+			break;
+		}
+		list_move_tail(&(message->list), batch);
+		taken++;
+	}
+	drain_incoming(minor);
+	if (mask == ~0ULL && !*retry) {
+		list_for_each_entry_safe_reverse(message, temp_message, tag_bucket(minor, tag), tag_link) {
+			if (taken == count)
+				break;
+			if (message->tag != tag)
+				continue;
+			if (!take_message(minor, message, batch)) {
+				*retry = true;
+				break;
+			}
+			taken++;
+		}
+	} else {
+		for (level = PRIORITY_LEVELS - 1; level >= 0 && taken < count && !*retry; level--) {
+			list_for_each_entry_safe_reverse(message, temp_message, level_queue(minor, level), list) {
+				if (taken == count)
+					break;
+				if (message->tag == 0 || (message->tag & mask) != (tag & mask))
+					continue;
+				if (!take_message(minor, message, batch)) {
+					*retry = true;
+					break;
+				}
+				taken++;
+			}
+		}
+	}
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return taken;
+}
+
+//message_expired returns true if the time to live of a message is over at now
+static bool message_expired(struct message *message, ktime_t now) {
+	return message->expires_at != 0 && ktime_after(now, message->expires_at);
+}
+
+//release_expired gives back to the caches the expired messages of a list, taken from the queue of the device file or from shard,
+//and releases their storage. It returns their number
+static int release_expired(struct minor *minor, int shard, struct list_head *expired) {
+
+	struct message *message;
+	struct message *temp_message;
+	size_t storage_freed = 0;
+	int count = 0;
+
+	list_for_each_entry_safe(message, temp_message, expired, list) {
+		storage_freed += message->size;
+		count++;
+		list_del(&(message->list));
+		free_message(message);
+	}
+
+	if (count > 0) {
+		release_storage(minor, shard, storage_freed, count);
+		trace_tms_expire(minor->minor_number, count);
+		stats_add(minor, expired_messages, count);
+	}
+	return count;
+}
+
+//purge_expired drops the expired messages of a device file with the list engine and the FIFO ordering, and returns their number.
+//Without full only the oldest messages of each level are checked, until the first one not expired; otherwise the whole queues are
+//scanned. A message is dropped only if a reading can be claimed for it, as for the tagged reads
+static int purge_expired(struct minor *minor, bool full) {
+
+	struct message *message;
+	struct message *temp_message;
+	LIST_HEAD(expired);
+	ktime_t now;
+	int level;
+
+	if (!READ_ONCE(minor->ttl_used) || minor->engine != QUEUE_ENGINE_LIST || READ_ONCE(minor->ordering) != ORDERING_FIFO)
+		return 0;
+
+	now = ktime_get();
+	spin_lock(&(minor->operation_synchronizer));
+	drain_incoming(minor);
+	for (level = PRIORITY_LEVELS - 1; level >= 0; level--) {
+		list_for_each_entry_safe_reverse(message, temp_message, level_queue(minor, level), list) {
+			if (!message_expired(message, now)) {
+				if (!full)
+					break;
+				continue;
+			}
+			if (!take_message(minor, message, &expired))
+				goto out;
+		}
+	}
+out:
+	spin_unlock(&(minor->operation_synchronizer));
+
+	return release_expired(minor, SHARD_NONE, &expired);
+}
+
+//drop_expired drops the expired messages of a batch taken from the queue of the device file or from shard, and returns their
+//number. The readings claimed for them are consumed
+static int drop_expired(struct minor *minor, int shard, struct list_head *batch) {
+
+	struct message *message;
+	struct message *temp_message;
+	LIST_HEAD(expired);
+	ktime_t now;
+
+	if (!READ_ONCE(minor->ttl_used))
+		return 0;
+
+	now = ktime_get();
+	list_for_each_entry_safe(message, temp_message, batch, list) {
+		if (message_expired(message, now))
+			list_move_tail(&(message->list), &expired);
+	}
+	return release_expired(minor, shard, &expired);
+}
+
+//reaper_period returns the delay of the next run of the reaper. While the reaper is disabled the work only checks the parameter
+//again
+static unsigned long reaper_period(void) {
+	int period_ms = READ_ONCE(ttl_reap_ms);
+
+	return msecs_to_jiffies(period_ms > 0 ? period_ms : DEFAULT_TTL_REAP_MS);
+}
+
+//enable_ttl marks a channel as used with a time to live. The first channel with a time to live starts the reaper, which stops
+//when the last one is reclaimed
+static void enable_ttl(struct minor *minor) {
+	bool first;
+
+	spin_lock(&(minor->operation_synchronizer));
+	first = !minor->ttl_used;
+	WRITE_ONCE(minor->ttl_used, true);
+	spin_unlock(&(minor->operation_synchronizer));
+
+	if (first && atomic_inc_return(&ttl_channels) == 1)
+		schedule_delayed_work(&reaper_work, reaper_period());
+}
+
+//reap_expired_messages is the periodic work that scans the device files with a time to live for expired messages. Each channel
+//is taken as a user under the lock of the table, so a channel left with expired messages only is reclaimed once they are dropped.
+//The work is armed again only while some channel has a time to live: enable_ttl arms it for the next one, and a work already
+//running is queued again
+static void reap_expired_messages(struct work_struct *work) {
+
+	struct minor *minor;
+	unsigned long minor_number;
+
+	if (READ_ONCE(ttl_reap_ms) <= 0)
+		goto out;
+
+	xa_for_each(&channels, minor_number, minor) {
+		xa_lock(&channels);
+		minor = xa_load(&channels, minor_number);
+		if (minor == NULL || !READ_ONCE(minor->ttl_used)) {
+			xa_unlock(&channels);
+			continue;
+		}
+		atomic_inc(&(minor->users));
+		xa_unlock(&channels);
+
+		purge_expired(minor, true);
+		put_channel(minor, 1);
+		cond_resched();
+	}
+
+out:
+	if (atomic_read(&ttl_channels) > 0)
+		schedule_delayed_work(&reaper_work, reaper_period());
+}
+
+//claim_tagged_messages is claim_reading for a session with a tag filter: it takes up to count messages matching the filter,
+//appending them to batch, and returns their number. The filtered readers wait on the waitqueue of the device file without
+//exclusion, until a tagged message is posted. The filter is supported by the device files with the list engine and the FIFO
+//ordering, otherwise it returns -EOPNOTSUPP. The other errors are the ones of claim_reading
+static int claim_tagged_messages(struct minor *minor, u64 tag, u64 mask, int count, long recv_timeout, ktime_t recv_deadline,
+		bool nonblock, struct list_head *batch) {
+
+	struct pending_read *pending_read = NULL;
+	int minor_number = minor->minor_number;
+	unsigned long sequence;
+	long wait_outcome;
+	ktime_t wait_start = 0;
+	bool retry;
+	int taken;
+
+	if (minor->engine != QUEUE_ENGINE_LIST || READ_ONCE(minor->ordering) != ORDERING_FIFO || READ_ONCE(minor->tag_index) == NULL)
+		return -EOPNOTSUPP;
+
+	while (true) {
+		//The sequence is read before looking for the messages, so a tagged message posted in the meantime ends the wait
+		sequence = READ_ONCE(minor->tag_sequence);
+		taken = take_tagged_messages(minor, tag, mask, count, batch, &retry);
+		if (taken > 0)
+			break;
+
+		//The readers that claimed the matching messages are about to fetch them: the queue is checked again
+		if (retry) {
+			cond_resched();
+			continue;
+		}
+
+		if (nonblock) {
+			taken = -EAGAIN;
+			break;
+		}
+
+		if (recv_timeout == 0 && recv_deadline == 0) {
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: not messages matching the filter\n", MODULE_NAME, major_number, minor_number);
+			taken = -1;
+			break;
+		}
+
+		//The wait is linked to the pending readings of the device file, so dev_flush() can abort it
+		if (pending_read == NULL) {
+			pending_read = kzalloc(sizeof(struct pending_read), GFP_KERNEL);
+			if (pending_read == NULL)
+				return -1;
+			INIT_LIST_HEAD(&(pending_read->list));
+			INIT_LIST_HEAD(&(pending_read->handoff_link));
+			spin_lock(&(minor->operation_synchronizer));
+			list_add(&(pending_read->list), &(minor->pending_readings));
+			spin_unlock(&(minor->operation_synchronizer));
+			wait_start = ktime_get();
+		}
+
+		if (recv_deadline != 0)
+			wait_outcome = wait_event_hrtimeout(minor->pending_readers_wq,
+							READ_ONCE(minor->tag_sequence) != sequence || pending_read->is_flushed,
+							ktime_sub(recv_deadline, ktime_get())) == 0;
+		else
+			wait_outcome = wait_event_timeout(minor->pending_readers_wq,
+							READ_ONCE(minor->tag_sequence) != sequence || pending_read->is_flushed, recv_timeout);
+
+		if (pending_read->is_flushed) {
+			stats_inc(minor, flushed_reads);
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: another process calls flush()\n", MODULE_NAME, major_number, minor_number);
+			taken = -1;
+			break;
+		}
+
+		if (wait_outcome == 0) {
+			trace_tms_read_timeout(minor_number, elapsed_ns(wait_start));
+			stats_inc(minor, read_timeouts);
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: not messages matching the filter after timeout expiration\n",
+				MODULE_NAME, major_number, minor_number);
+			taken = -1;
+			break;
+		}
+		recv_timeout = wait_outcome;
+	}
+
+	if (pending_read != NULL) {
+		leave_pending_readings(minor, pending_read);
+		kfree(pending_read);
+		record_read_wait(minor, wait_start);
+	}
+
+	return taken;
+}
+
+//claim_broadcast takes the next message of the broadcast log for a subscriber, storing it in message with a reference for the
+//read. If the subscriber read the whole log, the thread sleeps as in claim_reading until a message is posted, the timeout expires
+//or flush() is invoked; the wait is not exclusive, since a post is for every subscriber. It returns 0 if a message is taken,
+//-EAGAIN if there are none for a nonblocking read, -1 if the read has to be aborted
+static int claim_broadcast(struct minor *minor, struct session *session, long recv_timeout, ktime_t recv_deadline, bool nonblock,
+		struct message **message) {
+
+	struct pending_read *pending_read = NULL;
+	int minor_number = minor->minor_number;
+	long wait_outcome;
+	ktime_t wait_start = 0;
+	int outcome = 0;
+
+	while ((*message = take_broadcast(minor, session)) == NULL) {
+		if (nonblock) {
+			outcome = -EAGAIN;
+			break;
+		}
+
+		if (recv_timeout == 0 && recv_deadline == 0) {
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: not messages to read\n", MODULE_NAME, major_number, minor_number);
+			outcome = -1;
+			break;
+		}
+
+		//The wait is linked to the pending readings of the device file, so dev_flush() can abort it
+		if (pending_read == NULL) {
+			pending_read = kzalloc(sizeof(struct pending_read), GFP_KERNEL);
+			if (pending_read == NULL)
+				return -1;
+			INIT_LIST_HEAD(&(pending_read->list));
+			INIT_LIST_HEAD(&(pending_read->handoff_link));
+			spin_lock(&(minor->operation_synchronizer));
+			list_add(&(pending_read->list), &(minor->pending_readings));
+			spin_unlock(&(minor->operation_synchronizer));
+			wait_start = ktime_get();
+		}
+
+		if (recv_deadline != 0)
+			wait_outcome = wait_event_hrtimeout(minor->pending_readers_wq,
+							READ_ONCE(session->cursor) != NULL || pending_read->is_flushed,
+							ktime_sub(recv_deadline, ktime_get())) == 0;
+		else
+			wait_outcome = wait_event_timeout(minor->pending_readers_wq,
+							READ_ONCE(session->cursor) != NULL || pending_read->is_flushed, recv_timeout);
+
+		if (pending_read->is_flushed) {
+			stats_inc(minor, flushed_reads);
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: another process calls flush()\n", MODULE_NAME, major_number, minor_number);
+			outcome = -1;
+			break;
+		}
+
+		if (wait_outcome == 0) {
+			trace_tms_read_timeout(minor_number, elapsed_ns(wait_start));
+			stats_inc(minor, read_timeouts);
+			AUDIT
+			printk("%s: Read aborted on device [%d,%d]: not messages to read after timeout expiration\n", MODULE_NAME,
+				major_number, minor_number);
+			outcome = -1;
+			break;
+		}
+		recv_timeout = wait_outcome;
+	}
+
+	if (pending_read != NULL) {
+		leave_pending_readings(minor, pending_read);
+		kfree(pending_read);
+		record_read_wait(minor, wait_start);
+	}
+
+	return outcome;
+}
+
+//receive_message takes the message a read of the session returns: the next message of the log in broadcast mode, the oldest
+//matching message for a session with a tag filter, otherwise the message of a claimed reading. The read occurs here: the message
+//is taken from the queue, unless a writer handed it off. The expired messages are dropped when they are met, at the head of the
+//queues and after the message is taken: if the message taken expired, the read starts again. shard is set to where the storage
+//of the message has to be given back, SHARD_BROADCAST for a message of the log. It returns 0 if a message is taken
+static int receive_message(struct file *file, bool nonblock, struct message **message, int *shard) {
+
+	struct session *current_session = (struct session*)(file->private_data);
+	struct minor *minor = get_channel(file);
+	LIST_HEAD(batch);
+	unsigned long read_start = jiffies;
+	unsigned long elapsed;
+	long recv_timeout;
+	long timeout;
+	ktime_t recv_deadline;
+	u64 filter_mask;
+	int outcome;
+
+	//Checking if the read has to be blocking or not
+	get_recv_timeout(current_session, &recv_timeout, &recv_deadline);
+
+	if (READ_ONCE(minor->broadcast) != BROADCAST_OFF) {
+		*shard = SHARD_BROADCAST;
+		return claim_broadcast(minor, current_session, recv_timeout, recv_deadline, nonblock, message);
+	}
+
+	purge_expired(minor, false);
+	filter_mask = READ_ONCE(current_session->filter_mask);
+	do {
+		//A read that starts again after an expired message waits only for the rest of the timeout. A deadline is already
+		//absolute, so it holds for every attempt
+		timeout = recv_timeout;
+		elapsed = jiffies - read_start;
+		if (recv_deadline == 0 && recv_timeout != 0)
+			timeout = (unsigned long)recv_timeout > elapsed ? recv_timeout - elapsed : 0;
+
+		if (filter_mask != 0) {
+			outcome = claim_tagged_messages(minor, READ_ONCE(current_session->filter_tag), filter_mask, 1, timeout,
+					recv_deadline, nonblock, &batch);
+			if (outcome < 0)
+				return outcome;
+			*shard = SHARD_NONE;
+		} else {
+			outcome = claim_reading(minor, timeout, recv_deadline, nonblock, shard, &batch);
+			if (outcome < 0)
+				return outcome;
+			if (outcome == 0)
+				fetch_messages(minor, *shard, 1, &batch);
+		}
+		drop_expired(minor, *shard, &batch);
+	} while (list_empty(&batch));
+
+	*message = list_first_entry(&batch, struct message, list);
+	list_del_init(&((*message)->list));
+	return 0;
+}
+
+//finish_read accounts a message returned by receive_message as read and gives it back: a message of the broadcast log drops the
+//reference of the read, the others give back their storage and are freed. A delayed message has already been unlinked from its
+//session when it was posted
+static void finish_read(struct minor *minor, int shard, struct message *message) {
+	record_read(minor, minor->minor_number, message);
+	stats_inc(minor, reads);
+	stats_inc(minor, read_messages);
+
+	if (shard == SHARD_BROADCAST) {
+		put_broadcast(minor, message);
+		return;
+	}
+	release_storage(minor, shard, message->size, 1);
+	free_message(message);
+}
+
+//unread_message gives back a message returned by receive_message that the read could not deliver whole, so the next read of the
+//session returns it again. A message of the broadcast log goes back under the cursor of the session, into the log again if it
+//left it, being then older than all the messages still there. The others go on the requeued messages of the device file, and
+//their reading is made available again on the shard it was claimed on
+static void unread_message(struct file *file, int shard, struct message *message) {
+
+	struct session *current_session = (struct session*)(file->private_data);
+	struct minor *minor = get_channel(file);
+
+	spin_lock(&(minor->operation_synchronizer));
+	if (shard == SHARD_BROADCAST) {
+		if (list_empty(&(message->list))) {
+			refcount_inc(&(message->references));
+			list_add(&(message->list), &(minor->broadcast_log));
+		}
+		message->subscribers++;
+		WRITE_ONCE(current_session->cursor, message);
+		spin_unlock(&(minor->operation_synchronizer));
+		put_broadcast(minor, message);
+		return;
+	}
+	message->shard = shard;
+	list_add_tail(&(message->list), &(minor->requeued));
+	spin_unlock(&(minor->operation_synchronizer));
+
+	if (shard == SHARD_NONE)
+		atomic_inc(&(minor->available_readings));
+	else
+		atomic_inc(&(per_cpu_ptr(minor->shards, shard)->available_readings));
+	wake_readers(minor, 1);
+}
+
+static ssize_t dev_read(struct file *file, char *buff, size_t len, loff_t *off) {
+
+	struct message *message_to_read;
+	int unread_chars;
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	int outcome;
+	int shard;
+
+	AUDIT
+	printk("%s: Read called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	outcome = receive_message(file, file->f_flags & O_NONBLOCK, &message_to_read, &shard);
+	if (outcome < 0)
+		return outcome;
+
+	if (message_to_read->size < len){
+		len = message_to_read->size;	
+	}
+	unread_chars = copy_message_to_user(message_to_read, buff, len);
+	if (len > 0 && unread_chars == len) {
+		unread_message(file, shard, message_to_read);
+		return -EFAULT;
+	}
+	finish_read(minor, shard, message_to_read);
+
+	AUDIT	
+	printk("%s: Read done on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	return len - unread_chars;
+}
+
+//free_batch gives back to the caches the messages of a batch that has not been posted
+static void free_batch(struct list_head *batch) {
+	struct message *message;
+	struct message *temp_message;
+
+	list_for_each_entry_safe(message, temp_message, batch, list) {
+		list_del(&(message->list));
+		free_message(message);
+	}
+}
+
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+	struct file *file = iocb->ki_filp;
+	struct session *current_session;
+	struct message *new_message;
+	struct flow *flow;
+	struct iov_iter segments;
+	LIST_HEAD(batch);
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	size_t segment_size;
+	size_t total_size = 0;
+	ssize_t written_chars = 0;
+	u64 handle;
+	int count = 0;
+	int allocated = 0;
+	long send_timeout;
+	ktime_t send_deadline;
+	ktime_t expires_at;
+	bool is_delayed;
+	int priority;
+	int outcome;
+	int shard;
+
+	AUDIT
+	printk("%s: Vectored write called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	//The segments are walked a first time to check the size of each message and to compute the storage needed by the batch
+	segments = *from;
+	while (iov_iter_count(&segments) > 0) {
+		segment_size = iov_iter_single_seg_count(&segments);
+		if (segment_size > max_message_size) {
+			stats_inc(minor, oversize_rejections);
+			AUDIT
+			printk("%s: Vectored write aborted on device [%d,%d]: too long message\n", MODULE_NAME, major_number, minor_number);
+			return -1;
+		}
+		total_size += segment_size;
+		count++;
+		iov_iter_advance(&segments, segment_size);
+	}
+
+	if (count == 0)
+		return 0;
+
+	//A write submitted with the real-time I/O priority class (e.g. the ioprio of an io_uring request) overrides the priority of
+	//the session: the I/O priority 0, the highest one, is mapped on the highest level
+	current_session = (struct session*)(file->private_data);
+	priority = READ_ONCE(current_session->send_priority);
+	if (IOPRIO_PRIO_CLASS(iocb->ki_ioprio) == IOPRIO_CLASS_RT)
+		priority = PRIORITY_LEVELS - 1 - min_t(int, IOPRIO_PRIO_DATA(iocb->ki_ioprio), PRIORITY_LEVELS - 1);
+	if (priority != 0 && !READ_ONCE(minor->priorities_used))
+		WRITE_ONCE(minor->priorities_used, true);
+
+	//The storage for the whole batch is reserved at once: either all the messages are written or none of them
+	flow = writer_flow(minor, current_session);
+	if (IS_ERR(flow))
+		return PTR_ERR(flow);
+	if (!charge_flow(flow, total_size)) {
+		stats_inc(minor, quota_rejections);
+		AUDIT
+		printk("%s: Vectored write aborted on device [%d,%d]: storage quota of the session used up\n", MODULE_NAME, major_number, minor_number);
+		return -EDQUOT;
+	}
+	shard = writer_shard(minor);
+	outcome = wait_storage(minor, current_session, shard, priority, total_size, count,
+			(file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+	if (outcome < 0){
+		uncharge_flow(flow, total_size);
+		stats_inc(minor, full_rejections);
+		AUDIT
+		printk("%s: Vectored write aborted on device [%d,%d]: not enough space for storing messages\n", MODULE_NAME, major_number, minor_number);
+		return outcome;	
+	}
+
+	is_delayed = get_send_timeout(current_session, &send_timeout, &send_deadline);
+	expires_at = get_expiry(current_session);
+
+	//A message is created for each segment. The batch is ordered from the newest to the oldest message
+	while (iov_iter_count(from) > 0) {
+		segment_size = iov_iter_single_seg_count(from);
+		new_message = alloc_message(minor->arena, segment_size, is_delayed, shard, READ_ONCE(current_session->send_tag), priority);
+		if (new_message == NULL) {
+			free_batch(&batch);
+			release_storage(minor, shard, total_size, count);
+			uncharge_flow(flow, total_size);
+			//A message gives back its slot of the arena when it is freed, the failed one too, so only the slots reserved for
+			//the messages not created are released here
+			if (minor->arena != NULL)
+				atomic_sub(count - allocated - 1, &(minor->arena->reserved_slots));
+			AUDIT
+			printk("%s: Vectored write aborted on device [%d,%d]: not enough memory for messages\n", MODULE_NAME, major_number, minor_number);
+			return -ENOMEM;
+		}
+		new_message->expires_at = expires_at;
+		written_chars += copy_message_from_iter(new_message, from);
+		list_add(&(new_message->list), &batch);
+		allocated++;
+	}
+
+	//The bytes charged to the flow go to the messages only once the whole batch exists, so a failed batch is uncharged at once
+	if (flow != NULL) {
+		list_for_each_entry(new_message, &batch, list)
+			attach_flow(new_message, flow);
+	}
+
+	if (!is_delayed){
+
+		//The batch is immediatly posted
+		post_messages(minor, &batch, count);
+		trace_tms_write(minor_number, total_size, count);
+		stats_inc(minor, writes);
+		stats_add(minor, written_messages, count);
+
+		AUDIT
+		printk("%s: Vectored write of %d messages done on device [%d,%d]\n", MODULE_NAME, count, major_number, minor_number);
+
+		return written_chars;
+
+	} else {
+
+		//The posting of the batch is deferred. With handles the messages take consecutive ones and the last is returned
+		handle = defer_messages(current_session, &batch, send_timeout, send_deadline);
+		trace_tms_write_deferred(minor_number, total_size, count, send_delay(send_timeout, send_deadline));
+		stats_inc(minor, writes);
+		stats_add(minor, deferred_messages, count);
+
+		AUDIT
+		printk("%s: Vectored write of %d messages deferred on device [%d,%d]\n", MODULE_NAME, count, major_number, minor_number);
+
+		return handle;
+	}
+}
+
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+	struct file *file = iocb->ki_filp;
+	struct session *current_session;
+	struct message *message_to_read;
+	struct message *temp_message;
+	LIST_HEAD(batch);
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	size_t segment_size;
+	size_t wanted_chars;
+	size_t copied_chars;
+	size_t storage_freed = 0;
+	ssize_t read_chars = 0;
+	bool faulted = false;
+	int read_count = 0;
+	int count = 1;
+	long recv_timeout;
+	ktime_t recv_deadline;
+	u64 filter_mask;
+	int outcome;
+	int shard;
+
+	AUDIT
+	printk("%s: Vectored read called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	current_session = (struct session*)(file->private_data);
+	get_recv_timeout(current_session, &recv_timeout, &recv_deadline);
+
+	//In broadcast mode the first message is taken as in dev_read, so the call can block, and the next ones while the session has
+	//messages of the log to read, up to one for each segment
+	if (READ_ONCE(minor->broadcast) != BROADCAST_OFF) {
+		outcome = claim_broadcast(minor, current_session, recv_timeout, recv_deadline,
+				(file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT), &message_to_read);
+		if (outcome < 0)
+			return outcome;
+		//A copy that faults before the first byte gives the message back, as in dev_read, and ends the read
+		do {
+			segment_size = iov_iter_single_seg_count(to);
+			wanted_chars = min(segment_size, message_to_read->size);
+			copied_chars = copy_message_to_iter(message_to_read, wanted_chars, to);
+			if (wanted_chars > 0 && copied_chars == 0) {
+				unread_message(file, SHARD_BROADCAST, message_to_read);
+				faulted = true;
+				break;
+			}
+			read_chars += copied_chars;
+			iov_iter_advance(to, segment_size - copied_chars);
+			record_read(minor, minor_number, message_to_read);
+			put_broadcast(minor, message_to_read);
+			read_count++;
+		} while (copied_chars == wanted_chars && iov_iter_count(to) > 0 &&
+				(message_to_read = take_broadcast(minor, current_session)) != NULL);
+		if (read_count == 0)
+			return -EFAULT;
+		stats_inc(minor, reads);
+		stats_add(minor, read_messages, read_count);
+		return read_chars;
+	}
+
+	//The first reading is claimed as in dev_read, so it can block. The others are claimed only while there are available
+	//readings, up to one for each segment. A message handed off by a writer is already in the batch. The expired messages are
+	//dropped as in dev_read
+	purge_expired(minor, false);
+	filter_mask = READ_ONCE(current_session->filter_mask);
+	do {
+		if (filter_mask != 0) {
+			//A session with a tag filter takes up to one matching message for each segment at once
+			count = claim_tagged_messages(minor, READ_ONCE(current_session->filter_tag), filter_mask, to->nr_segs, recv_timeout,
+					recv_deadline, (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT), &batch);
+			if (count < 0)
+				return count;
+			shard = SHARD_NONE;
+		} else {
+			outcome = claim_reading(minor, recv_timeout, recv_deadline,
+					(file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT), &shard, &batch);
+			if (outcome < 0)
+				return outcome;
+			count = 1;
+			while (count < to->nr_segs && claim_shard_reading(minor, shard))
+				count++;
+
+			fetch_messages(minor, shard, count - outcome, &batch);
+		}
+		count -= drop_expired(minor, shard, &batch);
+	} while (count == 0);
+
+	//Each message is copied into its own segment. A message longer than the segment is truncated, as in dev_read, and the
+	//unused tail of a segment is skipped. After the first short copy the rest of the batch is given back as in dev_read, with
+	//the message itself if nothing of it was copied, so the next reads return the messages in the same order
+	list_for_each_entry_safe(message_to_read, temp_message, &batch, list) {
+		list_del_init(&(message_to_read->list));
+		segment_size = iov_iter_single_seg_count(to);
+		wanted_chars = min(segment_size, message_to_read->size);
+		copied_chars = faulted ? 0 : copy_message_to_iter(message_to_read, wanted_chars, to);
+		if (faulted || (wanted_chars > 0 && copied_chars == 0)) {
+			unread_message(file, shard, message_to_read);
+			faulted = true;
+			continue;
+		}
+		faulted = copied_chars < wanted_chars;
+		read_chars += copied_chars;
+		iov_iter_advance(to, segment_size - copied_chars);
+
+		storage_freed += message_to_read->size;
+		record_read(minor, minor_number, message_to_read);
+		free_message(message_to_read);
+		read_count++;
+	}
+	if (read_count == 0)
+		return -EFAULT;
+	release_storage(minor, shard, storage_freed, read_count);
+	stats_inc(minor, reads);
+	stats_add(minor, read_messages, read_count);
+
+	AUDIT	
+	printk("%s: Vectored read of %d messages done on device [%d,%d]\n", MODULE_NAME, read_count, major_number, minor_number);
+
+	return read_chars;
+}
+
+//The pages of a message added to a pipe are shared with the message, and in broadcast mode with the other subscribers, so the
+//reader of the pipe can't steal them: it only drops its reference
+static const struct pipe_buf_operations message_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+//release_spliced_page drops the reference to a page that splice_to_pipe could not add to the pipe
+static void release_spliced_page(struct splice_pipe_desc *spd, unsigned int i) {
+	put_page(spd->pages[i]);
+}
+
+static ssize_t dev_splice_read(struct file *file, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+
+	struct splice_pipe_desc spd = {
+		.ops = &message_pipe_buf_ops,
+		.spd_release = release_spliced_page,
+	};
+	struct message *message_to_read;
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	struct page *page;
+	ssize_t spliced = 0;
+	size_t chunk;
+	size_t left;
+	unsigned int needed = 0;
+	unsigned int i;
+	int outcome;
+	int shard;
+
+	AUDIT
+	printk("%s: Splice read called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	if (len == 0)
+		return 0;
+
+	//The caller holds the lock of the pipe, so its free buffers can only grow until the message is spliced
+	spd.nr_pages_max = pipe->max_usage - pipe_occupancy(pipe->head, pipe->tail);
+	if (spd.nr_pages_max == 0)
+		return -EAGAIN;
+	spd.pages = kmalloc_array(spd.nr_pages_max, sizeof(struct page *), GFP_KERNEL);
+	spd.partial = kmalloc_array(spd.nr_pages_max, sizeof(struct partial_page), GFP_KERNEL);
+	if (spd.pages == NULL || spd.partial == NULL) {
+		spliced = -ENOMEM;
+		goto out;
+	}
+
+	//A message of no bytes would read as the end of the file in the pipe, so it is consumed and the next one is taken
+	while ((outcome = receive_message(file, (file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK), &message_to_read,
+			&shard)) == 0 && message_to_read->size == 0)
+		finish_read(minor, shard, message_to_read);
+	if (outcome < 0) {
+		spliced = outcome;
+		goto out;
+	}
+
+	//The message is truncated to len bytes, as a read with a short buffer, but it is spliced only whole: a message that needs
+	//more buffers than the pipe has free is given back, and the splice fails with -EAGAIN, or with -EFBIG if even the empty pipe
+	//would be too small
+	len = min(len, message_to_read->size);
+	if (message_to_read->text != NULL)
+		needed = DIV_ROUND_UP(len, PAGE_SIZE);
+	for (i = 0, left = len; message_to_read->text == NULL && left > 0; i++, needed++)
+		left -= min_t(size_t, left, message_to_read->pages[i].bv_len);
+	if (needed > spd.nr_pages_max) {
+		unread_message(file, shard, message_to_read);
+		spliced = needed > pipe->max_usage ? -EFBIG : -EAGAIN;
+		goto out;
+	}
+
+	//The pages of a large message are added to the pipe by reference. An inline message is copied in pages of its own, one for
+	//each pipe buffer, since the content of a message in an arena can be longer than a page
+	for (left = 0; message_to_read->text != NULL && left < len; left += chunk) {
+		chunk = min_t(size_t, len - left, PAGE_SIZE);
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL) {
+			for (i = 0; i < spd.nr_pages; i++)
+				put_page(spd.pages[i]);
+			unread_message(file, shard, message_to_read);
+			spliced = -ENOMEM;
+			goto out;
+		}
+		memcpy_to_page(page, 0, message_to_read->text + left, chunk);
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = 0;
+		spd.partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+	}
+	for (i = 0; message_to_read->text == NULL && len > 0; i++) {
+		chunk = min_t(size_t, len, message_to_read->pages[i].bv_len);
+		get_page(message_to_read->pages[i].bv_page);
+		spd.pages[spd.nr_pages] = message_to_read->pages[i].bv_page;
+		spd.partial[spd.nr_pages].offset = message_to_read->pages[i].bv_offset;
+		spd.partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		len -= chunk;
+	}
+
+	//The buffers fit in the pipe, so the splice fails only as a whole (the pipe has no readers) and the message is then given back
+	spliced = splice_to_pipe(pipe, &spd);
+	if (spliced > 0)
+		finish_read(minor, shard, message_to_read);
+	else
+		unread_message(file, shard, message_to_read);
+
+	AUDIT
+	printk("%s: Splice read done on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+out:
+	kfree(spd.pages);
+	kfree(spd.partial);
+	return spliced;
+}
+
+//splice_to_message is the actor of __splice_from_pipe for dev_splice_write: it appends to the message the part of the pipe buffer
+//being consumed, taking a reference to its page instead of copying it
+static int splice_to_message(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd) {
+	struct message *message = sd->u.data;
+	struct bio_vec *page;
+
+	if (message->nr_pages == pipe->max_usage)
+		return 0;
+
+	get_page(buf->page);
+	page = &(message->pages[message->nr_pages++]);
+	page->bv_page = buf->page;
+	page->bv_offset = buf->offset;
+	page->bv_len = sd->len;
+	return sd->len;
+}
+
+static ssize_t dev_splice_write(struct pipe_inode_info *pipe, struct file *file, loff_t *ppos, size_t len, unsigned int flags) {
+
+	struct session *current_session = (struct session*)(file->private_data);
+	struct splice_desc sd = {
+		.flags = flags,
+		.pos = *ppos,
+	};
+	struct message *new_message;
+	struct flow *flow;
+	LIST_HEAD(batch);
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	ssize_t spliced = -ENOMEM;
+	long send_timeout;
+	ktime_t send_deadline;
+	bool is_delayed;
+	int priority;
+	int shard;
+	int outcome;
+
+	AUDIT
+	printk("%s: Splice write called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	//A splice posts a single message with the data in the pipe, up to max_message_size bytes: the rest is left in the pipe for
+	//the next message. The storage is reserved for the largest message and the part not used is given back
+	len = min_t(size_t, len, max(max_message_size, 0));
+	flow = writer_flow(minor, current_session);
+	if (IS_ERR(flow))
+		return PTR_ERR(flow);
+	if (!charge_flow(flow, len)) {
+		stats_inc(minor, quota_rejections);
+		AUDIT
+		printk("%s: Splice write aborted on device [%d,%d]: storage quota of the session used up\n", MODULE_NAME, major_number, minor_number);
+		return -EDQUOT;
+	}
+	priority = READ_ONCE(current_session->send_priority);
+	shard = writer_shard(minor);
+	outcome = wait_storage(minor, current_session, shard, priority, len, 1,
+			(file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (outcome < 0) {
+		uncharge_flow(flow, len);
+		stats_inc(minor, full_rejections);
+		AUDIT
+		printk("%s: Write aborted on device [%d,%d]: not enough space for storing message\n", MODULE_NAME, major_number, minor_number);
+		return outcome;
+	}
+
+	is_delayed = get_send_timeout(current_session, &send_timeout, &send_deadline);
+	new_message = alloc_message(minor->arena, 0, is_delayed, shard, READ_ONCE(current_session->send_tag), priority);
+
+	//The message can reference at most one page for each buffer of the pipe
+	pipe_lock(pipe);
+	if (new_message != NULL && alloc_pages_vector(new_message, 0, pipe->max_usage) == 0) {
+		sd.total_len = len;
+		sd.u.data = new_message;
+		spliced = __splice_from_pipe(pipe, &sd, splice_to_message);
+	}
+	pipe_unlock(pipe);
+
+	if (spliced <= 0) {
+		release_storage(minor, shard, len, 1);
+		uncharge_flow(flow, len);
+		if (new_message != NULL)
+			free_message(new_message);
+		AUDIT
+		printk("%s: Splice write aborted on device [%d,%d]: no data or not enough memory\n", MODULE_NAME, major_number, minor_number);
+		return spliced;
+	}
+	release_storage(minor, shard, len - spliced, 0);
+	uncharge_flow(flow, len - spliced);
+	new_message->size = spliced;
+	attach_flow(new_message, flow);
+	new_message->expires_at = get_expiry(current_session);
+
+	stats_inc(minor, writes);
+	if (!is_delayed) {
+		post_message(minor, new_message);
+		trace_tms_write(minor_number, spliced, 1);
+		stats_inc(minor, written_messages);
+	} else {
+		list_add(&(new_message->list), &batch);
+		defer_messages(current_session, &batch, send_timeout, send_deadline);
+		trace_tms_write_deferred(minor_number, spliced, 1, send_delay(send_timeout, send_deadline));
+		stats_inc(minor, deferred_messages);
+	}
+
+	AUDIT
+	printk("%s: Splice write of %zd bytes done on device [%d,%d]\n", MODULE_NAME, spliced, major_number, minor_number);
+
+	return spliced;
+}
+
+//revoke_delayed_messages cancels the delayed messages of a session whose timers have not expired yet. It returns the number of
+//canceled messages
+static int revoke_delayed_messages(struct session *session) {
+
+	struct minor *minor = session->minor;
+	int canceled_writes;
+
+	//The pending writes on the session are canceled and the structs deallocated
+	spin_lock_bh(&(minor->pending_lock));
+	canceled_writes = core_revoke_pending(&(session->pending_writes), drop_pending_write, NULL);
+	spin_unlock_bh(&(minor->pending_lock));
+
+	AUDIT
+	printk("%s: %d deferred writes canceled on device [%d,%d]\n", MODULE_NAME, canceled_writes, major_number, minor->minor_number);
+	trace_tms_revoke(minor->minor_number, canceled_writes);
+	stats_add(minor, revoked_messages, canceled_writes);
+	if (canceled_writes > 0)
+		put_channel(minor, canceled_writes);
+
+	return canceled_writes;
+}
+
+static long dev_ioctl(struct file *file, unsigned int command, unsigned long param) {
+
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	struct session *current_session;
+	struct message_timeout timeout;
+	struct message_filter filter;
+	struct message_reschedule reschedule;
+	struct flow *flow;
+	u64 handle;
+	u64 tag;
+	long outcome = 0;
+
+	AUDIT
+	printk("%s: Ioctl called on device [%d,%d] with command %d\n", MODULE_NAME, major_number, minor_number, command);
+
+	current_session = (struct session*)(file->private_data);
+	mutex_lock(&(current_session->session_mutex));
+
+	switch(command){
+
+		//The timeouts are changed under the seqcount of the session too, since the reads and the writes read them locklessly
+		case SET_SEND_TIMEOUT:
+			write_seqcount_begin(&(current_session->timeouts_seq));
+			current_session->send_timeout = (long)param;
+			current_session->send_timeout_ns = 0;
+			write_seqcount_end(&(current_session->timeouts_seq));
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+		
+		case SET_RECV_TIMEOUT:
+			write_seqcount_begin(&(current_session->timeouts_seq));
+			current_session->recv_timeout = (long)param;
+			current_session->recv_timeout_ns = 0;
+			write_seqcount_end(&(current_session->timeouts_seq));
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case SET_SEND_TIMEOUT_NS:
+		case SET_RECV_TIMEOUT_NS:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&timeout, (void __user *)param, sizeof(struct message_timeout)))
+				return -EFAULT;
+			if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= NSEC_PER_SEC || (timeout.flags & ~TIMEOUT_ABSOLUTE) != 0)
+				return -EINVAL;
+
+			//The high resolution timeout replaces the one in jiffies
+			mutex_lock(&(current_session->session_mutex));
+			write_seqcount_begin(&(current_session->timeouts_seq));
+			if (command == SET_SEND_TIMEOUT_NS) {
+				current_session->send_timeout = 0;
+				current_session->send_timeout_ns = ktime_set(timeout.tv_sec, timeout.tv_nsec);
+				current_session->send_timeout_is_deadline = timeout.flags & TIMEOUT_ABSOLUTE;
+			} else {
+				current_session->recv_timeout = 0;
+				current_session->recv_timeout_ns = ktime_set(timeout.tv_sec, timeout.tv_nsec);
+				current_session->recv_timeout_is_deadline = timeout.flags & TIMEOUT_ABSOLUTE;
+			}
+			write_seqcount_end(&(current_session->timeouts_seq));
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case SET_SEND_TAG:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&tag, (void __user *)param, sizeof(u64)))
+				return -EFAULT;
+
+			//The tagged messages are indexed only by the list engine, the only one that supports the filters
+			if (tag != 0 && minor->engine == QUEUE_ENGINE_LIST && create_tag_index(minor) < 0)
+				return -ENOMEM;
+			WRITE_ONCE(current_session->send_tag, tag);
+			break;
+
+		case SET_SEND_PRIORITY:
+			if (param >= PRIORITY_LEVELS) {
+				mutex_unlock(&(current_session->session_mutex));
+				return -EINVAL;
+			}
+			WRITE_ONCE(current_session->send_priority, (int)param);
+			if (param != 0)
+				WRITE_ONCE(minor->priorities_used, true);
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case SET_WRITE_TIMEOUT_NS:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&timeout, (void __user *)param, sizeof(struct message_timeout)))
+				return -EFAULT;
+			if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= NSEC_PER_SEC || (timeout.flags & ~TIMEOUT_ABSOLUTE) != 0)
+				return -EINVAL;
+
+			mutex_lock(&(current_session->session_mutex));
+			write_seqcount_begin(&(current_session->timeouts_seq));
+			current_session->write_timeout_ns = ktime_set(timeout.tv_sec, timeout.tv_nsec);
+			current_session->write_timeout_is_deadline = timeout.flags & TIMEOUT_ABSOLUTE;
+			write_seqcount_end(&(current_session->timeouts_seq));
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case SET_MESSAGE_TTL:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&timeout, (void __user *)param, sizeof(struct message_timeout)))
+				return -EFAULT;
+			if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= NSEC_PER_SEC || (timeout.flags & ~TIMEOUT_ABSOLUTE) != 0)
+				return -EINVAL;
+
+			mutex_lock(&(current_session->session_mutex));
+			write_seqcount_begin(&(current_session->timeouts_seq));
+			current_session->message_ttl = ktime_set(timeout.tv_sec, timeout.tv_nsec);
+			current_session->message_ttl_is_deadline = timeout.flags & TIMEOUT_ABSOLUTE;
+			write_seqcount_end(&(current_session->timeouts_seq));
+			if (current_session->message_ttl != 0 && !READ_ONCE(minor->ttl_used))
+				enable_ttl(minor);
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case SET_RECV_FILTER:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&filter, (void __user *)param, sizeof(struct message_filter)))
+				return -EFAULT;
+			if (filter.mask != 0 && minor->engine != QUEUE_ENGINE_LIST)
+				return -EOPNOTSUPP;
+			if (filter.mask != 0 && create_tag_index(minor) < 0)
+				return -ENOMEM;
+
+			mutex_lock(&(current_session->session_mutex));
+			WRITE_ONCE(current_session->filter_tag, filter.tag);
+			WRITE_ONCE(current_session->filter_mask, filter.mask);
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+
+		case REVOKE_DELAYED_MESSAGES:		
+
+			mutex_unlock(&(current_session->session_mutex));
+			revoke_delayed_messages(current_session);
+			break;
+
+		case SHARED_RING_WAIT:
+			mutex_unlock(&(current_session->session_mutex));
+			outcome = shared_ring_wait(minor, (long)param);
+			break;
+
+		case SHARED_RING_NOTIFY:
+			mutex_unlock(&(current_session->session_mutex));
+			wake_up(&(minor->pending_readers_wq));
+			break;
+
+		case SET_ORDERING:
+			mutex_unlock(&(current_session->session_mutex));
+			outcome = set_ordering(minor, (int)param);
+			AUDIT
+			printk("%s: Ordering of device [%d,%d] set to %d (outcome %ld)\n", MODULE_NAME, major_number, minor_number, (int)param, outcome);
+			break;
+
+		case SET_BROADCAST:
+			mutex_unlock(&(current_session->session_mutex));
+			outcome = set_broadcast(minor, (int)param);
+			AUDIT
+			printk("%s: Broadcast mode of device [%d,%d] set to %d (outcome %ld)\n", MODULE_NAME, major_number, minor_number, (int)param, outcome);
+			break;
+
+		case SET_WRITE_HANDLES:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (param != 0 && create_handle_index(minor) < 0)
+				return -ENOMEM;
+			WRITE_ONCE(current_session->write_handles, param != 0);
+			break;
+
+		case CANCEL_DELAYED_MESSAGE:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&handle, (void __user *)param, sizeof(__u64)))
+				return -EFAULT;
+			outcome = cancel_delayed_message(minor, handle);
+			break;
+
+		case RESCHEDULE_DELAYED_MESSAGE:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (copy_from_user(&reschedule, (void __user *)param, sizeof(struct message_reschedule)))
+				return -EFAULT;
+			timeout = reschedule.timeout;
+			if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= NSEC_PER_SEC || (timeout.flags & ~TIMEOUT_ABSOLUTE) != 0)
+				return -EINVAL;
+
+			//A relative timeout starts from now, like the send timeout of a write
+			if (timeout.flags & TIMEOUT_ABSOLUTE)
+				outcome = reschedule_delayed_message(minor, reschedule.handle, ktime_set(timeout.tv_sec, timeout.tv_nsec));
+			else
+				outcome = reschedule_delayed_message(minor, reschedule.handle, ktime_add(ktime_get(), ktime_set(timeout.tv_sec, timeout.tv_nsec)));
+			AUDIT
+			printk("%s: Deferred write %llu rescheduled on device [%d,%d] (outcome %ld)\n", MODULE_NAME, reschedule.handle, major_number, minor_number, outcome);
+			break;
+
+		//The quota and the weight are kept in the flow of the session, allocated by the first of them
+		case SET_STORAGE_QUOTA:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (param > LONG_MAX)
+				return -EINVAL;
+			flow = session_flow(current_session, param != 0);
+			if (flow == NULL && param != 0)
+				return -ENOMEM;
+			if (flow != NULL)
+				WRITE_ONCE(flow->quota, (long)param);
+			AUDIT
+			printk("%s: Storage quota of session on device [%d,%d] set to %lu\n", MODULE_NAME, major_number, minor_number, param);
+			break;
+
+		case SET_FAIR_WEIGHT:
+
+			mutex_unlock(&(current_session->session_mutex));
+
+			if (param < 1 || param > FAIR_MAX_WEIGHT)
+				return -EINVAL;
+			flow = session_flow(current_session, true);
+			if (flow == NULL)
+				return -ENOMEM;
+			WRITE_ONCE(flow->weight, (int)param);
+			break;
+
+		default:
+			mutex_unlock(&(current_session->session_mutex));
+			break;
+	}
+
+	return outcome;
+}
+
+
+//The uring_cmd passthrough relies on the cancelable commands and on the task work completions of io_uring, available since 6.7
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+
+//The pdu of a parked command points to its uring_read
+#define uring_read_of(cmd)	(*(struct uring_read **)((cmd)->pdu))
+
+static void uring_read_task(struct io_uring_cmd *cmd, unsigned int issue_flags);
+
+//kick_uring_read unparks a read and schedules a new attempt in the task that submitted it, unless another event already did
+static void kick_uring_read(struct minor *minor, struct uring_read *uring_read) {
+	bool parked;
+
+	spin_lock_bh(&(minor->uring_lock));
+	parked = !list_empty(&(uring_read->list));
+	list_del_init(&(uring_read->list));
+	spin_unlock_bh(&(minor->uring_lock));
+
+	if (parked)
+		io_uring_cmd_complete_in_task(uring_read->cmd, uring_read_task);
+}
+
+//wake_uring_reads unparks up to count reads of the device file, from the oldest, for count new messages. The list is checked
+//without the lock after a full barrier, paired with the one of park_uring_read, so a post never misses a read being parked.
+//The reads are unparked under the lock, as in kick_uring_read and cancel_uring_read, so whoever unparks a read owns its new
+//attempt; they are scheduled after the lock is released through their woken links, which the other paths never look at
+static void wake_uring_reads(struct minor *minor, int count) {
+	struct uring_read *uring_read;
+	struct uring_read *temp_uring_read;
+	LIST_HEAD(woken);
+
+	smp_mb();
+	if (list_empty(&(minor->uring_reads)))
+		return;
+
+	spin_lock_bh(&(minor->uring_lock));
+	list_for_each_entry_safe(uring_read, temp_uring_read, &(minor->uring_reads), list) {
+		if (count-- == 0)
+			break;
+		list_del_init(&(uring_read->list));
+		list_add_tail(&(uring_read->woken), &woken);
+	}
+	spin_unlock_bh(&(minor->uring_lock));
+
+	//The attempt of a read can free it as soon as it is scheduled, so the next read is looked up before
+	list_for_each_entry_safe(uring_read, temp_uring_read, &woken, woken)
+		io_uring_cmd_complete_in_task(uring_read->cmd, uring_read_task);
+}
+
+//flush_uring_reads aborts the parked reads of the device file for flush(). It returns the number of aborted reads
+static int flush_uring_reads(struct minor *minor) {
+	struct uring_read *uring_read;
+	int aborted_reads = 0;
+
+	spin_lock_bh(&(minor->uring_lock));
+	list_for_each_entry(uring_read, &(minor->uring_reads), list) {
+		WRITE_ONCE(uring_read->is_flushed, true);
+		aborted_reads++;
+	}
+	spin_unlock_bh(&(minor->uring_lock));
+
+	wake_uring_reads(minor, INT_MAX);
+	return aborted_reads;
+}
+
+//uring_read_expired is the timer callback of the receive timeout of a parked read
+static enum hrtimer_restart uring_read_expired(struct hrtimer *timer) {
+	struct uring_read *uring_read = container_of(timer, struct uring_read, timer);
+
+	WRITE_ONCE(uring_read->is_expired, true);
+	kick_uring_read(get_channel(uring_read->cmd->file), uring_read);
+	return HRTIMER_NORESTART;
+}
+
+//uring_read_ready returns true if a parked read has to be tried again: the session has a message to read, or the read has to be
+//aborted
+static bool uring_read_ready(struct minor *minor, struct uring_read *uring_read) {
+	struct session *session = (struct session*)(uring_read->cmd->file->private_data);
+
+	if (READ_ONCE(uring_read->is_expired) || READ_ONCE(uring_read->is_flushed))
+		return true;
+	if (READ_ONCE(minor->broadcast) != BROADCAST_OFF)
+		return READ_ONCE(session->cursor) != NULL;
+	return readings_available(minor);
+}
+
+//park_uring_read links a read to the parked reads of the device file. The availability of a message is checked again after the
+//read is visible to the writers, so a message posted in the meantime unparks it
+static void park_uring_read(struct minor *minor, struct uring_read *uring_read) {
+	spin_lock_bh(&(minor->uring_lock));
+	list_add_tail(&(uring_read->list), &(minor->uring_reads));
+	spin_unlock_bh(&(minor->uring_lock));
+
+	smp_mb();
+	if (uring_read_ready(minor, uring_read))
+		kick_uring_read(minor, uring_read);
+}
+
+//try_uring_read tries to complete a URING_CMD_RECV with a message taken without waiting, as a nonblocking read. If there are no
+//messages the read is parked, marking the command as cancelable the first time, and -EIOCBQUEUED is returned; otherwise the
+//read is released and its outcome returned: the number of read chars, -ETIME if the receive timeout expired, -ECANCELED if
+//flush() is invoked
+static ssize_t try_uring_read(struct uring_read *uring_read, unsigned int issue_flags, bool first) {
+
+	struct file *file = uring_read->cmd->file;
+	struct minor *minor = get_channel(file);
+	struct message *message;
+	ssize_t outcome;
+	size_t len;
+	int shard;
+
+	outcome = receive_message(file, true, &message, &shard);
+	if (outcome == -EAGAIN && !READ_ONCE(uring_read->is_expired) && !READ_ONCE(uring_read->is_flushed)) {
+		if (first)
+			io_uring_cmd_mark_cancelable(uring_read->cmd, issue_flags);
+		park_uring_read(minor, uring_read);
+		return -EIOCBQUEUED;
+	}
+
+	//A copy that faults before the first byte gives the message back, as in dev_read
+	if (outcome == 0) {
+		len = min(uring_read->len, message->size);
+		outcome = len - copy_message_to_user(message, uring_read->buff, len);
+		if (len > 0 && outcome == 0) {
+			unread_message(file, shard, message);
+			outcome = -EFAULT;
+		} else {
+			finish_read(minor, shard, message);
+		}
+	} else if (outcome == -EAGAIN && READ_ONCE(uring_read->is_flushed)) {
+		stats_inc(minor, flushed_reads);
+		outcome = -ECANCELED;
+	} else if (outcome == -EAGAIN) {
+		stats_inc(minor, read_timeouts);
+		outcome = -ETIME;
+	}
+
+	if (uring_read->has_timeout)
+		hrtimer_cancel(&(uring_read->timer));
+	kfree(uring_read);
+	return outcome;
+}
+
+//uring_read_task tries again a parked read in the task that submitted it, where its buffer can be written
+static void uring_read_task(struct io_uring_cmd *cmd, unsigned int issue_flags) {
+	ssize_t outcome = try_uring_read(uring_read_of(cmd), issue_flags, false);
+
+	if (outcome != -EIOCBQUEUED)
+		io_uring_cmd_done(cmd, outcome, 0, issue_flags);
+}
+
+//start_uring_read starts a URING_CMD_RECV, with the receive timeout of the session if it has one
+static int start_uring_read(struct io_uring_cmd *cmd, const struct message_uring_cmd *command, unsigned int issue_flags) {
+
+	struct session *session = (struct session*)(cmd->file->private_data);
+	struct uring_read *uring_read;
+	long recv_timeout;
+	ktime_t recv_deadline;
+
+	if (READ_ONCE(session->filter_mask) != 0)
+		return -EOPNOTSUPP;
+
+	uring_read = kzalloc(sizeof(struct uring_read), GFP_KERNEL);
+	if (uring_read == NULL)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&(uring_read->list));
+	uring_read->cmd = cmd;
+	uring_read->buff = u64_to_user_ptr(command->addr);
+	uring_read->len = command->len;
+	uring_read_of(cmd) = uring_read;
+
+	if (get_recv_timeout(session, &recv_timeout, &recv_deadline)) {
+		if (recv_deadline == 0)
+			recv_deadline = ktime_add_ns(ktime_get(), jiffies_to_nsecs(recv_timeout));
+		hrtimer_setup(&(uring_read->timer), uring_read_expired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+		hrtimer_start(&(uring_read->timer), recv_deadline, HRTIMER_MODE_ABS_SOFT);
+		uring_read->has_timeout = true;
+	}
+
+	return try_uring_read(uring_read, issue_flags, true);
+}
+
+//cancel_uring_read completes a parked read with -ECANCELED when io_uring cancels the command, e.g. because its ring is closed.
+//A read being tried is completed by the attempt
+static void cancel_uring_read(struct io_uring_cmd *cmd, unsigned int issue_flags) {
+	struct uring_read *uring_read = uring_read_of(cmd);
+	struct minor *minor = get_channel(cmd->file);
+	bool parked;
+
+	spin_lock_bh(&(minor->uring_lock));
+	parked = !list_empty(&(uring_read->list));
+	list_del_init(&(uring_read->list));
+	spin_unlock_bh(&(minor->uring_lock));
+
+	if (!parked)
+		return;
+	if (uring_read->has_timeout)
+		hrtimer_cancel(&(uring_read->timer));
+	kfree(uring_read);
+	io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+}
+
+static int dev_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags) {
+
+	const struct message_uring_cmd *command = io_uring_sqe_cmd(cmd->sqe);
+	struct session *session = (struct session*)(cmd->file->private_data);
+	int minor_number = get_minor(cmd->file);
+	ktime_t delay;
+	ssize_t written;
+
+	BUILD_BUG_ON(sizeof(struct uring_read *) > sizeof(cmd->pdu));
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		cancel_uring_read(cmd, issue_flags);
+		return 0;
+	}
+
+	AUDIT
+	printk("%s: Uring command %u called on device [%d,%d]\n", MODULE_NAME, cmd->cmd_op, major_number, minor_number);
+
+	switch (cmd->cmd_op) {
+
+		case URING_CMD_SEND:
+			//A send that would wait for storage is retried by io_uring from a worker thread, where it can block
+			delay = ns_to_ktime((u64)READ_ONCE(command->delay_us) * NSEC_PER_USEC);
+			written = send_message(cmd->file, u64_to_user_ptr(READ_ONCE(command->addr)), READ_ONCE(command->len),
+					(issue_flags & IO_URING_F_NONBLOCK) || (cmd->file->f_flags & O_NONBLOCK), delay);
+			//The result of a completion is an int: the handles fit in it, as the written chars of a message do
+			return written;
+
+		case URING_CMD_RECV:
+			return start_uring_read(cmd, command, issue_flags);
+
+		case URING_CMD_REVOKE:
+			return revoke_delayed_messages(session);
+
+		default:
+			return -EINVAL;
+	}
+}
+
+#else
+
+static void wake_uring_reads(struct minor *minor, int count) {
+}
+
+static int flush_uring_reads(struct minor *minor) {
+	return 0;
+}
+
+#endif
+
+static __poll_t dev_poll(struct file *file, poll_table *wait) {
+
+	struct session *current_session = (struct session*)(file->private_data);
+	struct minor *minor = get_channel(file);
+	struct flow *flow = session_flow(current_session, false);
+	int shard = writer_shard(minor);
+	__poll_t mask = 0;
+
+	poll_wait(file, &(minor->pending_readers_wq), wait);
+	poll_wait(file, &(minor->pending_writers_wq), wait);
+
+	//The device file is readable if a reading is available, or if the session mapped the shared ring and the ring has a message.
+	//In broadcast mode it is readable if the session has messages of the log to read
+	if (READ_ONCE(minor->broadcast) != BROADCAST_OFF) {
+		if (READ_ONCE(current_session->cursor) != NULL)
+			mask |= EPOLLIN | EPOLLRDNORM;
+	} else if (readings_available(minor) ||
+			(READ_ONCE(current_session->shared_ring_mapped) && shared_ring_readable(minor->shared_ring)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	//The device file is writable if a message of max_message_size bytes fits the storage usable by the priority of the session,
+	//that is the storage of the shard of the current CPU with the per-producer orderings, the slots of the arena and the quota of
+	//the session
+	if (atomic_long_read(shard_storage(minor, shard)) + max_message_size <= storage_limit(READ_ONCE(current_session->send_priority)) &&
+			(shard != SHARD_NONE || minor->engine != QUEUE_ENGINE_RING || atomic_read(&(minor->ring.reserved_slots)) < minor->ring.capacity) &&
+			(minor->arena == NULL || atomic_read(&(minor->arena->reserved_slots)) < minor->arena->capacity) &&
+			(flow == NULL || READ_ONCE(flow->quota) == 0 || atomic_long_read(&(flow->storage_size)) + max_message_size <= READ_ONCE(flow->quota)))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+
+static int dev_mmap(struct file *file, struct vm_area_struct *vma) {
+
+	struct session *current_session;
+	struct shared_ring *ring;
+	struct shared_ring *new_ring;
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int outcome;
+
+	AUDIT
+	printk("%s: Mmap called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	//The shared ring is created by the first mmap on the device file. It is allocated out of the lock of the device file, which is a
+	//spinlock, and installed only if no other mmap did it in the meantime
+	ring = smp_load_acquire(&(minor->shared_ring));
+	if (ring == NULL) {
+		new_ring = shared_ring_create();
+		if (new_ring == NULL)
+			return -ENOMEM;
+		spin_lock(&(minor->operation_synchronizer));
+		ring = minor->shared_ring;
+		if (ring == NULL) {
+			ring = new_ring;
+			new_ring = NULL;
+			smp_store_release(&(minor->shared_ring), ring);
+		}
+		spin_unlock(&(minor->operation_synchronizer));
+		if (new_ring != NULL)
+			shared_ring_destroy(new_ring);
+	}
+
+	if (vma->vm_pgoff != 0 || size > ring->area_size) {
+		AUDIT
+		printk("%s: Mmap aborted on device [%d,%d]: invalid range\n", MODULE_NAME, major_number, minor_number);
+		return -EINVAL;
+	}
+
+	outcome = remap_vmalloc_range(vma, ring->header, 0);
+	if (outcome < 0)
+		return outcome;
+
+	//From now on the delayed writes of the session are posted on the shared ring
+	current_session = (struct session*)(file->private_data);
+	mutex_lock(&(current_session->session_mutex));
+	current_session->shared_ring_mapped = true;
+	mutex_unlock(&(current_session->session_mutex));
+
+	return 0;
+}
+
+
+static int dev_flush(struct file *file, fl_owner_t id) {
+	struct list_head *pos_i;
+	struct pending_read *pending_read;
+	struct blocked_write *blocked_write;
+	struct session *session;
+	struct minor *minor = get_channel(file);
+	int minor_number = get_minor(file);
+	int canceled_writes = 0;
+	int aborted_reads = 0;
+	int aborted_writes = 0;
+	
+	AUDIT
+	printk("%s: Flush called on device [%d,%d]\n", MODULE_NAME, major_number, minor_number);
+
+	//Acquiring lock for device file
+	spin_lock(&(minor->operation_synchronizer));
+
+	//Canceling each delayed message through the sessions opened for the device file and the sessions already closed. The
+	//canceling can fail if the timer is already expired
+	spin_lock_bh(&(minor->pending_lock));
+	list_for_each(pos_i, &minor->sessions) { 
+	    session = list_entry(pos_i, struct session, list); 	
+		canceled_writes += core_revoke_pending(&(session->pending_writes), drop_pending_write, NULL);
+	}
+	canceled_writes += core_revoke_pending(&(minor->orphan_writes), drop_pending_write, NULL);
+	spin_unlock_bh(&(minor->pending_lock));
+
+	AUDIT
+	printk("%s: %d deferred writes canceled on device [%d,%d]\n", MODULE_NAME, canceled_writes, major_number, minor_number);
+
+	//Canceling each blocked reading on the device file marking the apposite flag in the pending_read struct
+	list_for_each(pos_i, &minor->pending_readings) { 
+    	pending_read = list_entry(pos_i, struct pending_read, list); 	
+		pending_read->is_flushed = true;	 
+		//A reader waiting for a handoff is not on the waitqueue
+		if (pending_read->task != NULL)
+			wake_up_process(pending_read->task);
+		aborted_reads++;
+    }
+	wake_up_all(&(minor->pending_readers_wq));
+	aborted_reads += flush_uring_reads(minor);
+
+	//The writes waiting for room in the storage are aborted in the same way
+	list_for_each_entry(blocked_write, &(minor->blocked_writes), list) {
+		blocked_write->is_flushed = true;
+		aborted_writes++;
+	}
+	wake_up_all(&(minor->pending_writers_wq));
+
+	spin_unlock(&(minor->operation_synchronizer));
+	trace_tms_flush(minor_number, canceled_writes, aborted_reads, aborted_writes);
+	stats_add(minor, revoked_messages, canceled_writes);
+	if (canceled_writes > 0)
+		put_channel(minor, canceled_writes);
+
+	return 0;
+}
+
+static struct file_operations file_ops = {
+	.owner = THIS_MODULE,
+	.open = dev_open,
+	.write = dev_write,
+	.read = dev_read,
+	.write_iter = dev_write_iter,
+	.read_iter = dev_read_iter,
+	.splice_read = dev_splice_read,
+	.splice_write = dev_splice_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	.uring_cmd = dev_uring_cmd,
+#endif
+	.unlocked_ioctl = dev_ioctl,
+	.mmap = dev_mmap,
+	.poll = dev_poll,
+	.flush = dev_flush,
+	.release = dev_release
+};
+
+
+//stats_show prints the statistics of a device file, summing up the copies of all the CPUs. Each line is a name followed by a
+//value; a histogram bucket is printed only if it is not empty, named after the lower bound of its latencies in nanoseconds
+static int stats_show(struct seq_file *file, void *data) {
+	struct minor *minor = file->private;
+	struct minor_stats total;
+	u64 *cpu_counters;
+	u64 *counters = (u64 *)&total;
+	int cpu, i;
+
+	//minor_stats is made only of u64 counters, so the copies are summed as arrays
+	memset(&total, 0, sizeof(struct minor_stats));
+	for_each_possible_cpu(cpu) {
+		cpu_counters = (u64 *)per_cpu_ptr(minor->stats, cpu);
+		for (i = 0; i < sizeof(struct minor_stats) / sizeof(u64); i++)
+			counters[i] += cpu_counters[i];
+	}
+
+	seq_printf(file, "queue_depth %d\n", queued_readings(minor));
+	seq_printf(file, "storage_size %ld\n", atomic_long_read(&(minor->storage_size)));
+	seq_printf(file, "writes %llu\n", total.writes);
+	seq_printf(file, "written_messages %llu\n", total.written_messages);
+	seq_printf(file, "deferred_messages %llu\n", total.deferred_messages);
+	seq_printf(file, "oversize_rejections %llu\n", total.oversize_rejections);
+	seq_printf(file, "full_rejections %llu\n", total.full_rejections);
+	seq_printf(file, "quota_rejections %llu\n", total.quota_rejections);
+	seq_printf(file, "reads %llu\n", total.reads);
+	seq_printf(file, "read_messages %llu\n", total.read_messages);
+	seq_printf(file, "read_timeouts %llu\n", total.read_timeouts);
+	seq_printf(file, "flushed_reads %llu\n", total.flushed_reads);
+	seq_printf(file, "write_timeouts %llu\n", total.write_timeouts);
+	seq_printf(file, "flushed_writes %llu\n", total.flushed_writes);
+	seq_printf(file, "revoked_messages %llu\n", total.revoked_messages);
+	seq_printf(file, "expired_messages %llu\n", total.expired_messages);
+	seq_printf(file, "lagged_messages %llu\n", total.lagged_messages);
+
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		if (total.queue_latency[i] != 0)
+			seq_printf(file, "queue_latency_ns[%llu] %llu\n", i == 0 ? 0 : 1ULL << i, total.queue_latency[i]);
+	}
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		if (total.read_wait[i] != 0)
+			seq_printf(file, "read_wait_ns[%llu] %llu\n", i == 0 ? 0 : 1ULL << i, total.read_wait[i]);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+//stats_reset_write clears the statistics of a device file, whatever is written. The counters updated while they are cleared
+//can keep their value
+static ssize_t stats_reset_write(struct file *file, const char __user *buffer, size_t len, loff_t *off) {
+	struct minor *minor = file->private_data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(minor->stats, cpu), 0, sizeof(struct minor_stats));
+	return len;
+}
+
+static const struct file_operations stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = stats_reset_write,
+	.llseek = noop_llseek,
+};
+
+//destroy_channel deallocates a channel with the messages still queued on it, the ring of the ring engine and the shared ring.
+//The channel is no longer in the table, but a lookup that found it before can still be trying to take it, so the struct is
+//freed after an RCU grace period
+static void destroy_channel(struct minor *minor) {
+	struct message *message;
+	struct message *temp_message;
+	struct flow *flow;
+	struct flow *temp_flow;
+	LIST_HEAD(unread);
+	int level;
+	int cpu;
+
+	debugfs_remove_recursive(minor->debugfs_dir);
+
+	list_for_each_entry_safe(message, temp_message, &(minor->requeued), list) {
+		list_del(&(message->list));
+		free_message(message);
+	}
+	drain_incoming(minor);
+	for (level = 0; level < PRIORITY_LEVELS; level++) {
+		list_for_each_entry_safe(message, temp_message, level_queue(minor, level), list) {
+			list_del(&(message->list));
+			free_message(message);
+		}
+	}
+
+	//The last message of a flow frees the flow, so the messages are moved out of the flows before they are freed
+	list_for_each_entry_safe(flow, temp_flow, &(minor->active_flows), active_link) {
+		list_del_init(&(flow->active_link));
+		list_splice_init(&(flow->messages), &unread);
+	}
+	list_for_each_entry_safe(message, temp_message, &unread, list) {
+		list_del(&(message->list));
+		free_message(message);
+	}
+
+	if (minor->shared_ring != NULL)
+		shared_ring_destroy(minor->shared_ring);
+
+	//The messages still queued in the ring are deallocated with the ring
+	if (minor->ring.slots != NULL) {
+		while ((message = ring_dequeue(&(minor->ring))) != NULL) {
+			free_message(message);
+		}
+		kvfree(minor->ring.slots);
+	}
+
+	if (minor->shards != NULL) {
+		for_each_possible_cpu(cpu) {
+			list_for_each_entry_safe(message, temp_message, &(per_cpu_ptr(minor->shards, cpu)->messages), list) {
+				list_del(&(message->list));
+				free_message(message);
+			}
+		}
+		free_percpu(minor->shards);
+	}
+
+	//The messages are all freed, so the arena has no slot in use
+	destroy_arena(minor->arena);
+	kfree(minor->tag_index);
+	kfree(minor->handle_index);
+	free_percpu(minor->stats);
+	if (minor->ttl_used)
+		atomic_dec(&ttl_channels);
+	kfree_rcu(minor, rcu);
+}
+
+//create_channel allocates and initializes the channel of a device file, with the only user that is creating it. In arena mode the
+//arena is allocated on node. As usual for debugfs, a failure in the creation of the statistics files only leaves them unreachable
+static struct minor *create_channel(int minor_number, int node) {
+	struct minor *minor;
+	char name[16];
+	int level;
+
+	minor = kzalloc(sizeof(struct minor), GFP_KERNEL);
+	if (minor == NULL)
+		return NULL;
+
+	spin_lock_init(&(minor->operation_synchronizer));
+	init_waitqueue_head(&(minor->pending_readers_wq));
+	init_waitqueue_head(&(minor->pending_writers_wq));
+	INIT_LIST_HEAD(&(minor->messages));
+	spin_lock_init(&(minor->tail_lock));
+	INIT_LIST_HEAD(&(minor->incoming));
+	INIT_LIST_HEAD(&(minor->requeued));
+	INIT_LIST_HEAD(&(minor->sessions));
+	INIT_LIST_HEAD(&(minor->pending_readings));
+	INIT_LIST_HEAD(&(minor->handoff_readers));
+	INIT_LIST_HEAD(&(minor->blocked_writes));
+	INIT_LIST_HEAD(&(minor->broadcast_log));
+	INIT_LIST_HEAD(&(minor->active_flows));
+	for (level = 1; level < PRIORITY_LEVELS; level++)
+		INIT_LIST_HEAD(level_queue(minor, level));
+	INIT_LIST_HEAD(&(minor->orphan_writes));
+	INIT_LIST_HEAD(&(minor->delivery_batch));
+	spin_lock_init(&(minor->pending_lock));
+	spin_lock_init(&(minor->uring_lock));
+	INIT_LIST_HEAD(&(minor->uring_reads));
+	minor->message_to_read = NULL;
+	atomic_long_set(&(minor->storage_size), 0);
+	atomic_set(&(minor->available_readings), 0);
+	atomic_set(&(minor->users), 1);
+	minor->minor_number = minor_number;
+	minor->engine = queue_engine;
+
+	minor->stats = alloc_percpu(struct minor_stats);
+	if (message_arena)
+		minor->arena = create_arena(minor, node);
+	if (minor->stats == NULL || (queue_engine == QUEUE_ENGINE_RING && ring_init(&(minor->ring)) < 0) ||
+			(message_arena && minor->arena == NULL)) {
+		destroy_arena(minor->arena);
+		kvfree(minor->ring.slots);
+		free_percpu(minor->stats);
+		kfree(minor);
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "%d", minor_number);
+	minor->debugfs_dir = debugfs_create_dir(name, debugfs_root);
+	debugfs_create_file("stats", 0440, minor->debugfs_dir, minor, &stats_fops);
+	debugfs_create_file("reset", 0220, minor->debugfs_dir, minor, &stats_reset_fops);
+
+	return minor;
+}
+
+//open_channel returns the channel of a device file, taken as a user, creating it if the device file has none. The lookup is
+//lockless: the lock of the table is taken only if the channel has no users, since it can be reclaimed, or it doesn't exist
+static struct minor *open_channel(int minor_number, int node) {
+	struct minor *minor;
+	struct minor *new_minor = NULL;
+	int outcome;
+
+	rcu_read_lock();
+	minor = xa_load(&channels, minor_number);
+	if (minor != NULL && atomic_inc_not_zero(&(minor->users))) {
+		rcu_read_unlock();
+		return minor;
+	}
+	rcu_read_unlock();
+
+	while (true) {
+		xa_lock(&channels);
+
+		//A channel in the table is reclaimed only holding the lock, so it can be taken even without users
+		minor = xa_load(&channels, minor_number);
+		if (minor != NULL) {
+			atomic_inc(&(minor->users));
+			xa_unlock(&channels);
+			if (new_minor != NULL)
+				destroy_channel(new_minor);
+			return minor;
+		}
+
+		if (new_minor != NULL) {
+			//The insertion can drop the lock to allocate memory, so another thread can insert the channel first
+			outcome = __xa_insert(&channels, minor_number, new_minor, GFP_KERNEL);
+			xa_unlock(&channels);
+			if (outcome == -EBUSY)
+				continue;
+			if (outcome < 0) {
+				destroy_channel(new_minor);
+				return NULL;
+			}
+			return new_minor;
+		}
+		xa_unlock(&channels);
+
+		new_minor = create_channel(minor_number, node);
+		if (new_minor == NULL)
+			return NULL;
+	}
+}
+
+//channel_is_idle returns true if a channel without users has nothing left to read. The shared ring counts as unread from the
+//claim of a slot, so the messages a producer is still writing are not freed with the channel either
+static bool channel_is_idle(struct minor *minor) {
+	return !readings_available(minor) &&
+			(minor->shared_ring == NULL || !shared_ring_unread(minor->shared_ring));
+}
+
+//put_channel drops count users of a channel. The last user reclaims the channel, unless it still has messages to read: in that
+//case the channel stays in the table until a new session reads them
+static void put_channel(struct minor *minor, int count) {
+
+	//Usually the channel keeps other users, so the lock of the table is not needed
+	if (atomic_add_unless(&(minor->users), -count, count))
+		return;
+
+	xa_lock(&channels);
+	if (!atomic_sub_and_test(count, &(minor->users)) || !channel_is_idle(minor)) {
+		xa_unlock(&channels);
+		return;
+	}
+	__xa_erase(&channels, minor->minor_number);
+	xa_unlock(&channels);
+
+	destroy_channel(minor);
+}
+
+//free_channels deallocates all the channels. It is called when the module is removed, so every message is given back to the
+//message caches before they are destroyed
+static void free_channels(void) {
+	struct minor *minor;
+	unsigned long minor_number;
+
+	xa_for_each(&channels, minor_number, minor) {
+		xa_erase(&channels, minor_number);
+		destroy_channel(minor);
+	}
+	xa_destroy(&channels);
+}
+
+//cancel_orphan_writes stops the timers of the delayed writes of the sessions already closed. It is called when the module is
+//removed: no session is open, so only the timers and the delivery work can still use the pending writes. A write whose timer
+//already expired is left to the delivery work, that destroy_workqueue() drains
+static void cancel_orphan_writes(void) {
+	struct pending_write *pending_write;
+	struct minor *minor;
+	unsigned long minor_number;
+	int canceled_writes;
+
+	xa_for_each(&channels, minor_number, minor) {
+		canceled_writes = 0;
+		while (true) {
+			spin_lock_bh(&(minor->pending_lock));
+			pending_write = list_first_entry_or_null(&(minor->orphan_writes), struct pending_write, pending.list);
+			if (pending_write != NULL)
+				list_del_init(&(pending_write->pending.list));
+			spin_unlock_bh(&(minor->pending_lock));
+
+			if (pending_write == NULL)
+				break;
+
+			if (pending_write->pending.is_high_resolution ? hrtimer_cancel(&(pending_write->pending.hrtimer)) :
+					timer_delete_sync(&(pending_write->pending.timer))) {
+				drop_pending_write(&(pending_write->pending), NULL);
+				canceled_writes++;
+			}
+		}
+
+		//The channel is dropped only when its orphan writes are done, since it can be reclaimed
+		if (canceled_writes > 0)
+			put_channel(minor, canceled_writes);
+	}
+}
+
+static void destroy_caches(void) {
+	kmem_cache_destroy(message_cache);
+	kmem_cache_destroy(pending_write_cache);
+}
+
+static int __init install_driver(void) {
+
+	//The outcome of the installation is always logged, whatever the audit parameter, since the major number is needed to
+	//create the device files
+	if (queue_engine != QUEUE_ENGINE_LIST && queue_engine != QUEUE_ENGINE_RING) {
+		printk("%s: invalid queue engine %d\n", MODULE_NAME, queue_engine);
+		return -EINVAL;
+	}
+
+	//The caches for messages are created with room for a payload of max_message_size bytes, up to MAX_INLINE_PAYLOAD_SIZE: the
+	//larger messages store their content in pages
+	inline_payload_size = clamp_t(int, max_message_size, 0, MAX_INLINE_PAYLOAD_SIZE);
+	message_cache = kmem_cache_create("tms_message", sizeof(struct message) + inline_payload_size, 0, SLAB_HWCACHE_ALIGN, NULL);
+	pending_write_cache = kmem_cache_create("tms_pending_write", sizeof(struct pending_write) + inline_payload_size, 0,
+									SLAB_HWCACHE_ALIGN, NULL);
+	if (message_cache == NULL || pending_write_cache == NULL) {
+		printk("%s: failure in creation of the message caches\n", MODULE_NAME);
+		destroy_caches();
+		return -ENOMEM;
+	}
+
+	//The delivery of delayed writes can be needed to free memory, so its workqueue has a rescuer thread
+	delivery_workqueue = alloc_workqueue("tms_delivery", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (delivery_workqueue == NULL) {
+		printk("%s: failure in creation of the delivery workqueue\n", MODULE_NAME);
+		destroy_caches();
+		return -ENOMEM;
+	}
+
+	//The channels are created on the first open of their device files
+	if (max_channels < 1 || max_channels > MINORMASK + 1) {
+		printk("%s: invalid number of channels %d\n", MODULE_NAME, max_channels);
+		destroy_workqueue(delivery_workqueue);
+		destroy_caches();
+		return -EINVAL;
+	}
+	debugfs_root = debugfs_create_dir("timed_messaging_system", NULL);
+
+	major_number = __register_chrdev(0, 0, max_channels, DEVICE_DRIVER_NAME, &file_ops);
+	if (major_number < 0) {
+
+	  printk("%s: failure in device driver registration\n", MODULE_NAME);
+	  debugfs_remove_recursive(debugfs_root);
+	  destroy_workqueue(delivery_workqueue);
+	  destroy_caches();
+	  return major_number;
 	}
 
-	AUDIT
 	printk("%s: success in device driver registration with major number %d\n",MODULE_NAME, major_number);
 
 	AUDIT
@@ -519,7 +4451,13 @@ static int __init install_driver(void) {
 }
 
 static void __exit uninstall_driver(void){
-	unregister_chrdev(major_number, DEVICE_DRIVER_NAME);
+	__unregister_chrdev(major_number, 0, max_channels, DEVICE_DRIVER_NAME);
+	cancel_orphan_writes();
+	cancel_delayed_work_sync(&reaper_work);
+	destroy_workqueue(delivery_workqueue);
+	free_channels();
+	debugfs_remove_recursive(debugfs_root);
+	destroy_caches();
 
 	AUDIT
 	printk("%s: module successfully removed\n", MODULE_NAME);
@@ -1,89 +1,412 @@
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 //Ioctl commands
 #define SET_SEND_TIMEOUT _IO('a', 0)
 #define SET_RECV_TIMEOUT _IO('a', 1)
 #define REVOKE_DELAYED_MESSAGES _IO('a', 2)
+#define SHARED_RING_WAIT _IO('a', 3)
+#define SHARED_RING_NOTIFY _IO('a', 4)
+#define SET_SEND_TIMEOUT_NS _IOW('a', 5, struct message_timeout)
+#define SET_RECV_TIMEOUT_NS _IOW('a', 6, struct message_timeout)
+#define SET_ORDERING _IO('a', 7)
+#define SET_SEND_TAG _IOW('a', 8, __u64)
+#define SET_RECV_FILTER _IOW('a', 9, struct message_filter)
+#define SET_SEND_PRIORITY _IO('a', 10)
+#define SET_MESSAGE_TTL _IOW('a', 11, struct message_timeout)
+#define SET_WRITE_TIMEOUT_NS _IOW('a', 12, struct message_timeout)
+#define SET_BROADCAST _IO('a', 13)
+#define SET_WRITE_HANDLES _IO('a', 14)
+#define CANCEL_DELAYED_MESSAGE _IOW('a', 15, __u64)
+#define RESCHEDULE_DELAYED_MESSAGE _IOW('a', 16, struct message_reschedule)
+#define SET_STORAGE_QUOTA _IO('a', 17)
+#define SET_FAIR_WEIGHT _IO('a', 18)
+
+//Priority levels of the messages, from 0 (the default and lowest one) to PRIORITY_LEVELS - 1
+#define PRIORITY_LEVELS 8
+
+//Orderings of the messages of a device file, set with SET_ORDERING
+#define ORDERING_FIFO 0						//messages are read in the order they are posted (default)
+#define ORDERING_PER_PRODUCER 1				//messages are queued per CPU and read in order only with respect to the same CPU
+#define ORDERING_APPROXIMATE 2				//as ORDERING_PER_PRODUCER, but readers take the oldest head among the CPUs
+#define ORDERING_FAIR 3						//messages are queued per writing session and read round-robin among the sessions
+
+//Highest weight of a session with ORDERING_FAIR, set with SET_FAIR_WEIGHT
+#define FAIR_MAX_WEIGHT 64
+
+//Modes of a device file set with SET_BROADCAST, with the policy for the subscribers that lag behind the writers
+#define BROADCAST_OFF 0						//each message is read by a single reader (default)
+#define BROADCAST_DROP 1					//every subscriber reads every message; a full log drops the oldest messages
+#define BROADCAST_BLOCK 2					//every subscriber reads every message; a full log blocks or fails the writers
+
+//Operations of the uring_cmd passthrough, in the cmd_op field of an IORING_OP_URING_CMD submission
+#define URING_CMD_SEND 0					//posts the message in the buffer, as write()
+#define URING_CMD_RECV 1					//completes with the next message copied in the buffer, waiting without a thread
+#define URING_CMD_REVOKE 2					//revokes the delayed messages of the session, completing with their number
+
+//Flags of struct message_timeout
+#define TIMEOUT_ABSOLUTE 1					//the timeout is an absolute CLOCK_MONOTONIC deadline instead of a relative time
+
+//message_timeout is the parameter of SET_SEND_TIMEOUT_NS, SET_RECV_TIMEOUT_NS, SET_MESSAGE_TTL and SET_WRITE_TIMEOUT_NS
+struct message_timeout {
+	__s64 tv_sec;
+	__s64 tv_nsec;
+	__u32 flags;
+	__u32 padding;
+};
+
+//message_reschedule is the parameter of RESCHEDULE_DELAYED_MESSAGE: the handle of a delayed message and its new send timeout
+struct message_reschedule {
+	__u64 handle;
+	struct message_timeout timeout;
+};
+
+//message_filter is the parameter of SET_RECV_FILTER: a read takes only the messages whose tag is equal to tag in the bits of mask.
+//A mask of all ones is an exact match, a zero mask removes the filter. Untagged messages (tag 0) never match a filter
+struct message_filter {
+	__u64 tag;
+	__u64 mask;
+};
+
+//message_uring_cmd is the command of an IORING_OP_URING_CMD submission on a device file, stored in the cmd area of the submission
+//queue entry
+struct message_uring_cmd {
+	__u64 addr;								//address of the buffer of the message
+	__u32 len;								//size in bytes of the buffer
+	__u32 delay_us;							//URING_CMD_SEND: microseconds before the posting, 0 for the send timeout of the session
+};
+
+//Layout of the shared ring that mmap() exposes for a device file. The ring is a bounded multi-producer multi-consumer queue:
+//a producer claims the slot at tail when its sequence is equal to tail, writes the message and stores tail + 1 in the sequence;
+//a consumer claims the slot at head when its sequence is equal to head + 1, reads the message and stores head + slot_count in
+//the sequence. Positions are claimed with a compare-and-swap, sequences are written with release semantics and read with
+//acquire semantics. A producer has to call SHARED_RING_NOTIFY only if waiters is not zero, after a full memory barrier
+struct shared_ring_header {
+	__u64 head;								//next position to read
+	__u8 head_padding[56];
+	__u64 tail;								//next position to write
+	__u8 tail_padding[56];
+	__u32 slot_count;						//number of slots, always a power of two
+	__u32 slot_size;						//size in bytes of a slot, shared_ring_slot header included
+	__u32 slots_offset;						//offset in bytes of the first slot from the start of the mapping
+	__u32 waiters;							//number of consumers sleeping in SHARED_RING_WAIT
+};
+
+struct shared_ring_slot {
+	__u64 sequence;
+	__u32 size;								//the size in bytes of the message
+	__u32 padding;
+	char text[];							//the content of the message, up to slot_size - sizeof(struct shared_ring_slot) bytes
+};
 
 #ifdef __KERNEL__
 
 #define MODULE_NAME "TIMED-MESSAGING-SYSTEM"
 #define DEVICE_DRIVER_NAME "timed-messaging-system"
-#define MAX_MINOR_NUMBER 8
-#define AUDIT if(1)
+#define DEFAULT_MAX_CHANNELS 4096
+#define AUDIT if(static_branch_unlikely(&audit_enabled))
 #define DEFAULT_MAX_MESSAGE_SIZE 64
 #define DEFAULT_MAX_STORAGE_SIZE 1280
 #define DEFAULT_SEND_TIMEOUT 0
 #define DEFAULT_RECV_TIMEOUT 0
+#define QUEUE_ENGINE_LIST 0
+#define QUEUE_ENGINE_RING 1
+#define DEFAULT_QUEUE_ENGINE QUEUE_ENGINE_LIST
+#define SHARED_RING_MAX_ATTEMPTS 64
+#define STATS_HISTOGRAM_BUCKETS 40
+#define SHARD_NONE -1
+#define SHARD_BROADCAST -2
+#define MAX_INLINE_PAYLOAD_SIZE 512
+#define TAG_HASH_BITS 8
+#define HANDLE_HASH_BITS 10
+#define DEFAULT_TTL_REAP_MS 1000
+
+//AUDIT guards the printk logging of the operations. audit_enabled is a static key, disabled by default and switched by the
+//audit parameter of the module; the tracepoints in timed_messaging_system_trace.h are the way to observe a production system
+DECLARE_STATIC_KEY_FALSE(audit_enabled);
+
+//ring_slot is a cell of the message ring. The sequence number tells if the slot is ready to be written (sequence equal to the
+//position of the producer) or ready to be read (sequence equal to the position of the consumer plus one)
+struct ring_slot {
+	atomic_long_t sequence;
+	struct message *message;
+};
+
+//message_ring is a bounded multi-producer multi-consumer queue of messages. Producers and consumers claim a position through a
+//compare-and-swap on tail and head, so the enqueue and the dequeue don't need the lock of the device file
+struct message_ring {
+	atomic_long_t head ____cacheline_aligned_in_smp;	//next position to read
+	atomic_long_t tail ____cacheline_aligned_in_smp;	//next position to write
+	atomic_t reserved_slots;				//slots claimed by accepted writes and not yet released by a read
+	unsigned long capacity;					//number of slots, always a power of two
+	struct ring_slot *slots;
+};
+
+//shared_ring collects the kernel side metadata of the ring mapped by the processes that communicate without syscalls
+struct shared_ring {
+	struct shared_ring_header *header;		//start of the vmalloc'ed area mapped in userspace
+	char *slots;							//first slot of the ring
+	unsigned long slot_count;
+	size_t slot_size;
+	size_t area_size;						//size in bytes of the whole area, page aligned
+	spinlock_t waiters_lock;				//to keep the waiters field of the header exact
+	unsigned int waiters;
+};
+
+//message_arena holds the messages of a device file in arena mode (message_arena parameter). It is allocated with the channel,
+//with a slot for each max_message_size bytes of max_storage_size, and a slot has room for a pending_write with max_message_size
+//bytes of content, so a write takes a slot from the free stack and a read gives it back, without allocating memory. The slots are
+//reserved with the storage, so a write that got its storage always finds a free slot
+struct message_arena {
+	char *slots;							//first slot, allocated on the node of the primary consumer when it is known
+	size_t slot_size;						//size in bytes of a slot, a multiple of the cache line
+	size_t payload_size;					//bytes of content stored in a slot
+	unsigned long capacity;					//number of slots
+	atomic_t reserved_slots;				//slots reserved by accepted writes and not yet given back
+	spinlock_t lock;						//to synchronize the free stack
+	unsigned long free_count;				//number of free slots
+	unsigned int *free_slots;				//indexes of the free slots, the last freed on the top
+	wait_queue_head_t *writers_wq;			//woken up when a slot is given back, since the writers may wait for it
+};
+
+//message_shard is the queue of the messages written from a CPU on a device file with the per-producer orderings. Each shard
+//has its own lock and storage accounting, so writers on different CPUs don't contend
+struct message_shard {
+	spinlock_t lock;						//to synchronize the operations on the queue of the shard
+	struct list_head messages;				//messages posted on the shard, from the oldest
+	ktime_t head_queued_at;					//queued_at of the oldest message, used by ORDERING_APPROXIMATE
+	atomic_long_t storage_size;				//bytes used by the shard to store messages
+	atomic_t available_readings;			//number of available readings on the shard
+} ____cacheline_aligned_in_smp;
+
+//flow is the account of the messages written by a session: the storage they use, against the quota of the session, and with
+//ORDERING_FAIR their queue and the state of the deficit round-robin among the sessions. A flow is referenced by its session and
+//by each of its messages, so it outlives the session until its last message is read or dropped
+struct flow {
+	struct list_head messages;				//messages of the flow queued with ORDERING_FAIR, the newest at the head (lock of the minor)
+	struct list_head active_link;			//link in the active flows of the device file, empty if no message is queued
+	long deficit;							//bytes the flow can still read in its turn (lock of the minor)
+	int weight;								//the flow gets weight times max_message_size bytes at each turn
+	long quota;								//bytes of storage the messages of the flow can use, 0 for no quota
+	atomic_long_t storage_size;				//bytes used by the messages of the flow
+	refcount_t references;					//the session and the messages of the flow
+};
 
 //minor struct collect the metadata needed to manage a device file with a specified minor number
+//minor_stats collects the statistics of a device file. Each CPU updates its own copy, so the statistics don't add contention
+//between the threads; the copies are summed up when they are read through debugfs. Bucket i of the histograms counts the
+//latencies from 2^i to 2^(i+1) - 1 nanoseconds, the last bucket also all the longer ones
+struct minor_stats {
+	u64 writes;								//write calls that posted or deferred messages
+	u64 written_messages;					//messages immediatly posted
+	u64 deferred_messages;					//messages whose posting has been deferred
+	u64 oversize_rejections;				//writes rejected because a message is longer than max_message_size
+	u64 full_rejections;					//writes rejected because the storage of device file is full
+	u64 quota_rejections;					//writes rejected because the storage quota of the session is used up
+	u64 reads;								//read calls that read messages
+	u64 read_messages;						//messages read
+	u64 read_timeouts;						//blocked reads aborted by the expiration of their timeout
+	u64 flushed_reads;						//blocked reads aborted by flush()
+	u64 write_timeouts;						//writes aborted because the storage was still full when their timeout expired
+	u64 flushed_writes;						//writes waiting for room in the storage aborted by flush()
+	u64 revoked_messages;					//delayed messages canceled by REVOKE_DELAYED_MESSAGES or flush()
+	u64 expired_messages;					//messages dropped because their time to live was over
+	u64 lagged_messages;					//broadcast messages dropped before every subscriber read them
+	u64 queue_latency[STATS_HISTOGRAM_BUCKETS];	//time spent by the messages in the queue of device file
+	u64 read_wait[STATS_HISTOGRAM_BUCKETS];		//time spent sleeping by the blocked reads
+};
+
+//minor struct is a channel, the state of a device file. Channels are created on the first open of their device file and
+//stored in a table indexed by minor number, so the memory used scales with the active channels. A channel is reclaimed when it
+//has no users, that is no open sessions and no pending writes, and no messages to read, the unread slots of its shared ring
+//included
 struct minor {
 	wait_queue_head_t pending_readers_wq; 	//used during blocked readings
-	struct mutex operation_synchronizer;	//to synchronize the operation on device file
-	struct list_head messages; 				//list of messages posted on device file
+	wait_queue_head_t pending_writers_wq;	//used by the threads waiting for room in the storage
+	spinlock_t operation_synchronizer;		//to synchronize the operation on device file, and head lock of the message list
+	int engine;								//queue engine used to store the messages (list or ring)
+	struct list_head messages; 				//list of messages posted on device file (list engine)
+	spinlock_t tail_lock ____cacheline_aligned_in_smp;	//tail lock of the message list, taken by the writers instead of operation_synchronizer
+	struct list_head incoming;				//messages posted under tail_lock and not yet moved to messages, the newest at the head
+	struct message_ring ring;				//ring of messages posted on device file (ring engine)
+	struct shared_ring *shared_ring;		//ring shared with userspace, created by the first mmap on device file
 	struct list_head sessions; 				//list of open sessions on device file
 	struct list_head *message_to_read; 		//pointer to next message to read
+	struct list_head requeued;				//messages given back by the reads that could not deliver them, read before the queues
 	struct list_head pending_readings; 		//list of pending readings on device file
-	size_t storage_size; 					//bytes used by device file to store messages
-	int available_readings;					//number of available readings on device file
+	struct list_head blocked_writes;		//writes waiting for room in the storage of device file
+	struct list_head handoff_readers;		//pending readings waiting for a handoff, from the oldest (reader_handoff)
+	struct list_head *tag_index;			//buckets of the tagged messages by hash of the tag, allocated when tags are first used
+	unsigned long tag_sequence;				//incremented at each post of tagged messages, to wake up the filtered readers
+	struct list_head priority_queues[PRIORITY_LEVELS - 1];	//messages of the priority levels above 0 (list engine)
+	unsigned long priority_bitmap;			//bit i is set if the queue of priority level i is not empty
+	bool priorities_used;					//true once a session wrote messages with a priority
+	bool ttl_used;							//true once a session set a time to live for its messages
+	int broadcast;							//broadcast mode of device file, BROADCAST_OFF if each message has one reader
+	struct list_head broadcast_log;			//messages posted in broadcast mode, from the oldest
+	spinlock_t uring_lock;					//to synchronize the list of parked uring reads
+	struct list_head uring_reads;			//URING_CMD_RECV commands waiting for a message, from the oldest
+	spinlock_t pending_lock;				//to synchronize the lists of pending writes of the sessions on device file
+	struct hlist_head *handle_index;		//buckets of the pending writes by hash of the handle (protected by pending_lock)
+	u64 next_handle;						//handle of the next delayed message with a handle (protected by pending_lock)
+	struct list_head orphan_writes;			//pending writes of the sessions already closed on device file
+	atomic_long_t storage_size; 			//bytes used by device file to store messages
+	atomic_t available_readings;			//number of available readings on device file
+	int ordering;							//ordering of the messages of device file
+	struct message_shard __percpu *shards;	//queues of the messages for each CPU, allocated by the first per-producer ordering
+	struct message_arena *arena;			//preallocated slots of the messages, NULL unless the module is in arena mode
+	atomic_t next_shard;					//shard the next reader starts from with ORDERING_PER_PRODUCER
+	struct list_head active_flows;			//flows with queued messages with ORDERING_FAIR, in round-robin order, the one in turn first
+	struct minor_stats __percpu *stats;		//statistics of device file, one copy for each CPU
+	struct dentry *debugfs_dir;				//debugfs directory of device file
+	int minor_number;						//minor number of device file
+	atomic_t users;							//open sessions and pending writes on device file
+	struct list_head delivery_batch;		//expired writes being posted by the delivery work
+	int delivery_count;						//number of messages in delivery_batch
+	struct list_head delivery_link;			//link in the device files with a delivery batch
+	struct rcu_head rcu;					//to free the struct after the lookups that could still see it
 };
 
 //session struct collect the metadata needed to manage session open on a device file
 struct session {
 	struct list_head list;					
-	struct workqueue_struct *workqueue;		//used during delayed writes
-	struct list_head pending_writes;		//list of pending writes of the session
+	struct list_head pending_writes;		//list of pending writes of the session (protected by pending_lock of the minor)
 	struct mutex session_mutex;				//to synchronize the operation on the session
+	seqcount_mutex_t timeouts_seq;			//to read the timeouts and the time to live without session_mutex (written under it)
+	struct minor *minor;					//device file of the session, kept by the session as a user
 	long send_timeout; 						//timeout before a read returns 
 	long recv_timeout;						//timeout before a write message is posted
+	ktime_t send_timeout_ns;				//high resolution send timeout, used instead of send_timeout if not zero
+	ktime_t recv_timeout_ns;				//high resolution receive timeout, used instead of recv_timeout if not zero
+	bool send_timeout_is_deadline;			//true if send_timeout_ns is an absolute CLOCK_MONOTONIC time
+	bool recv_timeout_is_deadline;			//true if recv_timeout_ns is an absolute CLOCK_MONOTONIC time
+	bool shared_ring_mapped;				//true if the session mapped the shared ring of the device file
+	u64 send_tag;							//tag of the messages written by the session, 0 for untagged messages
+	int send_priority;						//priority level of the messages written by the session
+	ktime_t write_timeout_ns;				//time a write can wait for room in the storage, 0 if it fails at once
+	bool write_timeout_is_deadline;			//true if write_timeout_ns is an absolute CLOCK_MONOTONIC time
+	ktime_t message_ttl;					//time to live of the messages written by the session, 0 if they don't expire
+	bool message_ttl_is_deadline;			//true if message_ttl is an absolute CLOCK_MONOTONIC time
+	u64 filter_tag;							//tag of the messages read by the session, in the bits of filter_mask
+	u64 filter_mask;						//mask of the tag filter of the session, 0 if the session reads every message
+	bool is_subscriber;						//true if the session reads the broadcast log, that is it is open for reading
+	bool write_handles;						//true if the delayed writes of the session return the handle of the message
+	struct flow *flow;						//account of the messages of the session, allocated by the first quota, weight or fair write
+	struct message *cursor;					//next message of the broadcast log to read, NULL if the session read all of them
 };
 
-//message struct represents a message in the system
+//message struct represents a message in the system. Messages are allocated from a slab cache whose objects have room for
+//max_message_size bytes of payload, up to MAX_INLINE_PAYLOAD_SIZE, so the content of a small message is stored in the same
+//object. The content of a larger message is a vector of pages, allocated one by one or referenced from a pipe by splice(). In
+//arena mode every message is stored in a slot of the arena of its device file, with its whole content
 struct message {
 	struct list_head list;					
 	bool is_delayed;						//true if the posting of message is delayed
+	u8 priority;							//priority level of the message
+	int shard;								//shard the message is stored on, SHARD_NONE for the queue of device file
+	u64 tag;								//tag of the message, 0 for an untagged message
+	struct flow *flow;						//flow of the session that wrote the message, NULL if the session has none
+	struct message_arena *arena;			//arena the message is stored in, NULL for a message taken from the caches
+	struct list_head tag_link;				//link in the bucket of the tag index (list engine)
 	size_t size;							//the size in bytes of the message	
-	char *text;								//the content of the message
+	ktime_t queued_at;						//time of the write, or of the posting for a delayed message
+	ktime_t expires_at;						//CLOCK_MONOTONIC time the message expires at, 0 if it doesn't expire
+	unsigned int subscribers;				//subscribers that did not read the message yet (broadcast log)
+	refcount_t references;					//references of the broadcast log and of the reads copying the message
+	char *text;								//the content of the message (points to payload, NULL if the content is in pages)
+	struct bio_vec *pages;					//pages holding the content of a large message, each with its offset and length
+	unsigned int nr_pages;					//number of entries used in pages
+	char payload[];							//inline storage for the content of the message
 };
 
-//pending_write represents a delayed write in the system
+//pending_write represents a delayed write in the system. A delayed message is allocated as a pending_write from the start, so the
+//message is the last field: its payload extends past the end of the struct. The timer of every pending write lives in the timer
+//wheel of the kernel; when it expires the pending write is moved on the module-wide list of expired writes, that the delivery
+//work posts in batches
 struct pending_write{
-	struct list_head list;	
-	struct delayed_work delayed_work;		//the work to do when timer expires
+	struct core_pending pending;			//link in the pending writes of the session, or in the orphan writes of the minor, timer and handle
+	struct llist_node expired_node;			//link in the list of expired writes
+	struct minor *minor;					//device file target for writing, kept by the pending write as a user
+	bool to_shared_ring;					//true if the message has to be posted on the shared ring
 	struct message message;					//the message to post
-	int minor_number;						//minor number of device target for writing
+};
+
+//blocked_write represents a write waiting for room in the storage of a device file
+struct blocked_write {
+	struct list_head list;
+	bool is_flushed;						//true if anyone call flush() on the device file
 };
 
 //pending_read represents a blocked read in the system
 struct pending_read {
 	struct list_head list;
+	struct list_head handoff_link;			//link in the readers waiting for a handoff on device file
+	struct task_struct *task;				//thread waiting for a handoff, NULL if the read waits on the waitqueue
+	struct message *message;				//message handed off by a writer
+	bool is_flushed;						//true if anyone call flush() on the device file
+};
+
+//uring_read represents a URING_CMD_RECV waiting for a message. No thread sleeps for it: the command is parked on the device file
+//and it is tried again, in the task that submitted it, when a message is posted, the timeout expires or flush() is invoked
+struct uring_read {
+	struct list_head list;					//link in the parked uring reads of the device file, empty while the read is tried
+	struct list_head woken;					//link in the reads unparked together by wake_uring_reads
+	struct io_uring_cmd *cmd;
+	char *buff;								//buffer of the message in the submitting task
+	size_t len;
+	struct hrtimer timer;					//expires at the receive timeout of the session
+	bool has_timeout;						//true if timer is started
+	bool is_expired;						//true if the receive timeout expired
 	bool is_flushed;						//true if anyone call flush() on the device file
 };
 
 
 /* The open function creates a session to the file specified by pathname and adds this to the list of sessions associated to device file.
 the just created sesssion has send_timeout and recv_timeout set to zero by default. The pointer to that session is stored in the 
-private_data field of struct file. The open returns 0 in case of success.*/
+private_data field of struct file. If the device file has no channel yet, the channel is created and inserted in the table of channels (in arena mode with its arena, a slot for each max_message_size bytes of max_storage_size, on the NUMA node of the opening thread if the session is open for reading); a session looks up its channel only at open and keeps it as a user until it is closed. The open returns 0 in case of success, -ENOMEM if the channel cannot be created.*/
 static int dev_open(struct inode *inode, struct file *file);
 
 /* The release function closes the session to the file specified by file descriptor and remove this from the list of session associated
-to device file. Before complete the close the workqueue containing the delayed writes started on this session is waited; then the workqueue is destroyed. The release returns 0 in case of success.*/
+to device file. The close doesn't wait for the delayed writes started on this session: they are moved on the orphan writes of the device file and they are still posted when their timers expire, or canceled by flush(). If the session was the last user of a channel without messages, the channel is reclaimed. The release returns 0 in case of success.*/
 static int dev_release(struct inode *inode, struct file *file);
 
 /* The write function allows to post a message on the message queue of the device file specified througth the struct file passed in input.
 Others params are buff and len, respectively the message to write and its size. The offset off is unused.
 When a write occours first the size of message is checked not be over the maximum size allowed and is checked also the total storage space, of the device file the write occours on, not be over the maximum size allowed. If these checks fail the write is aborted, otherwise can occours.
-So the message is created, if this can be immediatly posted (send_timeout is zero) it is linked to the list of message of the device file and it is ready to be read. Otherwise, a pending_write struct containg a delayed work consisting in the write is created and linked to the list of pending write associated to session the write occours on. The message previously created is copied into this struct and the original one is freed. The write returns the number of written chars, 0 in case of delayed write, -1 in case of error */
+So the message is created in a single allocation from the message cache (a message larger than MAX_INLINE_PAYLOAD_SIZE keeps its content in a vector of pages allocated one by one, so it never needs a high order allocation; in arena mode it takes instead a free slot of the arena of the device file, with its whole content, and no memory is allocated), if this can be immediatly posted (send_timeout is zero) it is linked to the message queue of the device file (a two-lock list, where the writers append under a tail lock and the readers take the oldest messages under the lock of the device file, or a lock-free ring, depending on the queue_engine parameter; tags, priorities and readers waiting for a handoff make the writers take the lock of the device file too) and it is ready to be read. Otherwise, the message is created inside a pending_write struct whose timer, in the timer wheel of the kernel, expires after send_timeout jiffies, and this is linked to the list of pending write associated to session the write occours on. When the timer expires the pending_write is unlinked from the session and handed to the module-wide delivery work, that posts all the writes expired in the same tick with one lock acquisition and one wake up for each device file. If the storage is full and the session has a write timeout (SET_WRITE_TIMEOUT_NS), the writer sleeps until the message fits, the timeout expires, flush() is invoked or a signal interrupts it (the write then returns -EINTR): the waiting writers are woken up one at a time, in the order they started waiting, when reads, revokes or expired messages free storage. A session with a storage quota (SET_STORAGE_QUOTA) is checked against its quota before the storage of the device file, and it never waits for its own messages to be read. The write returns the number of written chars, 0 in case of delayed write (or the handle of the delayed message, if the session enabled SET_WRITE_HANDLES), -1 in case of error (-EAGAIN if the storage is full and the file is opened with O_NONBLOCK, -EDQUOT if the quota of the session is used up) */
 static ssize_t dev_write(struct file *file, const char *buff, size_t len, loff_t *off);
 
 /* The open function allows to read a message from the message queue of the device file specified througth the struct file passed in input.
 Others params are buff and len, respectively the buffer where the caller wants receive the message and its size. The offset off is unused.
-The read is always not blocking if there are messages to read. If there are not the read is blocking only in the case recv_timeout is not zero. In this case a pending_read struct is created and linked to the others in a list associated to the device file. The thread asking for a blocking read start to sleep on the waitqueue of the device file until a new message is posted or flush operation is invoked. If a new message is posted the read occours, if flush operation is invoked the read is aborted. The read returns the number of read chars, -1 in case of absence of message to read */
+The read is always not blocking if there are messages to read. If there are not the read is blocking only in the case recv_timeout is not zero. In this case a pending_read struct is created and linked to the others in a list associated to the device file. The thread asking for a blocking read start to sleep on the waitqueue of the device file until a new message is posted or flush operation is invoked. If a new message is posted the read occours, if flush operation is invoked the read is aborted. The blocked readers wait exclusively, in the order they started waiting, and a post wakes up one of them for each message; with the reader_handoff parameter (list engine and FIFO ordering) the writer hands the message directly to the reader waiting for longest, so the reader doesn't race with the others for it. A reader first claims one of the available readings and then takes the oldest message from the queue, so with the ring engine neither step needs the lock of the device file. If the file is opened with O_NONBLOCK the read never sleeps and returns -EAGAIN when there are no messages, whatever the recv_timeout. If nothing of the message can be copied to buff the message is left for the next read and the read returns -EFAULT. The read returns the number of read chars, -1 in case of absence of message to read */
 static ssize_t dev_read(struct file *file, char *buff, size_t len, loff_t *off);
 
-/* The ioctl function allows to manage the session to a device file specified by the file input parameter. The other parama are the command to execute and the param for this command. The available commands are SET_SEND_TIMEOUT that sets the send_timeout to the value specified by param, SET_RECT_TIMEOUT that sets the recv_timeout to the value specified by param and REVOKE_DELAYED_MESSAGE that revokes the post of all delayed message on the current session. The ioctl returns 0 in case of success.*/
+/* The write_iter function is invoked by writev() and allows to post a batch of messages on the message queue of the device file specified througth the kiocb passed in input: each segment of the iov_iter from is a message. The size of every message is checked as in dev_write and the storage for the whole batch is reserved at once, so either all the messages are written or none of them. The batch is posted taking the lock of the device file once and waking up the readers once, or it is deferred as a whole if the send_timeout of the session is not zero. The write_iter returns the number of written chars, 0 in case of delayed write (or, if the session enabled SET_WRITE_HANDLES, the handle of the last message of the batch: the messages take consecutive handles, in the order of the segments), -1 in case of error */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from);
+
+/* The read_iter function is invoked by readv() and allows to read up to one message for each segment of the iov_iter to. The first message is read as in dev_read, so the call can block if the recv_timeout of the session is not zero; then the messages are taken while there are available readings, stopping when the queue is empty. A message longer than its segment is truncated and the unused tail of a segment is left untouched. The read stops at the first message that can't be copied whole: the messages after it, and the message itself if nothing of it was copied, are left for the next read, and if no message was read the read_iter returns -EFAULT. The read_iter returns the total number of read chars, -1 in case of absence of message to read */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+/* The splice_read function is invoked by splice() and sendfile() with the device file as source and moves one message into the pipe, read as in dev_read, so the call can block if the recv_timeout of the session is not zero (SPLICE_F_NONBLOCK or O_NONBLOCK make it return -EAGAIN). The pages of a large message are added to the pipe by reference, without copying them: the pipe and the message share them, and in broadcast mode the other subscribers too. A message stored inline, small or in an arena slot, is copied in new pages, a pipe buffer for each page of its content. The message is truncated to len bytes, but it is moved only whole: if the pipe has not a free buffer for each page of the message, the message is left for the next read and the splice_read returns -EAGAIN, or -EFBIG if the pipe is too small even when empty (F_SETPIPE_SZ). The message is left for the next read too if the pipe has no readers. A message of no bytes is consumed without moving anything, since the pipe would read it as the end of the file, and the next message is moved in its place. The splice_read returns the number of bytes moved, -1 or a negative error code in case of error */
+static ssize_t dev_splice_read(struct file *file, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+/* The splice_write function is invoked by splice() and sendfile() with the device file as destination and posts one message with the data in the pipe, up to len and max_message_size bytes: the rest is left in the pipe for the next call. The message takes a reference to the pages of the pipe buffers instead of copying them, so the data of a page cache page can change if the file is written afterwards, as for the other splice destinations. The storage, the send timeout, the tag, the priority and the time to live are handled as in dev_write. The splice_write returns the number of bytes consumed from the pipe, even if the message is delayed, -1 or a negative error code in case of error */
+static ssize_t dev_splice_write(struct pipe_inode_info *pipe, struct file *file, loff_t *ppos, size_t len, unsigned int flags);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+/* The uring_cmd function is invoked by io_uring for the IORING_OP_URING_CMD submissions on the device file, so a thread can drive many device files with batched submissions and completions. The operation is in cmd_op and its parameters in the struct message_uring_cmd stored in the cmd area of the submission. URING_CMD_SEND posts the message in the buffer as dev_write does; if delay_us is not zero the message is posted delay_us microseconds later, whatever the send timeout of the session. A send that would wait for room in the storage is moved by io_uring on a worker thread, where it can wait as a write does. URING_CMD_RECV completes with the next message copied in the buffer, truncated to len bytes, as dev_read. If there are no messages the command is parked on the device file without any thread waiting for it: a post, the expiration of the receive timeout of the session (no timeout if it is zero) or flush() tries it again in the task that submitted it. URING_CMD_RECV doesn't support the sessions with a tag filter. URING_CMD_REVOKE revokes the delayed messages of the session as REVOKE_DELAYED_MESSAGES. The uring_cmd returns the result of the command: the number of written chars (0 for a delayed message, or its handle with SET_WRITE_HANDLES), the number of read chars, -ETIME if the receive timeout expired, -ECANCELED if flush() is invoked or the ring is closed, the number of revoked messages for URING_CMD_REVOKE, or -EIOCBQUEUED while the read is parked */
+static int dev_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags);
+#endif
+
+/* The ioctl function allows to manage the session to a device file specified by the file input parameter. The other parama are the command to execute and the param for this command. The available commands are SET_SEND_TIMEOUT that sets the send_timeout to the value specified by param, SET_RECT_TIMEOUT that sets the recv_timeout to the value specified by param, SET_SEND_TIMEOUT_NS and SET_RECV_TIMEOUT_NS that set the same timeouts with nanosecond resolution from the struct message_timeout pointed by param (a relative time or, with TIMEOUT_ABSOLUTE, a CLOCK_MONOTONIC deadline: delayed posts are then driven by hrtimers and blocking reads by high resolution waits) and REVOKE_DELAYED_MESSAGE that revokes the post of all delayed message on the current session, SHARED_RING_WAIT that sleeps until the shared ring of the device file has a message to read, at most for param jiffies, and SHARED_RING_NOTIFY that wakes up the threads sleeping on the shared ring, and SET_ORDERING that sets the ordering of the messages of the device file to param. With ORDERING_FIFO (the default) the messages are read in the order they are posted; with ORDERING_PER_PRODUCER each CPU posts on its own queue, with its own lock and max_storage_size bytes of storage, and the readers drain the queues round-robin, so the messages keep their order only with respect to the same writer CPU; ORDERING_APPROXIMATE uses the same queues, but a reader takes the message at the head that was queued first, giving an approximate global order; with ORDERING_FAIR (list engine only) each session writes on its own queue, keeping the storage of the device file, and the readers serve the sessions with messages by deficit round-robin on the bytes, so a session that writes a lot doesn't delay the messages of the others: at its turn a session gets its weight times max_message_size bytes, reads its oldest messages while they fit, and passes the turn. The ordering can be set only by the only session open on the device file when it has no messages. SET_SEND_TAG sets the tag (the __u64 pointed by param, 0 for untagged messages) attached to the messages the session writes from then on, and SET_RECV_FILTER installs the tag filter of the session from the struct message_filter pointed by param: the reads of the session then take the oldest message whose tag matches, in the order the messages were posted, and sleep until a matching message is posted. The tagged messages of the list engine are indexed in a hash table of the tags, so a read with an exact filter doesn't scan the queue; a read with another mask does. Filters are supported only by the list engine with the FIFO ordering. SET_SEND_PRIORITY sets the priority level (param, from 0 to PRIORITY_LEVELS - 1) of the messages the session writes from then on; a vectored write submitted with the real-time I/O priority class overrides it, mapping the I/O priority 0 on the highest level. With the list engine and the FIFO ordering the messages of each level have their own queue and a bitmap of the non-empty levels gives the highest one with a single bit scan, so the reads take the messages of the highest level first (with priority_aging_ms, a message older than the aging is read first whatever its level). The storage is shared by all the levels, but the priority_reservation parameter can reserve part of it to the higher levels. SET_MESSAGE_TTL sets the time to live of the messages the session writes from then on, from the struct message_timeout pointed by param (a time from the write or, with TIMEOUT_ABSOLUTE, a CLOCK_MONOTONIC deadline; zero for messages that don't expire). An expired message is never read: it is dropped when a read meets it, when a write finds the storage full and by the periodic scan of the module, every ttl_reap_ms milliseconds, and its storage is given back. SET_WRITE_TIMEOUT_NS sets, from the struct message_timeout pointed by param, how long the writes of the session wait for room in a full storage (zero to fail at once). SET_BROADCAST switches the device file to broadcast mode with the lagging policy param (BROADCAST_OFF to switch back): every session open for reading is a subscriber with its own cursor in a shared log of the messages, so a message is stored once and read by every subscriber open when it was posted, in the order of the posts, and it is freed, giving back its storage, when the slowest subscriber reads it or is closed. Writers that don't read should open the device file with O_WRONLY, so they don't hold the log back. When the log fills the storage, BROADCAST_DROP drops its oldest messages and the subscribers that did not read them skip them (lagged_messages in the statistics), while BROADCAST_BLOCK leaves the writers failing or waiting for room as with a full storage. Tags, filters, priorities and time to live are ignored in broadcast mode, and the mode, like the ordering, can be set only by the only session open on the device file when it has no messages. SET_WRITE_HANDLES (param not zero) makes the delayed writes of the session return a handle of the message instead of 0: the handles are positive in an int, unique on the device file and indexed in a hash table, so CANCEL_DELAYED_MESSAGE cancels the delayed message with the handle (the __u64 pointed by param) and RESCHEDULE_DELAYED_MESSAGE moves its posting to the timeout of the struct message_reschedule pointed by param (a time from now or, with TIMEOUT_ABSOLUTE, a CLOCK_MONOTONIC deadline; the message is then driven by a hrtimer), without scanning the pending writes. Any session of the device file can cancel or reschedule a message by its handle, and a vectored write returns the handle of its last message. SET_STORAGE_QUOTA limits to param bytes (0 for no quota) the storage used by the messages the session wrote and nobody read yet, delayed ones included, so a single session can't take all the storage of the device file: a write over the quota fails at once. SET_FAIR_WEIGHT sets the weight of the session with ORDERING_FAIR to param, from 1 (the default) to FAIR_MAX_WEIGHT. The ioctl returns 0 in case of success. CANCEL_DELAYED_MESSAGE and RESCHEDULE_DELAYED_MESSAGE return -ENOENT if the message has no handle, or it has already been posted, revoked or canceled. SET_ORDERING and SET_BROADCAST return -EINVAL for an unknown ordering or mode, or for a per-producer ordering in broadcast mode, and -EBUSY if other sessions are open or messages are stored. SET_SEND_PRIORITY returns -EINVAL for an unknown level, SET_FAIR_WEIGHT for an invalid weight and SET_STORAGE_QUOTA for a quota over LONG_MAX; SET_ORDERING returns -EINVAL for ORDERING_FAIR with the ring engine. SET_RECV_FILTER returns -EOPNOTSUPP with the ring engine, and the filtered reads return -EOPNOTSUPP with a per-producer ordering. SHARED_RING_WAIT returns -ETIME if the timeout expires, -ECANCELED if flush() is invoked and -ENXIO if the ring has not been mapped.*/
 static long dev_ioctl(struct file *file, unsigned int command, unsigned long param);
 
+/* The poll function allows to wait for a device file with poll(), select() and epoll. The thread is registered on the waitqueue of the blocked readers and on the waitqueue woken up when storage is released. The device file is readable (EPOLLIN) when there are available readings, or when the session mapped the shared ring and the ring has a message to read; it is writable (EPOLLOUT) when the storage, and the quota of the session, have room for a message of max_message_size bytes. The poll returns the mask of the ready events. */
+static __poll_t dev_poll(struct file *file, poll_table *wait);
+
+/* The mmap function maps the shared ring of the device file specified througth the struct file passed in input. The ring is created by the first mmap on the device file, with a slot for each max_message_size bytes of max_storage_size, and it lives as long as the channel: it is freed when the channel is reclaimed, after the last session is closed and its slots are all read. The mapping has to start at offset zero and can't be larger than the ring. Co-operating processes enqueue and dequeue messages on the ring directly, following the protocol described by struct shared_ring_header, and enter the kernel only to sleep (SHARED_RING_WAIT), to wake up the sleeping consumers (SHARED_RING_NOTIFY) or to schedule a delayed write: once a session has mapped the ring, its delayed writes are posted on the ring when the timer expires. REVOKE_DELAYED_MESSAGES and flush() work as for the other delayed writes and flush() also aborts the waits on the ring. The mmap returns 0 in case of success. */
+static int dev_mmap(struct file *file, struct vm_area_struct *vma);
+
 /* The flush operation allows to unblock all the blocked readers on the device file and cancel all delayed writes across all sessions open for device file. To unblock the blocked readers the function iterates over the list of pending read associated to device file and set to true the flag is_flushed. Then wakes up all the thread sleeping on the waitqueue. When schedulated these threads will be check the flush condition and will abort the read operation. The flush returns 0 in case of success */
 static int dev_flush(struct file *file, fl_owner_t id);
 
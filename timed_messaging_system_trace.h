@@ -0,0 +1,155 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM timed_messaging_system
+
+#if !defined(_TIMED_MESSAGING_SYSTEM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TIMED_MESSAGING_SYSTEM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+//Tracepoints of the module. They cost a not taken branch while disabled and they can be enabled from tracefs, perf or
+//trace-cmd (e.g. "trace-cmd record -e timed_messaging_system"). Latencies are in nanoseconds
+
+//tms_write is hit when a batch of count messages of size bytes in total is immediatly posted on a device file
+TRACE_EVENT(tms_write,
+	TP_PROTO(int minor, size_t size, int count),
+	TP_ARGS(minor, size, count),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, size)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->size = size;
+		__entry->count = count;
+	),
+	TP_printk("minor=%d size=%zu count=%d", __entry->minor, __entry->size, __entry->count)
+);
+
+//tms_write_deferred is hit when the posting of a batch of count messages is deferred by delay_ns
+TRACE_EVENT(tms_write_deferred,
+	TP_PROTO(int minor, size_t size, int count, s64 delay_ns),
+	TP_ARGS(minor, size, count, delay_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, size)
+		__field(int, count)
+		__field(s64, delay_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->size = size;
+		__entry->count = count;
+		__entry->delay_ns = delay_ns;
+	),
+	TP_printk("minor=%d size=%zu count=%d delay_ns=%lld", __entry->minor, __entry->size, __entry->count, __entry->delay_ns)
+);
+
+//tms_deferred_publish is hit when a delayed message is posted by the delivery work. latency_ns is the time since the write
+TRACE_EVENT(tms_deferred_publish,
+	TP_PROTO(int minor, size_t size, s64 latency_ns),
+	TP_ARGS(minor, size, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, size)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->size = size;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("minor=%d size=%zu latency_ns=%lld", __entry->minor, __entry->size, __entry->latency_ns)
+);
+
+//tms_read is hit for each message read. latency_ns is the time the message spent in the queue of the device file
+TRACE_EVENT(tms_read,
+	TP_PROTO(int minor, size_t size, s64 latency_ns),
+	TP_ARGS(minor, size, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, size)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->size = size;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("minor=%d size=%zu latency_ns=%lld", __entry->minor, __entry->size, __entry->latency_ns)
+);
+
+//tms_read_timeout is hit when a blocking read is aborted because its timeout expired after waited_ns
+TRACE_EVENT(tms_read_timeout,
+	TP_PROTO(int minor, s64 waited_ns),
+	TP_ARGS(minor, waited_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(s64, waited_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->waited_ns = waited_ns;
+	),
+	TP_printk("minor=%d waited_ns=%lld", __entry->minor, __entry->waited_ns)
+);
+
+//tms_revoke is hit when REVOKE_DELAYED_MESSAGES cancels count delayed messages of a session
+TRACE_EVENT(tms_revoke,
+	TP_PROTO(int minor, int count),
+	TP_ARGS(minor, count),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+	),
+	TP_printk("minor=%d count=%d", __entry->minor, __entry->count)
+);
+
+//tms_expire is hit when count messages whose time to live is over are dropped
+TRACE_EVENT(tms_expire,
+	TP_PROTO(int minor, int count),
+	TP_ARGS(minor, count),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+	),
+	TP_printk("minor=%d count=%d", __entry->minor, __entry->count)
+);
+
+//tms_flush is hit when flush() cancels canceled_writes delayed messages and aborts aborted_reads blocked readings and
+//aborted_writes writes waiting for room in the storage
+TRACE_EVENT(tms_flush,
+	TP_PROTO(int minor, int canceled_writes, int aborted_reads, int aborted_writes),
+	TP_ARGS(minor, canceled_writes, aborted_reads, aborted_writes),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, canceled_writes)
+		__field(int, aborted_reads)
+		__field(int, aborted_writes)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->canceled_writes = canceled_writes;
+		__entry->aborted_reads = aborted_reads;
+		__entry->aborted_writes = aborted_writes;
+	),
+	TP_printk("minor=%d canceled_writes=%d aborted_reads=%d aborted_writes=%d", __entry->minor, __entry->canceled_writes,
+		__entry->aborted_reads, __entry->aborted_writes)
+);
+
+#endif
+
+//The header is looked up again by define_trace.h, from the directory of the module (the Makefile adds it to the include path)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE timed_messaging_system_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "../timed_messaging_system.h"
+
+#define MAX_DEVICES 8
+#define DEFAULT_PRODUCERS 1
+#define DEFAULT_CONSUMERS 1
+#define DEFAULT_MESSAGE_SIZE 64
+#define DEFAULT_DURATION_SEC 5
+#define DEFAULT_DELAY_US 1000
+#define DEFAULT_RECV_TIMEOUT_US 100000
+
+//Latencies are collected in log-linear histograms: 2^SUB_BUCKET_BITS buckets for each power of two, so the percentiles have
+//a relative error below 1 / 2^SUB_BUCKET_BITS
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (64 * SUB_BUCKETS)
+
+//Every message starts with a stamp, so the consumers can compute the latency from the time the message was due
+struct stamp {
+	uint64_t sent_ns;
+	uint64_t delay_ns;
+};
+
+struct config {
+	int device_count;
+	char *devices[MAX_DEVICES];
+	int producers;
+	int consumers;
+	int message_size;
+	int duration_sec;
+	double delayed_ratio;
+	long delay_us;
+	long recv_timeout_us;
+	int ordering;
+	const char *label;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	uint64_t messages;
+	uint64_t rejected;
+	uint64_t latencies[HISTOGRAM_BUCKETS];
+};
+
+static struct config config = {
+	.producers = DEFAULT_PRODUCERS,
+	.consumers = DEFAULT_CONSUMERS,
+	.message_size = DEFAULT_MESSAGE_SIZE,
+	.duration_sec = DEFAULT_DURATION_SEC,
+	.delayed_ratio = 0,
+	.delay_us = DEFAULT_DELAY_US,
+	.recv_timeout_us = DEFAULT_RECV_TIMEOUT_US,
+	.ordering = ORDERING_FIFO,
+	.label = "",
+};
+
+static volatile int stop;
+
+static uint64_t now_ns(void) {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value) {
+	int exponent;
+
+	if (value < SUB_BUCKETS)
+		return value;
+	exponent = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+	return (exponent + 1) * SUB_BUCKETS + ((value >> exponent) & (SUB_BUCKETS - 1));
+}
+
+//histogram_value returns the lower bound of the values counted in a bucket
+static uint64_t histogram_value(int bucket) {
+	int exponent = bucket / SUB_BUCKETS - 1;
+
+	if (exponent < 0)
+		return bucket;
+	return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << exponent;
+}
+
+static uint64_t percentile(uint64_t *histogram, uint64_t count, double fraction) {
+	uint64_t target = (uint64_t)(count * fraction);
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen > target)
+			return histogram_value(i);
+	}
+	return 0;
+}
+
+static void set_timeout(int fd, unsigned long command, long us) {
+	struct message_timeout timeout;
+
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.tv_sec = us / 1000000;
+	timeout.tv_nsec = (us % 1000000) * 1000;
+	if (ioctl(fd, command, &timeout) == -1) {
+		printf("Error in ioctl()\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int open_device(const char *filename) {
+	int fd = open(filename, O_RDWR);
+
+	if (fd == -1) {
+		printf("Error in open() of %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+//producer writes messages on its device file until the end of the run. A delayed message is written on a second session whose
+//send timeout is delay_us; a write rejected because the storage is full is counted and retried with the next message
+static void *producer(void *arg) {
+	struct worker *worker = arg;
+	const char *device = config.devices[worker->id % config.device_count];
+	int immediate_fd = open_device(device);
+	int delayed_fd = open_device(device);
+	unsigned int seed = worker->id;
+	struct stamp *stamp;
+	char *message;
+	int delayed;
+
+	message = calloc(1, config.message_size);
+	if (message == NULL) {
+		printf("Error in calloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	stamp = (struct stamp *)message;
+	set_timeout(delayed_fd, SET_SEND_TIMEOUT_NS, config.delay_us);
+
+	while (!stop) {
+		delayed = rand_r(&seed) < config.delayed_ratio * RAND_MAX;
+		stamp->delay_ns = delayed ? config.delay_us * 1000ULL : 0;
+		stamp->sent_ns = now_ns();
+		if (write(delayed ? delayed_fd : immediate_fd, message, config.message_size) == -1)
+			worker->rejected++;
+		else
+			worker->messages++;
+	}
+
+	free(message);
+	close(delayed_fd);
+	close(immediate_fd);
+	return NULL;
+}
+
+//consumer reads messages from its device file until the end of the run, recording how late each one is read with respect to
+//the time it was due
+static void *consumer(void *arg) {
+	struct worker *worker = arg;
+	int fd = open_device(config.devices[worker->id % config.device_count]);
+	struct stamp stamp;
+	char *message;
+	uint64_t due;
+	uint64_t now;
+
+	message = calloc(1, config.message_size);
+	if (message == NULL) {
+		printf("Error in calloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	set_timeout(fd, SET_RECV_TIMEOUT_NS, config.recv_timeout_us);
+
+	while (!stop) {
+		if (read(fd, message, config.message_size) < (ssize_t)sizeof(struct stamp))
+			continue;
+		now = now_ns();
+		memcpy(&stamp, message, sizeof(struct stamp));
+		due = stamp.sent_ns + stamp.delay_ns;
+		worker->latencies[histogram_bucket(now > due ? now - due : 0)]++;
+		worker->messages++;
+	}
+
+	free(message);
+	close(fd);
+	return NULL;
+}
+
+//drain removes the messages left on the device files, so they don't leak into the next run
+static void drain(void) {
+	char *message = malloc(config.message_size);
+	int fd, i;
+
+	for (i = 0; i < config.device_count && message != NULL; i++) {
+		fd = open(config.devices[i], O_RDWR | O_NONBLOCK);
+		if (fd == -1)
+			continue;
+		while (read(fd, message, config.message_size) > 0)
+			;
+		close(fd);
+	}
+	free(message);
+}
+
+//set_ordering sets the ordering of each device file from a session that stays open for the whole run, so the channel of the
+//device file is not reclaimed. It has to be called before the workers open the device files
+static void set_ordering(int *fds) {
+	int i;
+
+	for (i = 0; i < config.device_count; i++) {
+		fds[i] = open(config.devices[i], O_RDWR);
+		if (fds[i] == -1 || ioctl(fds[i], SET_ORDERING, config.ordering) == -1) {
+			printf("Error in setting the ordering of %s\n", config.devices[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static double cpu_seconds(void) {
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(void) {
+	printf("Usage: sudo ./bench [options] <filename> [filename...]\n");
+	printf("  -p <producers>        producer threads, assigned to the device files in turn (default %d)\n", DEFAULT_PRODUCERS);
+	printf("  -c <consumers>        consumer threads, assigned to the device files in turn (default %d)\n", DEFAULT_CONSUMERS);
+	printf("  -s <bytes>            message size, at least %zu (default %d)\n", sizeof(struct stamp), DEFAULT_MESSAGE_SIZE);
+	printf("  -t <seconds>          duration of the run (default %d)\n", DEFAULT_DURATION_SEC);
+	printf("  -r <ratio>            fraction of delayed messages, from 0 to 1 (default 0)\n");
+	printf("  -d <us>               send timeout of the delayed messages (default %d)\n", DEFAULT_DELAY_US);
+	printf("  -w <us>               receive timeout of the consumers (default %d)\n", DEFAULT_RECV_TIMEOUT_US);
+	printf("  -o <ordering>         ordering of the device files: 0 fifo, 1 per-producer, 2 approximate, 3 fair (default 0)\n");
+	printf("  -l <label>            label copied in the output, e.g. the version of the module\n");
+	printf("The output is a single JSON object. Latencies are in nanoseconds from the time a message was due\n");
+}
+
+static void parse_options(int argc, char *argv[]) {
+	int option;
+
+	while ((option = getopt(argc, argv, "p:c:s:t:r:d:w:o:l:h")) != -1) {
+		switch (option) {
+			case 'p': config.producers = strtol(optarg, NULL, 0); break;
+			case 'c': config.consumers = strtol(optarg, NULL, 0); break;
+			case 's': config.message_size = strtol(optarg, NULL, 0); break;
+			case 't': config.duration_sec = strtol(optarg, NULL, 0); break;
+			case 'r': config.delayed_ratio = strtod(optarg, NULL); break;
+			case 'd': config.delay_us = strtol(optarg, NULL, 0); break;
+			case 'w': config.recv_timeout_us = strtol(optarg, NULL, 0); break;
+			case 'o': config.ordering = strtol(optarg, NULL, 0); break;
+			case 'l': config.label = optarg; break;
+			default: usage(); exit(EXIT_FAILURE);
+		}
+	}
+
+	for (; optind < argc && config.device_count < MAX_DEVICES; optind++)
+		config.devices[config.device_count++] = argv[optind];
+
+	if (config.device_count == 0 || config.producers <= 0 || config.consumers <= 0 || config.duration_sec <= 0 ||
+			config.message_size < (int)sizeof(struct stamp) || config.delayed_ratio < 0 || config.delayed_ratio > 1 ||
+			config.delay_us <= 0 || config.recv_timeout_us <= 0 || config.ordering < ORDERING_FIFO ||
+			config.ordering > ORDERING_FAIR) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[]){
+	struct worker *producers, *consumers;
+	uint64_t *latencies;
+	uint64_t written = 0, rejected = 0, read_messages = 0;
+	int ordering_fds[MAX_DEVICES];
+	double start, elapsed, cpu;
+	int i, j;
+
+	parse_options(argc, argv);
+
+	producers = calloc(config.producers, sizeof(struct worker));
+	consumers = calloc(config.consumers, sizeof(struct worker));
+	latencies = calloc(HISTOGRAM_BUCKETS, sizeof(uint64_t));
+	if (producers == NULL || consumers == NULL || latencies == NULL) {
+		printf("Error in calloc()\n");
+		return(EXIT_FAILURE);
+	}
+
+	drain();
+	set_ordering(ordering_fds);
+	cpu = cpu_seconds();
+	start = now_ns() / 1e9;
+
+	for (i = 0; i < config.consumers; i++) {
+		consumers[i].id = i;
+		pthread_create(&consumers[i].thread, NULL, consumer, &consumers[i]);
+	}
+	for (i = 0; i < config.producers; i++) {
+		producers[i].id = i;
+		pthread_create(&producers[i].thread, NULL, producer, &producers[i]);
+	}
+
+	sleep(config.duration_sec);
+	stop = 1;
+
+	for (i = 0; i < config.producers; i++) {
+		pthread_join(producers[i].thread, NULL);
+		written += producers[i].messages;
+		rejected += producers[i].rejected;
+	}
+	for (i = 0; i < config.consumers; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		read_messages += consumers[i].messages;
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+			latencies[j] += consumers[i].latencies[j];
+	}
+	elapsed = now_ns() / 1e9 - start;
+	cpu = cpu_seconds() - cpu;
+	drain();
+	for (i = 0; i < config.device_count; i++)
+		close(ordering_fds[i]);
+
+	printf("{\"label\": \"%s\", \"devices\": %d, \"producers\": %d, \"consumers\": %d, \"message_size\": %d, "
+		"\"duration_sec\": %.3f, \"delayed_ratio\": %.3f, \"delay_us\": %ld, \"recv_timeout_us\": %ld, \"ordering\": %d, "
+		"\"written\": %llu, \"read\": %llu, \"rejected\": %llu, \"throughput_msg_per_sec\": %.0f, "
+		"\"rejected_write_rate\": %.6f, \"latency_p50_ns\": %llu, \"latency_p99_ns\": %llu, \"latency_p999_ns\": %llu, "
+		"\"cpu_ns_per_msg\": %.0f}\n",
+		config.label, config.device_count, config.producers, config.consumers, config.message_size,
+		elapsed, config.delayed_ratio, config.delay_us, config.recv_timeout_us, config.ordering,
+		(unsigned long long)written, (unsigned long long)read_messages, (unsigned long long)rejected,
+		read_messages / elapsed, written + rejected == 0 ? 0 : (double)rejected / (written + rejected),
+		(unsigned long long)percentile(latencies, read_messages, 0.5),
+		(unsigned long long)percentile(latencies, read_messages, 0.99),
+		(unsigned long long)percentile(latencies, read_messages, 0.999),
+		read_messages == 0 ? 0 : cpu * 1e9 / read_messages);
+
+	free(latencies);
+	free(consumers);
+	free(producers);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "../timed_messaging_system.h"
+
+//Test of a broadcast device file with BROADCAST_DROP and a subscriber that doesn't read: the log is filled with small messages,
+//then a nonblocking write of a large message has to succeed at once, dropping only the oldest messages it needs room for, and
+//the subscriber has to read the messages left in order, followed by the large one
+
+#define PARAMETERS "/sys/module/timed_messaging_system/parameters/"
+#define SMALL_SIZE ((ssize_t)sizeof(long))
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+//read_parameter returns the value of a parameter of the module
+static long read_parameter(const char *name) {
+	char path[256];
+	FILE *file;
+	long value;
+
+	snprintf(path, sizeof(path), PARAMETERS "%s", name);
+	file = fopen(path, "r");
+	if (file == NULL || fscanf(file, "%ld", &value) != 1) {
+		printf("Error in reading %s: is the module installed?\n", path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+	return value;
+}
+
+int main(int argc, char *argv[]){
+	long max_storage_size, large_size, written, kept, id;
+	char *buffer;
+	int fd, subscriber_fd;
+	ssize_t outcome;
+
+	if (argc != 2) {
+		printf("Usage: sudo ./broadcast_test <filename>\n");
+		printf("The device file must not be open elsewhere, and the module installed without message_arena and priority_reservation\n");
+		return(EXIT_FAILURE);
+	}
+
+	max_storage_size = read_parameter("max_storage_size");
+	large_size = read_parameter("max_message_size");
+	if (large_size > max_storage_size)
+		large_size = max_storage_size;
+	CHECK(large_size > SMALL_SIZE);
+	buffer = calloc(1, large_size);
+	CHECK(buffer != NULL);
+
+	//The writer doesn't read, so it is not a subscriber; the mode is set while it is the only session
+	fd = open(argv[1], O_WRONLY | O_NONBLOCK);
+	CHECK(fd != -1);
+	CHECK(ioctl(fd, SET_BROADCAST, BROADCAST_DROP) == 0);
+	subscriber_fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+	CHECK(subscriber_fd != -1);
+
+	written = max_storage_size / SMALL_SIZE;
+	for (id = 0; id < written; id++)
+		CHECK(write(fd, &id, SMALL_SIZE) == SMALL_SIZE);
+
+	//The oldest messages the large one needs room for are dropped, and the write doesn't fail even if nonblocking
+	kept = (max_storage_size - large_size) / SMALL_SIZE;
+	if (kept > written)
+		kept = written;
+	outcome = write(fd, buffer, large_size);
+	if (outcome == -1)
+		printf("Error in write() of %ld bytes on the full log: %s\n", large_size, strerror(errno));
+	CHECK(outcome == large_size);
+
+	for (id = written - kept; id < written; id++) {
+		CHECK(read(subscriber_fd, buffer, large_size) == SMALL_SIZE);
+		CHECK(memcmp(buffer, &id, SMALL_SIZE) == 0);
+	}
+	CHECK(read(subscriber_fd, buffer, large_size) == large_size);
+	CHECK(read(subscriber_fd, buffer, large_size) == -1 && errno == EAGAIN);
+
+	close(subscriber_fd);
+	close(fd);
+	free(buffer);
+	printf("ok broadcast drop: %ld of %ld messages dropped for a write of %ld bytes\n", written - kept, written, large_size);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include "tms_core.h"
+
+//Microbenchmarks of the core of the message queue, built in userspace with user/tms_core.c, so they run without the module. Each
+//benchmark prints a line in the format of Google Benchmark: name with its arguments, time per operation and operations per second
+
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_MAX_THREADS 8
+#define MESSAGE_SIZE 64
+#define STORAGE_SIZE (1L << 30)
+#define CANCEL_DELAY_NS 1000000000LL
+
+struct run {
+	struct tms_queue *queue;
+	long iterations;						//operations of each thread
+	long total;								//messages the consumers have to read in all
+	long *consumed;							//messages read by all the consumers
+	pthread_barrier_t *start;
+};
+
+//worker is the argument of a thread of a run. Each thread takes its own times, so the run lasts from the first start to the last
+//end whatever the main thread is doing
+struct worker {
+	struct run *run;
+	double start;							//seconds when the thread passed the barrier
+	double end;								//seconds when the thread finished its operations
+};
+
+static struct tms_queue queue;
+
+static double now(void) {
+	return ktime_get() / 1e9;
+}
+
+static void report(const char *name, long operations, double elapsed) {
+	printf("%-48s %10.1f ns %14.0f items_per_second\n", name, elapsed * 1e9 / operations, operations / elapsed);
+}
+
+static void *producer(void *argument) {
+	struct worker *worker = argument;
+	struct run *run = worker->run;
+	char message[MESSAGE_SIZE] = { 0 };
+	long i;
+
+	pthread_barrier_wait(run->start);
+	worker->start = now();
+	for (i = 0; i < run->iterations; i++) {
+		while (tms_send(run->queue, message, MESSAGE_SIZE) < 0)
+			sched_yield();
+	}
+	worker->end = now();
+	return NULL;
+}
+
+static void *consumer(void *argument) {
+	struct worker *worker = argument;
+	struct run *run = worker->run;
+	char message[MESSAGE_SIZE];
+
+	pthread_barrier_wait(run->start);
+	worker->start = now();
+	while (__atomic_load_n(run->consumed, __ATOMIC_RELAXED) < run->total) {
+		if (tms_receive(run->queue, message, MESSAGE_SIZE) < 0)
+			continue;
+		__atomic_fetch_add(run->consumed, 1, __ATOMIC_RELAXED);
+	}
+	worker->end = now();
+	return NULL;
+}
+
+static void *delayed_canceler(void *argument) {
+	struct worker *worker = argument;
+	struct run *run = worker->run;
+	char message[MESSAGE_SIZE] = { 0 };
+	ssize_t handle;
+	long i;
+
+	pthread_barrier_wait(run->start);
+	worker->start = now();
+	for (i = 0; i < run->iterations; i++) {
+		handle = tms_send_delayed(run->queue, message, MESSAGE_SIZE, CANCEL_DELAY_NS);
+		if (handle < 0 || tms_cancel(run->queue, handle) != 0) {
+			printf("Error in tms_send_delayed() or tms_cancel()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	worker->end = now();
+	return NULL;
+}
+
+//run_threads starts a thread for each of the count routines, all with run, and returns the seconds from the first start to the
+//last end of the threads
+static double run_threads(int count, void *(**routines)(void *), struct run *run) {
+	pthread_t *threads = malloc(count * sizeof(pthread_t));
+	struct worker *workers = malloc(count * sizeof(struct worker));
+	pthread_barrier_t start;
+	double first_start;
+	double last_end;
+	int i;
+
+	if (threads == NULL || workers == NULL) {
+		printf("Error in malloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start, NULL, count);
+	run->start = &start;
+	for (i = 0; i < count; i++) {
+		workers[i].run = run;
+		pthread_create(&threads[i], NULL, routines[i], &workers[i]);
+	}
+	for (i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+
+	first_start = workers[0].start;
+	last_end = workers[0].end;
+	for (i = 1; i < count; i++) {
+		if (workers[i].start < first_start)
+			first_start = workers[i].start;
+		if (workers[i].end > last_end)
+			last_end = workers[i].end;
+	}
+
+	pthread_barrier_destroy(&start);
+	free(workers);
+	free(threads);
+	return last_end - first_start;
+}
+
+//bench_send_receive runs threads producers and as many consumers on the queue: the producers append under the tail lock and the
+//consumers take under the head lock, so the two sides contend only when the queue runs empty
+static void bench_send_receive(int threads, long iterations) {
+	struct run run = { .queue = &queue, .iterations = iterations / threads, .total = iterations / threads * threads };
+	void *(**routines)(void *) = malloc(2 * threads * sizeof(*routines));
+	long consumed = 0;
+	char name[64];
+	int i;
+
+	if (routines == NULL) {
+		printf("Error in malloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < threads; i++) {
+		routines[2 * i] = producer;
+		routines[2 * i + 1] = consumer;
+	}
+	run.consumed = &consumed;
+
+	snprintf(name, sizeof(name), "BM_send_receive/producers:%d/consumers:%d", threads, threads);
+	report(name, run.total, run_threads(2 * threads, routines, &run));
+	free(routines);
+}
+
+//bench_delayed_cancel runs threads threads that write a delayed message and cancel it by its handle, contending on the lock of
+//the pending writes
+static void bench_delayed_cancel(int threads, long iterations) {
+	struct run run = { .queue = &queue, .iterations = iterations / threads };
+	void *(**routines)(void *) = malloc(threads * sizeof(*routines));
+	char name[64];
+	int i;
+
+	if (routines == NULL) {
+		printf("Error in malloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < threads; i++)
+		routines[i] = delayed_canceler;
+
+	snprintf(name, sizeof(name), "BM_delayed_cancel/threads:%d", threads);
+	report(name, run.iterations * threads, run_threads(threads, routines, &run));
+	free(routines);
+}
+
+//bench_revoke writes iterations delayed messages and revokes all of them at once
+static void bench_revoke(long iterations) {
+	char message[MESSAGE_SIZE] = { 0 };
+	double elapsed;
+	long i;
+
+	for (i = 0; i < iterations; i++) {
+		if (tms_send_delayed(&queue, message, MESSAGE_SIZE, CANCEL_DELAY_NS) < 0) {
+			printf("Error in tms_send_delayed()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = now();
+	if (tms_revoke(&queue) != iterations) {
+		printf("Error in tms_revoke()\n");
+		exit(EXIT_FAILURE);
+	}
+	report("BM_revoke", iterations, now() - elapsed);
+}
+
+//bench_deliver writes iterations delayed messages that expire at once, and measures the posting of all of them by the timers
+static void bench_deliver(long iterations) {
+	char message[MESSAGE_SIZE];
+	double elapsed;
+	long i;
+
+	for (i = 0; i < iterations; i++) {
+		if (tms_send_delayed(&queue, message, MESSAGE_SIZE, 0) < 0) {
+			printf("Error in tms_send_delayed()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = now();
+	if (shim_run_timers() != iterations) {
+		printf("Error in shim_run_timers()\n");
+		exit(EXIT_FAILURE);
+	}
+	report("BM_deliver_expired", iterations, now() - elapsed);
+
+	while (tms_receive(&queue, message, MESSAGE_SIZE) >= 0)
+		;
+}
+
+int main(int argc, char *argv[]){
+	long iterations;
+	int max_threads;
+	int threads;
+
+	if (argc > 3) {
+		printf("Usage: ./core_bench [iterations] [max_threads]\n");
+		return(EXIT_FAILURE);
+	}
+
+	iterations = argc > 1 ? strtol(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+	max_threads = argc > 2 ? strtol(argv[2], NULL, 0) : DEFAULT_MAX_THREADS;
+	if (iterations <= 0 || max_threads <= 0) {
+		printf("Invalid parameters\n");
+		return(EXIT_FAILURE);
+	}
+
+	tms_queue_init(&queue, STORAGE_SIZE);
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		bench_send_receive(threads, iterations);
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		bench_delayed_cancel(threads, iterations);
+	bench_revoke(iterations);
+	bench_deliver(iterations);
+
+	tms_queue_destroy(&queue);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "tms_core.h"
+
+//libFuzzer harness of the core of the message queue, built in userspace with user/tms_core.c. Each input is a sequence of
+//operations on a queue with a small storage: send, receive, delayed send, cancel, revoke, run of the expired timers and a jump
+//of the handles close to their wraparound. A model of the queue, with its posted and pending messages, predicts the result of
+//each operation and the storage used, and the harness aborts at the first difference
+
+#define STORAGE_SIZE 256
+#define MIN_MESSAGE_SIZE 4
+#define MAX_MESSAGES (STORAGE_SIZE / MIN_MESSAGE_SIZE)
+#define LONG_DELAY_NS 1000000000000LL
+
+#define FUZZ_CHECK(condition) \
+	do { \
+		if (!(condition)) \
+			abort(); \
+	} while (0)
+
+struct model_message {
+	uint32_t id;							//id written in the first bytes of the message
+	size_t size;
+	ssize_t handle;							//handle of the delayed message
+	bool expires;							//true if the delayed message expires at the next run of the timers
+};
+
+struct model {
+	struct model_message posted[MAX_MESSAGES];	//posted messages, the oldest first
+	int posted_count;
+	struct model_message pending[MAX_MESSAGES];	//delayed messages, in the order they were sent
+	int pending_count;
+	long storage_size;
+	uint32_t next_id;
+};
+
+static void model_remove_pending(struct model *model, int index) {
+	memmove(&(model->pending[index]), &(model->pending[index + 1]),
+		(model->pending_count - index - 1) * sizeof(struct model_message));
+	model->pending_count--;
+}
+
+static void fuzz_send(struct tms_queue *queue, struct model *model, uint8_t argument, bool delayed, bool expires) {
+	char message[MIN_MESSAGE_SIZE + 64] = { 0 };
+	struct model_message *sent;
+	size_t size = MIN_MESSAGE_SIZE + argument % 64;
+	ssize_t result;
+	uint32_t id = model->next_id++;
+
+	memcpy(message, &id, sizeof(id));
+	if (delayed)
+		result = tms_send_delayed(queue, message, size, expires ? 0 : LONG_DELAY_NS);
+	else
+		result = tms_send(queue, message, size);
+
+	if (model->storage_size + (long)size > STORAGE_SIZE) {
+		FUZZ_CHECK(result == -EAGAIN);
+		return;
+	}
+	model->storage_size += size;
+	if (delayed) {
+		FUZZ_CHECK(result > 0 && result <= INT_MAX);
+		sent = &(model->pending[model->pending_count++]);
+	} else {
+		FUZZ_CHECK(result == (ssize_t)size);
+		sent = &(model->posted[model->posted_count++]);
+	}
+	*sent = (struct model_message){ .id = id, .size = size, .handle = result, .expires = expires };
+}
+
+static void fuzz_receive(struct tms_queue *queue, struct model *model, uint8_t argument) {
+	char message[MIN_MESSAGE_SIZE + 64];
+	size_t len = MIN_MESSAGE_SIZE + argument % 64;
+	struct model_message *oldest = &(model->posted[0]);
+	ssize_t result;
+	uint32_t id;
+
+	result = tms_receive(queue, message, len);
+	if (model->posted_count == 0) {
+		FUZZ_CHECK(result == -EAGAIN);
+		return;
+	}
+	FUZZ_CHECK(result == (ssize_t)(len < oldest->size ? len : oldest->size));
+	memcpy(&id, message, sizeof(id));
+	FUZZ_CHECK(id == oldest->id);
+
+	model->storage_size -= oldest->size;
+	memmove(&(model->posted[0]), &(model->posted[1]), (model->posted_count - 1) * sizeof(struct model_message));
+	model->posted_count--;
+}
+
+//fuzz_cancel cancels a delayed message chosen by argument among the pending ones, or a handle that was never given out
+static void fuzz_cancel(struct tms_queue *queue, struct model *model, uint8_t argument) {
+	int index;
+
+	if (model->pending_count == 0 || argument == 0xff) {
+		FUZZ_CHECK(tms_cancel(queue, argument == 0xff ? 0 : (u64)INT_MAX + 1) == -ENOENT);
+		return;
+	}
+	index = argument % model->pending_count;
+	FUZZ_CHECK(tms_cancel(queue, model->pending[index].handle) == 0);
+	FUZZ_CHECK(tms_cancel(queue, model->pending[index].handle) == -ENOENT);
+	model->storage_size -= model->pending[index].size;
+	model_remove_pending(model, index);
+}
+
+static void fuzz_revoke(struct tms_queue *queue, struct model *model) {
+	int i;
+
+	FUZZ_CHECK(tms_revoke(queue) == model->pending_count);
+	for (i = 0; i < model->pending_count; i++)
+		model->storage_size -= model->pending[i].size;
+	model->pending_count = 0;
+}
+
+//fuzz_run_timers posts the delayed messages sent with no delay, in the order they were sent
+static void fuzz_run_timers(struct model *model) {
+	int expired = 0;
+	int i = 0;
+
+	while (i < model->pending_count) {
+		if (model->pending[i].expires) {
+			model->posted[model->posted_count++] = model->pending[i];
+			model_remove_pending(model, i);
+			expired++;
+		} else {
+			i++;
+		}
+	}
+	FUZZ_CHECK(shim_run_timers() == expired);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	struct tms_queue queue;
+	struct model model = { 0 };
+	size_t i;
+	uint8_t argument;
+
+	tms_queue_init(&queue, STORAGE_SIZE);
+
+	for (i = 0; i + 1 < size; i += 2) {
+		argument = data[i + 1];
+		switch (data[i] % 8) {
+		case 0:
+			fuzz_send(&queue, &model, argument, false, false);
+			break;
+		case 1:
+			fuzz_receive(&queue, &model, argument);
+			break;
+		case 2:
+			fuzz_send(&queue, &model, argument, true, true);
+			break;
+		case 3:
+			fuzz_send(&queue, &model, argument, true, false);
+			break;
+		case 4:
+			fuzz_cancel(&queue, &model, argument);
+			break;
+		case 5:
+			fuzz_revoke(&queue, &model);
+			break;
+		case 6:
+			fuzz_run_timers(&model);
+			break;
+		case 7:
+			//The handles of the pending messages would be given out again after the jump
+			if (model.pending_count == 0)
+				queue.next_handle = INT_MAX - argument % 4;
+			break;
+		}
+		FUZZ_CHECK(atomic_long_read(&(queue.storage_size)) == model.storage_size);
+		FUZZ_CHECK(atomic_read(&(queue.available_readings)) == model.posted_count);
+	}
+
+	tms_queue_destroy(&queue);
+	return 0;
+}
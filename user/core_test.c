@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tms_core.h"
+
+//Tests of the core of the message queue, built in userspace with user/tms_core.c: the FIFO order of the messages, the storage
+//accounting, the cancel and the revoke of the delayed messages racing with the expiry of their timers and the wraparound of the
+//handles. Each test prints a line when it passes; the first failed check prints its line and exits with EXIT_FAILURE
+
+#define MESSAGE_SIZE 64
+#define STORAGE_SIZE (1L << 20)
+#define FIFO_MESSAGES 100000
+#define RACE_ROUNDS 200
+#define RACE_MESSAGES 1000
+#define LONG_DELAY_NS 1000000000000LL
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+struct race {
+	struct tms_queue *queue;
+	ssize_t *handles;						//handles of the delayed messages to cancel
+	int count;								//number of handles
+	int canceled;							//messages canceled by the canceler
+	int expired;							//timers run by the expirer
+	bool revoke;							//true if the canceler revokes all the messages instead of canceling them one by one
+	pthread_barrier_t start;
+};
+
+static void fill_message(char *message, long id) {
+	memset(message, 0, MESSAGE_SIZE);
+	memcpy(message, &id, sizeof(id));
+}
+
+static long message_id(const char *message) {
+	long id;
+
+	memcpy(&id, message, sizeof(id));
+	return id;
+}
+
+//drain reads all the messages of queue and returns their number
+static int drain(struct tms_queue *queue) {
+	char message[MESSAGE_SIZE];
+	int count = 0;
+
+	while (tms_receive(queue, message, MESSAGE_SIZE) >= 0)
+		count++;
+	return count;
+}
+
+static void *fifo_producer(void *argument) {
+	struct tms_queue *queue = argument;
+	char message[MESSAGE_SIZE];
+	long id;
+
+	for (id = 0; id < FIFO_MESSAGES; id++) {
+		fill_message(message, id);
+		CHECK(tms_send(queue, message, MESSAGE_SIZE) == MESSAGE_SIZE);
+	}
+	return NULL;
+}
+
+//test_fifo checks that the messages are read in the order they are posted, with the reader on the head and the writer on the
+//tail of the queue at the same time, and with the incoming list drained while the message list is not empty
+static void test_fifo(void) {
+	struct tms_queue queue;
+	char message[MESSAGE_SIZE];
+	pthread_t producer;
+	long id;
+
+	tms_queue_init(&queue, STORAGE_SIZE * 64);
+
+	for (id = 0; id < 10; id++) {
+		fill_message(message, id);
+		CHECK(tms_send(&queue, message, MESSAGE_SIZE) == MESSAGE_SIZE);
+		if (id % 3 == 2) {
+			CHECK(tms_receive(&queue, message, MESSAGE_SIZE) == MESSAGE_SIZE);
+			CHECK(message_id(message) == id / 3);
+		}
+	}
+	for (id = 3; id < 10; id++) {
+		CHECK(tms_receive(&queue, message, MESSAGE_SIZE) == MESSAGE_SIZE);
+		CHECK(message_id(message) == id);
+	}
+	CHECK(tms_receive(&queue, message, MESSAGE_SIZE) == -EAGAIN);
+
+	pthread_create(&producer, NULL, fifo_producer, &queue);
+	for (id = 0; id < FIFO_MESSAGES; id++) {
+		while (tms_receive(&queue, message, MESSAGE_SIZE) < 0)
+			;
+		CHECK(message_id(message) == id);
+	}
+	pthread_join(producer, NULL);
+	CHECK(tms_receive(&queue, message, MESSAGE_SIZE) == -EAGAIN);
+
+	tms_queue_destroy(&queue);
+	printf("ok fifo\n");
+}
+
+//test_storage checks that the storage accounts the posted and the delayed messages, that a write that doesn't fit fails
+//without changing it, and that a read, a truncated one too, a cancel and a revoke give back the whole size of the message
+static void test_storage(void) {
+	struct tms_queue queue;
+	char message[2 * MESSAGE_SIZE] = { 0 };
+	ssize_t first;
+	ssize_t second;
+
+	tms_queue_init(&queue, 3 * MESSAGE_SIZE);
+
+	CHECK(tms_send(&queue, message, MESSAGE_SIZE) == MESSAGE_SIZE);
+	CHECK(atomic_long_read(&(queue.storage_size)) == MESSAGE_SIZE);
+	first = tms_send_delayed(&queue, message, MESSAGE_SIZE, LONG_DELAY_NS);
+	second = tms_send_delayed(&queue, message, MESSAGE_SIZE, LONG_DELAY_NS);
+	CHECK(first > 0 && second > 0 && first != second);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 3 * MESSAGE_SIZE);
+
+	CHECK(tms_send(&queue, message, 1) == -EAGAIN);
+	CHECK(tms_send_delayed(&queue, message, 1, 0) == -EAGAIN);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 3 * MESSAGE_SIZE);
+
+	CHECK(tms_receive(&queue, message, 1) == 1);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 2 * MESSAGE_SIZE);
+	CHECK(tms_cancel(&queue, first) == 0);
+	CHECK(tms_cancel(&queue, first) == -ENOENT);
+	CHECK(atomic_long_read(&(queue.storage_size)) == MESSAGE_SIZE);
+	CHECK(tms_send(&queue, message, 2 * MESSAGE_SIZE) == 2 * MESSAGE_SIZE);
+	CHECK(tms_revoke(&queue) == 1);
+	CHECK(tms_cancel(&queue, second) == -ENOENT);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 2 * MESSAGE_SIZE);
+	CHECK(drain(&queue) == 1);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 0);
+	CHECK(atomic_read(&(queue.available_readings)) == 0);
+
+	tms_queue_destroy(&queue);
+	printf("ok storage\n");
+}
+
+static void *race_expirer(void *argument) {
+	struct race *race = argument;
+	int expired;
+
+	pthread_barrier_wait(&(race->start));
+	do {
+		expired = shim_run_timers();
+		race->expired += expired;
+	} while (race->expired < race->count - __atomic_load_n(&(race->canceled), __ATOMIC_ACQUIRE) || expired > 0);
+	return NULL;
+}
+
+static void *race_canceler(void *argument) {
+	struct race *race = argument;
+	int canceled = 0;
+	int i;
+
+	pthread_barrier_wait(&(race->start));
+	if (race->revoke) {
+		canceled = tms_revoke(race->queue);
+	} else {
+		for (i = race->count - 1; i >= 0; i--) {
+			if (tms_cancel(race->queue, race->handles[i]) == 0)
+				canceled++;
+		}
+	}
+	__atomic_store_n(&(race->canceled), canceled, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+//run_race writes delayed messages that expire at once and cancels or revokes them while another thread runs their timers. Every
+//message has to be either canceled or posted, never both and never neither, and its storage has to be given back exactly once
+static void run_race(struct race *race) {
+	char message[MESSAGE_SIZE] = { 0 };
+	pthread_t expirer;
+	pthread_t canceler;
+	int i;
+
+	race->canceled = -1;
+	race->expired = 0;
+	for (i = 0; i < race->count; i++) {
+		race->handles[i] = tms_send_delayed(race->queue, message, MESSAGE_SIZE, 0);
+		CHECK(race->handles[i] > 0);
+	}
+	CHECK(atomic_long_read(&(race->queue->storage_size)) == race->count * MESSAGE_SIZE);
+
+	pthread_barrier_init(&(race->start), NULL, 2);
+	pthread_create(&expirer, NULL, race_expirer, race);
+	pthread_create(&canceler, NULL, race_canceler, race);
+	pthread_join(canceler, NULL);
+	pthread_join(expirer, NULL);
+	pthread_barrier_destroy(&(race->start));
+
+	CHECK(race->expired + race->canceled == race->count);
+	CHECK(drain(race->queue) == race->expired);
+	CHECK(atomic_long_read(&(race->queue->storage_size)) == 0);
+	for (i = 0; i < race->count; i++)
+		CHECK(tms_cancel(race->queue, race->handles[i]) == -ENOENT);
+	CHECK(tms_revoke(race->queue) == 0);
+}
+
+//test_race checks the cancel by handle or, with revoke, the revoke against the expiry of the timers, in many rounds
+static void test_race(bool revoke) {
+	struct tms_queue queue;
+	struct race race = { .queue = &queue, .count = RACE_MESSAGES, .revoke = revoke };
+	int round;
+
+	race.handles = malloc(RACE_MESSAGES * sizeof(ssize_t));
+	CHECK(race.handles != NULL);
+	tms_queue_init(&queue, STORAGE_SIZE);
+
+	for (round = 0; round < RACE_ROUNDS; round++)
+		run_race(&race);
+
+	tms_queue_destroy(&queue);
+	free(race.handles);
+	printf("ok %s race\n", revoke ? "revoke" : "cancel");
+}
+
+//test_handle_wraparound checks that the handles wrap around at INT_MAX skipping 0, so they always fit in the result of a write
+//and of an io_uring completion, and that the handles after the wraparound are found by the cancel
+static void test_handle_wraparound(void) {
+	struct tms_queue queue;
+	char message[MESSAGE_SIZE] = { 0 };
+	ssize_t before;
+	ssize_t last;
+	ssize_t after;
+
+	tms_queue_init(&queue, STORAGE_SIZE);
+
+	queue.next_handle = INT_MAX - 2;
+	before = tms_send_delayed(&queue, message, MESSAGE_SIZE, LONG_DELAY_NS);
+	last = tms_send_delayed(&queue, message, MESSAGE_SIZE, LONG_DELAY_NS);
+	after = tms_send_delayed(&queue, message, MESSAGE_SIZE, LONG_DELAY_NS);
+	CHECK(before == INT_MAX - 1);
+	CHECK(last == INT_MAX);
+	CHECK(after == 1);
+
+	CHECK(tms_cancel(&queue, after) == 0);
+	CHECK(tms_cancel(&queue, last) == 0);
+	CHECK(tms_cancel(&queue, 0) == -ENOENT);
+	CHECK(tms_cancel(&queue, (u64)INT_MAX + 1) == -ENOENT);
+	CHECK(tms_revoke(&queue) == 1);
+	CHECK(atomic_long_read(&(queue.storage_size)) == 0);
+
+	tms_queue_destroy(&queue);
+	printf("ok handle wraparound\n");
+}
+
+int main(int argc, char *argv[]){
+	test_fifo();
+	test_storage();
+	test_race(false);
+	test_race(true);
+	test_handle_wraparound();
+	return(EXIT_SUCCESS);
+}
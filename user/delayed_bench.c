@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "../timed_messaging_system.h"
+
+#define DEFAULT_OUTSTANDING 100000
+#define DEFAULT_OPEN_CLOSE_ITERATIONS 10000
+#define LONG_SEND_TIMEOUT 1000000
+#define SHORT_SEND_TIMEOUT 1
+
+static double now(clockid_t clock) {
+	struct timespec time;
+
+	clock_gettime(clock, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//open_close_rate returns the number of open/close pairs per second on the device file
+static double open_close_rate(const char *filename, int iterations) {
+	double start;
+	int fd, i;
+
+	start = now(CLOCK_MONOTONIC);
+	for (i = 0; i < iterations; i++) {
+		fd = open(filename, O_RDWR);
+		if (fd == -1) {
+			printf("Error in open()\n");
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+	}
+	return iterations / (now(CLOCK_MONOTONIC) - start);
+}
+
+//post_delayed posts count delayed messages of one byte and returns the mean cost of a write in nanoseconds
+static double post_delayed(int fd, int count) {
+	double start;
+	int i;
+
+	start = now(CLOCK_MONOTONIC);
+	for (i = 0; i < count; i++) {
+		if (write(fd, "x", 1) == -1) {
+			printf("Error in write() after %d delayed messages: increase max_storage_size\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return (now(CLOCK_MONOTONIC) - start) * 1e9 / count;
+}
+
+int main(int argc, char *argv[]){
+	int fd, read_fd, i, outstanding, iterations;
+	double start, elapsed;
+	char message;
+
+	if (argc < 2 || argc > 4) {
+		printf("Usage: sudo ./delayed_bench <filename> [outstanding_messages] [open_close_iterations]\n");
+		printf("The module has to be installed with max_storage_size of at least outstanding_messages bytes\n");
+		return(EXIT_FAILURE);
+	}
+
+	outstanding = argc > 2 ? strtol(argv[2], NULL, 0) : DEFAULT_OUTSTANDING;
+	iterations = argc > 3 ? strtol(argv[3], NULL, 0) : DEFAULT_OPEN_CLOSE_ITERATIONS;
+
+	printf("open_close_per_sec_idle %.0f\n", open_close_rate(argv[1], iterations));
+
+	fd = open(argv[1], O_RDWR);
+	read_fd = open(argv[1], O_RDWR | O_NONBLOCK);
+	if (fd == -1 || read_fd == -1) {
+		printf("Error in open()\n");
+		return(EXIT_FAILURE);
+	}
+
+	//Outstanding delayed messages whose timers don't expire during the measures
+	if (ioctl(fd, SET_SEND_TIMEOUT, LONG_SEND_TIMEOUT) == -1) {
+		printf("Error in ioctl()\n");
+		return(EXIT_FAILURE);
+	}
+	printf("delayed_write_ns %.0f\n", post_delayed(fd, outstanding));
+	printf("open_close_per_sec_outstanding %.0f\n", open_close_rate(argv[1], iterations));
+
+	start = now(CLOCK_MONOTONIC);
+	if (ioctl(fd, REVOKE_DELAYED_MESSAGES, NULL) == -1) {
+		printf("Error in ioctl()\n");
+		return(EXIT_FAILURE);
+	}
+	printf("revoke_ns_per_message %.0f\n", (now(CLOCK_MONOTONIC) - start) * 1e9 / outstanding);
+
+	//Delayed messages whose timers expire in the next tick: the time to drain them measures the delivery of expired writes
+	if (ioctl(fd, SET_SEND_TIMEOUT, SHORT_SEND_TIMEOUT) == -1) {
+		printf("Error in ioctl()\n");
+		return(EXIT_FAILURE);
+	}
+	start = now(CLOCK_MONOTONIC);
+	post_delayed(fd, outstanding);
+	for (i = 0; i < outstanding; ) {
+		if (read(read_fd, &message, 1) == 1)
+			i++;
+	}
+	elapsed = now(CLOCK_MONOTONIC) - start;
+	printf("delayed_delivery_per_sec %.0f\n", outstanding / elapsed);
+
+	close(read_fd);
+	close(fd);
+	return(EXIT_SUCCESS);
+}
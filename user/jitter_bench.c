@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "../timed_messaging_system.h"
+
+#define DEFAULT_DELAY_US 1000
+#define DEFAULT_SAMPLES 1000
+#define DEFAULT_HZ 250
+#define RECV_TIMEOUT_SEC 1
+
+enum timeout_path {
+	JIFFIES,
+	RELATIVE_NS,
+	ABSOLUTE_NS
+};
+
+static long long now_ns(void) {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+static int compare_lateness(const void *a, const void *b) {
+	long long first = *(const long long *)a;
+	long long second = *(const long long *)b;
+
+	return (first > second) - (first < second);
+}
+
+//set_timeout sets a high resolution timeout of nanoseconds ns through the ioctl command
+static void set_timeout(int fd, unsigned long command, long long ns, unsigned int flags) {
+	struct message_timeout timeout;
+
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.tv_sec = ns / 1000000000LL;
+	timeout.tv_nsec = ns % 1000000000LL;
+	timeout.flags = flags;
+	if (ioctl(fd, command, &timeout) == -1) {
+		printf("Error in ioctl()\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//measure posts samples delayed messages, each one delay_us microseconds after the write, and reads each of them with a
+//blocking read. It prints the lateness of the deliveries, that is the time between the expected and the effective delivery
+static void measure(const char *name, int write_fd, int read_fd, enum timeout_path path, long delay_us, int hz, int samples) {
+	long long *lateness;
+	long long start, sum = 0;
+	char message;
+	int i;
+
+	lateness = malloc(samples * sizeof(long long));
+	if (lateness == NULL) {
+		printf("Error in malloc()\n");
+		exit(EXIT_FAILURE);
+	}
+
+	//The jiffy timeout is rounded up, so a message is never posted before the requested delay
+	if (path == JIFFIES && ioctl(write_fd, SET_SEND_TIMEOUT, (delay_us * hz + 999999) / 1000000) == -1) {
+		printf("Error in ioctl()\n");
+		exit(EXIT_FAILURE);
+	}
+	if (path == RELATIVE_NS)
+		set_timeout(write_fd, SET_SEND_TIMEOUT_NS, delay_us * 1000LL, 0);
+
+	for (i = 0; i < samples; i++) {
+		start = now_ns();
+		if (path == ABSOLUTE_NS)
+			set_timeout(write_fd, SET_SEND_TIMEOUT_NS, start + delay_us * 1000LL, TIMEOUT_ABSOLUTE);
+		if (write(write_fd, "x", 1) == -1 || read(read_fd, &message, 1) != 1) {
+			printf("Error in write() or read() at sample %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+		lateness[i] = now_ns() - start - delay_us * 1000LL;
+		sum += lateness[i];
+	}
+
+	qsort(lateness, samples, sizeof(long long), compare_lateness);
+	printf("%s_lateness_us mean %.1f p50 %.1f p99 %.1f max %.1f\n", name, sum / 1000.0 / samples,
+		lateness[samples / 2] / 1000.0, lateness[samples * 99 / 100] / 1000.0, lateness[samples - 1] / 1000.0);
+	free(lateness);
+}
+
+int main(int argc, char *argv[]){
+	int write_fd, read_fd, samples, hz;
+	long delay_us;
+
+	if (argc < 2 || argc > 5) {
+		printf("Usage: sudo ./jitter_bench <filename> [delay_us] [samples] [hz]\n");
+		printf("hz is the tick rate of the kernel (CONFIG_HZ), used to convert the delay in jiffies\n");
+		return(EXIT_FAILURE);
+	}
+
+	delay_us = argc > 2 ? strtol(argv[2], NULL, 0) : DEFAULT_DELAY_US;
+	samples = argc > 3 ? strtol(argv[3], NULL, 0) : DEFAULT_SAMPLES;
+	hz = argc > 4 ? strtol(argv[4], NULL, 0) : DEFAULT_HZ;
+	if (delay_us <= 0 || samples <= 0 || hz <= 0) {
+		printf("Invalid parameters\n");
+		return(EXIT_FAILURE);
+	}
+
+	write_fd = open(argv[1], O_RDWR);
+	read_fd = open(argv[1], O_RDWR);
+	if (write_fd == -1 || read_fd == -1) {
+		printf("Error in open()\n");
+		return(EXIT_FAILURE);
+	}
+
+	//The reader always uses a high resolution wait, so the measures differ only for the timer that posts the message
+	set_timeout(read_fd, SET_RECV_TIMEOUT_NS, RECV_TIMEOUT_SEC * 1000000000LL, 0);
+
+	measure("jiffies", write_fd, read_fd, JIFFIES, delay_us, hz, samples);
+	measure("relative_ns", write_fd, read_fd, RELATIVE_NS, delay_us, hz, samples);
+	measure("absolute_ns", write_fd, read_fd, ABSOLUTE_NS, delay_us, hz, samples);
+
+	close(read_fd);
+	close(write_fd);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,258 @@
+#ifndef _KERNEL_SHIM_H
+#define _KERNEL_SHIM_H
+
+//Userspace stand-ins for the kernel primitives used by timed_messaging_core.h: lists, spinlocks, atomics, hashing and timers.
+//They follow the semantics of the kernel ones closely enough for the core to behave as in the module, but they are not meant to
+//be fast or complete: spinlocks are pthread spinlocks, atomics are the builtins of the compiler with full ordering, and timers
+//are kept in a list that shim_run_timers() scans
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef s64 ktime_t;
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, value) (*(volatile __typeof__(x) *)&(x) = (value))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define smp_mb__before_atomic() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+//Atomics
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+
+static inline int atomic_read(const atomic_t *v) { return __atomic_load_n(&(v->counter), __ATOMIC_RELAXED); }
+static inline void atomic_set(atomic_t *v, int i) { __atomic_store_n(&(v->counter), i, __ATOMIC_RELAXED); }
+static inline void atomic_add(int i, atomic_t *v) { __atomic_fetch_add(&(v->counter), i, __ATOMIC_RELAXED); }
+static inline void atomic_inc(atomic_t *v) { atomic_add(1, v); }
+
+static inline bool atomic_try_cmpxchg(atomic_t *v, int *old, int new) {
+	return __atomic_compare_exchange_n(&(v->counter), old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline int atomic_dec_if_positive(atomic_t *v) {
+	int old = atomic_read(v);
+
+	do {
+		if (old <= 0)
+			return old - 1;
+	} while (!__atomic_compare_exchange_n(&(v->counter), &old, old - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return old - 1;
+}
+
+static inline long atomic_long_read(const atomic_long_t *v) { return __atomic_load_n(&(v->counter), __ATOMIC_RELAXED); }
+static inline void atomic_long_set(atomic_long_t *v, long i) { __atomic_store_n(&(v->counter), i, __ATOMIC_RELAXED); }
+static inline void atomic_long_sub(long i, atomic_long_t *v) { __atomic_fetch_sub(&(v->counter), i, __ATOMIC_SEQ_CST); }
+
+static inline bool atomic_long_try_cmpxchg(atomic_long_t *v, long *old, long new) {
+	return __atomic_compare_exchange_n(&(v->counter), old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+//Spinlocks. The _bh variants are the same, since there are no softirqs
+
+typedef struct { pthread_spinlock_t lock; } spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *lock) { pthread_spin_init(&(lock->lock), PTHREAD_PROCESS_PRIVATE); }
+static inline void spin_lock(spinlock_t *lock) { pthread_spin_lock(&(lock->lock)); }
+static inline void spin_unlock(spinlock_t *lock) { pthread_spin_unlock(&(lock->lock)); }
+#define spin_lock_bh spin_lock
+#define spin_unlock_bh spin_unlock
+
+//Doubly linked lists, as in linux/list.h
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+	WRITE_ONCE(list->next, list);
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev, struct list_head *next) {
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	WRITE_ONCE(prev->next, new);
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head) { __list_add(new, head, head->next); }
+static inline void list_add_tail(struct list_head *new, struct list_head *head) { __list_add(new, head->prev, head); }
+
+static inline void __list_del(struct list_head *prev, struct list_head *next) {
+	next->prev = prev;
+	WRITE_ONCE(prev->next, next);
+}
+
+static inline void list_del(struct list_head *entry) {
+	__list_del(entry->prev, entry->next);
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry) {
+	__list_del(entry->prev, entry->next);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline bool list_empty(const struct list_head *head) { return READ_ONCE(head->next) == head; }
+
+static inline void list_move_tail(struct list_head *list, struct list_head *head) {
+	__list_del(list->prev, list->next);
+	list_add_tail(list, head);
+}
+
+static inline void __list_splice(const struct list_head *list, struct list_head *prev, struct list_head *next) {
+	struct list_head *first = list->next;
+	struct list_head *last = list->prev;
+
+	first->prev = prev;
+	prev->next = first;
+	last->next = next;
+	next->prev = last;
+}
+
+static inline void list_splice(const struct list_head *list, struct list_head *head) {
+	if (!list_empty(list))
+		__list_splice(list, head, head->next);
+}
+
+static inline void list_splice_init(struct list_head *list, struct list_head *head) {
+	if (!list_empty(list)) {
+		__list_splice(list, head, head->next);
+		INIT_LIST_HEAD(list);
+	}
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, __typeof__(*pos), member), n = list_next_entry(pos, member); \
+		&(pos->member) != (head); pos = n, n = list_next_entry(n, member))
+
+//Hash lists, as in linux/list.h
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+#define INIT_HLIST_HEAD(head) ((head)->first = NULL)
+
+static inline void INIT_HLIST_NODE(struct hlist_node *node) {
+	node->next = NULL;
+	node->pprev = NULL;
+}
+
+static inline void hlist_add_head(struct hlist_node *node, struct hlist_head *head) {
+	node->next = head->first;
+	if (head->first != NULL)
+		head->first->pprev = &(node->next);
+	head->first = node;
+	node->pprev = &(head->first);
+}
+
+static inline void hlist_del_init(struct hlist_node *node) {
+	if (node->pprev == NULL)
+		return;
+	*(node->pprev) = node->next;
+	if (node->next != NULL)
+		node->next->pprev = node->pprev;
+	INIT_HLIST_NODE(node);
+}
+
+#define hlist_entry_safe(ptr, type, member) ((ptr) != NULL ? container_of(ptr, type, member) : NULL)
+#define hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos != NULL; \
+		pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u64 hash_64(u64 value, unsigned int bits) { return (value * GOLDEN_RATIO_64) >> (64 - bits); }
+
+//Time. ktime_get() is CLOCK_MONOTONIC in nanoseconds, and jiffies tick every millisecond
+
+#define NSEC_PER_MSEC 1000000L
+
+static inline ktime_t ktime_get(void) {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+#define jiffies ((unsigned long)(ktime_get() / NSEC_PER_MSEC))
+
+//Timers. A timer armed with mod_timer() or hrtimer_start() is linked to a module-wide list and its callback is run by
+//shim_run_timers() once it expires. The callback is run without the lock of the list, after the timer is unlinked, so a
+//concurrent cancel finds it already expired, as in the kernel
+
+struct shim_timer {
+	struct list_head link;					//link in the armed timers, empty if the timer is not armed
+	ktime_t expires;						//CLOCK_MONOTONIC time the timer expires at
+	void (*run)(struct shim_timer *timer);	//callback of the timer, wrapping the one of timer_list or hrtimer
+};
+
+struct timer_list {
+	struct shim_timer base;
+	void (*function)(struct timer_list *timer);
+};
+
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_ABS_SOFT };
+
+struct hrtimer {
+	struct shim_timer base;
+	enum hrtimer_restart (*function)(struct hrtimer *timer);
+};
+
+void shim_timer_arm(struct shim_timer *timer, ktime_t expires);
+bool shim_timer_disarm(struct shim_timer *timer);
+
+//shim_run_timers runs the callbacks of the expired timers and returns their number
+int shim_run_timers(void);
+
+void shim_run_timer_list(struct shim_timer *timer);
+void shim_run_hrtimer(struct shim_timer *timer);
+
+static inline void timer_setup(struct timer_list *timer, void (*function)(struct timer_list *), unsigned int flags) {
+	INIT_LIST_HEAD(&(timer->base.link));
+	timer->base.run = shim_run_timer_list;
+	timer->function = function;
+}
+
+static inline void mod_timer(struct timer_list *timer, unsigned long expires) {
+	shim_timer_arm(&(timer->base), (ktime_t)expires * NSEC_PER_MSEC);
+}
+
+//POSIX timers have their own timer_delete
+#define timer_delete shim_timer_delete
+static inline bool timer_delete(struct timer_list *timer) { return shim_timer_disarm(&(timer->base)); }
+
+static inline void hrtimer_setup(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *), int clock,
+		enum hrtimer_mode mode) {
+	INIT_LIST_HEAD(&(timer->base.link));
+	timer->base.run = shim_run_hrtimer;
+	timer->function = function;
+}
+
+static inline void hrtimer_start(struct hrtimer *timer, ktime_t expires, enum hrtimer_mode mode) {
+	shim_timer_arm(&(timer->base), expires);
+}
+
+static inline int hrtimer_try_to_cancel(struct hrtimer *timer) { return shim_timer_disarm(&(timer->base)) ? 1 : 0; }
+
+#endif
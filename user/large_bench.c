@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "../timed_messaging_system.h"
+
+#define DEFAULT_ITERATIONS 1000
+#define MIN_SIZE 4096
+#define MAX_SIZE (1024 * 1024)
+
+static double now(void) {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//copy_rate writes and reads iterations messages of size bytes with write() and read(), so each message is copied from and to
+//userspace. It returns the throughput in MB/s
+static double copy_rate(int fd, char *buffer, size_t size, int iterations) {
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (write(fd, buffer, size) != (ssize_t)size || read(fd, buffer, size) != (ssize_t)size) {
+			printf("Error in write() or read() of %zu bytes\n", size);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return size * (double)iterations / (now() - start) / 1e6;
+}
+
+//splice_rate moves iterations messages of size bytes by reference: the buffer is mapped in a pipe with vmsplice(), spliced in the
+//device file, spliced out of it in another pipe and spliced to /dev/null. It returns the throughput in MB/s
+static double splice_rate(int fd, char *buffer, size_t size, int iterations) {
+	struct iovec iov = { .iov_base = buffer, .iov_len = size };
+	int in_pipe[2], out_pipe[2];
+	double start, elapsed;
+	int null_fd;
+	int i;
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd == -1 || pipe(in_pipe) == -1 || pipe(out_pipe) == -1) {
+		printf("Error in open() or pipe()\n");
+		exit(EXIT_FAILURE);
+	}
+
+	//Each pipe needs a buffer for each page of the message
+	if (fcntl(in_pipe[1], F_SETPIPE_SZ, size) == -1 || fcntl(out_pipe[1], F_SETPIPE_SZ, size) == -1) {
+		printf("Error in fcntl(): raise /proc/sys/fs/pipe-max-size to %zu\n", size);
+		exit(EXIT_FAILURE);
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (vmsplice(in_pipe[1], &iov, 1, 0) != (ssize_t)size || splice(in_pipe[0], NULL, fd, NULL, size, 0) != (ssize_t)size ||
+				splice(fd, NULL, out_pipe[1], NULL, size, 0) != (ssize_t)size || splice(out_pipe[0], NULL, null_fd, NULL, size, 0) != (ssize_t)size) {
+			printf("Error in vmsplice() or splice() of %zu bytes\n", size);
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = now() - start;
+
+	close(in_pipe[0]);
+	close(in_pipe[1]);
+	close(out_pipe[0]);
+	close(out_pipe[1]);
+	close(null_fd);
+	return size * (double)iterations / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]){
+	char *buffer;
+	size_t size;
+	int fd, iterations;
+
+	if (argc < 2 || argc > 3) {
+		printf("Usage: sudo ./large_bench <filename> [iterations]\n");
+		printf("The module has to be installed with max_message_size and max_storage_size of at least %d bytes\n", MAX_SIZE);
+		return(EXIT_FAILURE);
+	}
+
+	iterations = argc > 2 ? strtol(argv[2], NULL, 0) : DEFAULT_ITERATIONS;
+	if (iterations <= 0) {
+		printf("Invalid parameters\n");
+		return(EXIT_FAILURE);
+	}
+
+	fd = open(argv[1], O_RDWR);
+	buffer = aligned_alloc(4096, MAX_SIZE);
+	if (fd == -1 || buffer == NULL) {
+		printf("Error in open() or aligned_alloc()\n");
+		return(EXIT_FAILURE);
+	}
+	memset(buffer, 'x', MAX_SIZE);
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+		printf("size %zu copy_mb_per_sec %.0f", size, copy_rate(fd, buffer, size, iterations));
+		printf(" splice_mb_per_sec %.0f\n", splice_rate(fd, buffer, size, iterations));
+	}
+
+	free(buffer);
+	close(fd);
+	return(EXIT_SUCCESS);
+}
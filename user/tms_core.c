@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tms_core.h"
+
+//Timers of the shim. They are kept in a single list, sorted by expiry
+
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(armed_timers);
+
+void shim_timer_arm(struct shim_timer *timer, ktime_t expires) {
+	struct list_head *position;
+
+	pthread_mutex_lock(&timers_lock);
+	if (!list_empty(&(timer->link)))
+		list_del(&(timer->link));
+	timer->expires = expires;
+	for (position = armed_timers.prev; position != &armed_timers; position = position->prev) {
+		if (list_entry(position, struct shim_timer, link)->expires <= expires)
+			break;
+	}
+	list_add(&(timer->link), position);
+	pthread_mutex_unlock(&timers_lock);
+}
+
+bool shim_timer_disarm(struct shim_timer *timer) {
+	bool armed;
+
+	pthread_mutex_lock(&timers_lock);
+	armed = !list_empty(&(timer->link));
+	if (armed)
+		list_del_init(&(timer->link));
+	pthread_mutex_unlock(&timers_lock);
+
+	return armed;
+}
+
+int shim_run_timers(void) {
+	struct shim_timer *timer;
+	ktime_t now = ktime_get();
+	int count = 0;
+
+	while (true) {
+		pthread_mutex_lock(&timers_lock);
+		if (list_empty(&armed_timers) || list_first_entry(&armed_timers, struct shim_timer, link)->expires > now) {
+			pthread_mutex_unlock(&timers_lock);
+			return count;
+		}
+		timer = list_first_entry(&armed_timers, struct shim_timer, link);
+		list_del_init(&(timer->link));
+		pthread_mutex_unlock(&timers_lock);
+
+		timer->run(timer);
+		count++;
+	}
+}
+
+void shim_run_timer_list(struct shim_timer *timer) {
+	struct timer_list *timer_list = container_of(timer, struct timer_list, base);
+
+	timer_list->function(timer_list);
+}
+
+void shim_run_hrtimer(struct shim_timer *timer) {
+	struct hrtimer *hrtimer = container_of(timer, struct hrtimer, base);
+
+	hrtimer->function(hrtimer);
+}
+
+//Queue
+
+void tms_queue_init(struct tms_queue *queue, long max_storage_size) {
+	int i;
+
+	spin_lock_init(&(queue->head_lock));
+	INIT_LIST_HEAD(&(queue->messages));
+	queue->message_to_read = NULL;
+	spin_lock_init(&(queue->tail_lock));
+	INIT_LIST_HEAD(&(queue->incoming));
+	atomic_long_set(&(queue->storage_size), 0);
+	atomic_set(&(queue->available_readings), 0);
+	queue->max_storage_size = max_storage_size;
+	spin_lock_init(&(queue->pending_lock));
+	INIT_LIST_HEAD(&(queue->pending_writes));
+	for (i = 0; i < (1 << TMS_HANDLE_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&(queue->handle_index[i]));
+	queue->next_handle = 0;
+}
+
+void tms_queue_destroy(struct tms_queue *queue) {
+	struct tms_message *message;
+	struct tms_message *temp_message;
+
+	tms_revoke(queue);
+	core_drain_incoming(&(queue->messages), &(queue->incoming), &(queue->tail_lock));
+	list_for_each_entry_safe(message, temp_message, &(queue->messages), list) {
+		list_del(&(message->list));
+		free(message);
+	}
+}
+
+static struct tms_message *alloc_message(struct tms_queue *queue, const void *buffer, size_t len) {
+	struct tms_message *message;
+
+	if (!core_reserve_storage(&(queue->storage_size), queue->max_storage_size, len))
+		return NULL;
+
+	message = malloc(sizeof(struct tms_message) + len);
+	if (message == NULL) {
+		core_release_storage(&(queue->storage_size), len);
+		return NULL;
+	}
+	message->size = len;
+	memcpy(message->text, buffer, len);
+	return message;
+}
+
+static void post_message(struct tms_queue *queue, struct tms_message *message) {
+	LIST_HEAD(batch);
+
+	list_add(&(message->list), &batch);
+	core_post_tail(&(queue->tail_lock), &(queue->incoming), &(queue->available_readings), &batch, 1, NULL, NULL);
+}
+
+ssize_t tms_send(struct tms_queue *queue, const void *buffer, size_t len) {
+	struct tms_message *message = alloc_message(queue, buffer, len);
+
+	if (message == NULL)
+		return -EAGAIN;
+	post_message(queue, message);
+	return len;
+}
+
+ssize_t tms_receive(struct tms_queue *queue, void *buffer, size_t len) {
+	struct tms_message *message;
+	LIST_HEAD(batch);
+
+	if (!core_claim_reading(&(queue->available_readings)))
+		return -EAGAIN;
+
+	spin_lock(&(queue->head_lock));
+	message = list_entry(core_take_oldest(&(queue->messages), &(queue->incoming), &(queue->tail_lock),
+				&(queue->message_to_read), &batch), struct tms_message, list);
+	spin_unlock(&(queue->head_lock));
+
+	if (len > message->size)
+		len = message->size;
+	memcpy(buffer, message->text, len);
+	core_release_storage(&(queue->storage_size), message->size);
+	free(message);
+	return len;
+}
+
+//pending_write_hrtimer_expired is run when the timer of a delayed message expires: the message is no longer revocable and it is
+//posted
+static enum hrtimer_restart pending_write_hrtimer_expired(struct hrtimer *hrtimer) {
+	struct tms_pending_write *pending_write = container_of(hrtimer, struct tms_pending_write, pending.hrtimer);
+	struct tms_queue *queue = pending_write->queue;
+
+	core_expire_pending(&(pending_write->pending), &(queue->pending_lock));
+	post_message(queue, pending_write->message);
+	free(pending_write);
+	return HRTIMER_NORESTART;
+}
+
+ssize_t tms_send_delayed(struct tms_queue *queue, const void *buffer, size_t len, ktime_t delay) {
+	struct tms_pending_write *pending_write;
+	u64 handle;
+
+	pending_write = malloc(sizeof(struct tms_pending_write));
+	if (pending_write == NULL)
+		return -ENOMEM;
+	pending_write->message = alloc_message(queue, buffer, len);
+	if (pending_write->message == NULL) {
+		free(pending_write);
+		return -EAGAIN;
+	}
+	pending_write->queue = queue;
+	pending_write->pending.is_high_resolution = true;
+
+	spin_lock(&(queue->pending_lock));
+	pending_write->pending.handle = handle = core_next_handle(&(queue->next_handle));
+	core_link_pending(&(pending_write->pending), &(queue->pending_writes),
+		&(queue->handle_index[hash_64(handle, TMS_HANDLE_HASH_BITS)]));
+	hrtimer_setup(&(pending_write->pending.hrtimer), pending_write_hrtimer_expired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	hrtimer_start(&(pending_write->pending.hrtimer), ktime_get() + delay, HRTIMER_MODE_ABS_SOFT);
+	spin_unlock(&(queue->pending_lock));
+
+	return handle;
+}
+
+//drop_pending_write gives back the storage of a canceled pending write and frees it. It is called with the lock of the pending
+//writes held
+static void drop_pending_write(struct core_pending *pending, void *data) {
+	struct tms_pending_write *pending_write = container_of(pending, struct tms_pending_write, pending);
+	struct tms_queue *queue = data;
+
+	core_release_storage(&(queue->storage_size), pending_write->message->size);
+	free(pending_write->message);
+	free(pending_write);
+}
+
+int tms_cancel(struct tms_queue *queue, u64 handle) {
+	struct core_pending *pending;
+	bool canceled = false;
+
+	spin_lock(&(queue->pending_lock));
+	pending = core_find_pending(&(queue->handle_index[hash_64(handle, TMS_HANDLE_HASH_BITS)]), handle);
+	if (pending != NULL && core_cancel_pending(pending)) {
+		drop_pending_write(pending, queue);
+		canceled = true;
+	}
+	spin_unlock(&(queue->pending_lock));
+
+	return canceled ? 0 : -ENOENT;
+}
+
+int tms_revoke(struct tms_queue *queue) {
+	int canceled_writes;
+
+	spin_lock(&(queue->pending_lock));
+	canceled_writes = core_revoke_pending(&(queue->pending_writes), drop_pending_write, queue);
+	spin_unlock(&(queue->pending_lock));
+
+	return canceled_writes;
+}
@@ -0,0 +1,65 @@
+#ifndef _TMS_CORE_H
+#define _TMS_CORE_H
+
+//Userspace build of the message queue of a device file, on top of timed_messaging_core.h: a single FIFO queue with the list
+//engine, its storage accounting, the delayed messages with their handles and their revoke. The tail post, the take of the oldest
+//message and the link, cancel, expiry and revoke of the pending writes are the functions of the core that the module calls, so
+//the tests and the benchmarks exercise the same code. Tags, priorities, orderings and blocking operations are not included, and
+//the delayed messages are posted when shim_run_timers() finds their timers expired
+
+#include "kernel_shim.h"
+#include "../timed_messaging_core.h"
+
+#define TMS_HANDLE_HASH_BITS 10
+
+struct tms_message {
+	struct list_head list;
+	size_t size;
+	char text[];
+};
+
+struct tms_pending_write {
+	struct core_pending pending;			//link in the pending writes of the queue, timer and handle
+	struct tms_queue *queue;				//queue target for writing
+	struct tms_message *message;			//the message to post
+};
+
+struct tms_queue {
+	spinlock_t head_lock;					//head lock of the message list, taken by the readers
+	struct list_head messages;				//messages posted on the queue, the newest at the head
+	struct list_head *message_to_read;		//pointer to next message to read
+	spinlock_t tail_lock;					//tail lock of the message list, taken by the writers
+	struct list_head incoming;				//messages posted under tail_lock and not yet moved to messages
+	atomic_long_t storage_size;				//bytes used to store messages
+	atomic_t available_readings;			//number of available readings
+	long max_storage_size;					//bytes of storage of the queue
+	spinlock_t pending_lock;				//to synchronize the pending writes and the handle index
+	struct list_head pending_writes;		//delayed messages not posted yet
+	struct hlist_head handle_index[1 << TMS_HANDLE_HASH_BITS];	//buckets of the pending writes by hash of the handle
+	u64 next_handle;						//handle of the next delayed message
+};
+
+void tms_queue_init(struct tms_queue *queue, long max_storage_size);
+
+//tms_queue_destroy frees the messages of a queue and revokes its delayed messages
+void tms_queue_destroy(struct tms_queue *queue);
+
+//tms_send posts a message of len bytes. It returns len, or -EAGAIN if the storage is full
+ssize_t tms_send(struct tms_queue *queue, const void *buffer, size_t len);
+
+//tms_receive copies the oldest message in buffer, truncated to len bytes, and returns the number of copied bytes, -EAGAIN if
+//there are no messages
+ssize_t tms_receive(struct tms_queue *queue, void *buffer, size_t len);
+
+//tms_send_delayed posts a message of len bytes delay nanoseconds from now. It returns the handle of the message, -EAGAIN if the
+//storage is full or -ENOMEM
+ssize_t tms_send_delayed(struct tms_queue *queue, const void *buffer, size_t len, ktime_t delay);
+
+//tms_cancel cancels the delayed message with a handle. It returns 0, or -ENOENT if the message has already been posted
+int tms_cancel(struct tms_queue *queue, u64 handle);
+
+//tms_revoke cancels all the delayed messages of the queue that have not been posted yet and returns their number. It calls
+//core_revoke_pending as REVOKE_DELAYED_MESSAGES and flush() do in the module
+int tms_revoke(struct tms_queue *queue);
+
+#endif